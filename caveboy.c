@@ -14,8 +14,12 @@
 #include <math.h>
 #include <errno.h>
 #include <getopt.h>
+#include <sched.h>
 
 #include "perceptron.h"	
+#include "simd.h"
+#include "threadpool.h"
+#include "queue.h"
 
 /*  Handy macros */
 #ifndef printerr
@@ -37,7 +41,7 @@
  #define TRUE !FALSE
 #endif
 
-const char * usage = "Usage: %s PATDIR [-irhoam N] [-wez FILE] [-vnt]\n"\
+const char * usage = "Usage: %s PATDIR [-irhoambBjS N] [-wez FILE] [-sA NAME] [-vntqdPR]\n"\
 					  "\t-i N\tInput neurons [from pattern]\n"\
 					  "\t-h N\tHidden layer neurons [=input]\n"\
 					  "\t-o N\tOutput neurons [from pattern]\n"\
@@ -45,15 +49,34 @@ const char * usage = "Usage: %s PATDIR [-irhoam N] [-wez FILE] [-vnt]\n"\
 					  "\t-m N\tMax epoch [2000]\n"\
 					  "\t-f N\tVideo fps [10]\n"\
 					  "\t-r N\tNeuron radio [0.1]\n"\
+					  "\t-b N\tPatterns per testing batch [32]\n"\
+					  "\t-B N\tPatterns per training weight update [1]\n"\
+					  "\t-j N\tThreads, 0 for one per CPU within the affinity mask\n"\
+					  "\t\tand cgroup CPU quota. Online training with more\n"\
+					  "\t\tthan one is asynchronous [1]\n"\
+					  "\t-S N\tRandom seed for the initial weights [1]\n"\
+					  "\t-s MODE\tTransition function: exact, poly or table [exact]\n"\
+					  "\t-A NAME\tTransition function: bsigmoid, logistic, tanh or relu\n"\
+					  "\t\t(the same for training and testing) [bsigmoid]\n"\
 					  "\t-e FILE\tLog training ECM [error.dat]\n"\
 					  "\t-w FILE\tWeights file (wil be written if training) [weights.dat]\n"\
 					  "\t-z FILE\tSave/Read training info [tinfo.dat]\n"\
 					  "\t-n\tNormalize values [NO]\n"\
 					  "\t-t\tTraining [NO]\n"\
+					  "\t-q\tAlso test with the int8 quantized net [NO]\n"\
+					  "\t-d\tDeterministic training: same weights and errors for\n"\
+					  "\t\tthe same seed with any number of threads, on the same\n"\
+					  "\t\tkernels (see CAVEBOY_SIMD). Slower than -j alone: each\n"\
+					  "\t\tonline pattern is split among threads, which wait for\n"\
+					  "\t\teach other twice per pattern (nets under 65536 input\n"\
+					  "\t\tweights run on one thread), and batches are split in\n"\
+					  "\t\t8 shards, so no more than 8 threads compute them [NO]\n"\
+					  "\t-P\tPin threads to CPUs, also with CAVEBOY_PIN=1 [NO]\n"\
+					  "\t-R\tTest with a copy of the net on every NUMA node [NO]\n"\
 					  "\t-v\tVerbose mode [NO]\n";
 
-int training(perceptron per, patternset pset, int max_epoch, double alpha,
-		char * weights_path, char * tinfo_path, char * error_path){
+int training(perceptron per, patternset pset, threadpool pool, int max_epoch, double alpha,
+		int batch, int deterministic, char * weights_path, char * tinfo_path, char * error_path){
 	FILE * error_file = NULL;
 
 	/* Save obtained training info  */
@@ -64,8 +87,26 @@ int training(perceptron per, patternset pset, int max_epoch, double alpha,
 			printerr("ERROR: Couldn't open file %s; error %s\n",
 					error_path, strerror(errno));
 
-	/* Train and print epoch info to outfile */
-	perceptron_trainingprint(per, pset, alpha, 0, max_epoch, error_file);
+	/* Train and print epoch info to outfile.
+	 * Online updates unless a batch size was given.
+	 * With more than one thread, batches are split among them, and online
+	 * updates are made by all of them at once with no locks.
+	 * Deterministic training always splits batches in the same shards, and
+	 * splits each online pattern among threads instead, so the results
+	 * don't depend on the threads or on their timing. */
+	if( batch > 1 && deterministic )
+		perceptron_trainingprint_parallel(per, pset, alpha, 0, max_epoch, batch,
+				PERCEPTRON_SHARDS, pool, error_file);
+	else if( batch > 1 && threadpool_size(pool) > 1 )
+		perceptron_trainingprint_parallel(per, pset, alpha, 0, max_epoch, batch, 0, pool, error_file);
+	else if( batch > 1 )
+		perceptron_trainingprint_batch(per, pset, alpha, 0, max_epoch, batch, error_file);
+	else if( threadpool_size(pool) > 1 && deterministic )
+		perceptron_trainingprint_slices(per, pset, alpha, 0, max_epoch, pool, error_file);
+	else if( threadpool_size(pool) > 1 )
+		perceptron_trainingprint_hogwild(per, pset, alpha, 0, max_epoch, pool, error_file);
+	else
+		perceptron_trainingprint(per, pset, alpha, 0, max_epoch, error_file);
 
 	/* Save weights  */
 	perceptron_printpath(per, weights_path);
@@ -80,77 +121,467 @@ int training(perceptron per, patternset pset, int max_epoch, double alpha,
 	return TRUE;
 }
 
-int testing(perceptron per, patternset pset, double radio, char * weights_path, char * tinfo_path){
-	size_t pat = 0, n = 0, matches = 0;
-	int chosen = 0;
-	int * codes = NULL;
-	double min = 1.0 - radio;
+/* Finds the most excited neuron in the output layer.
+ *
+ * Undecidible (not found, -1) if:
+ * - Most excited neuron doesn't get close enough (> min)
+ * - More than 1 neuron has been activated (matches > 1).
+ */
+static int classify(const real * output, size_t no, double min){
+	size_t n = 0, matches = 0;
+	int chosen = -1;
+
+	for(n = 0; n < no; ++n){
+		if( output[n] > min ) {
+			chosen = n;
+			++matches;
+
+			/* 1 active neuron at most */
+			if( matches > 1 )
+				return -1;
+		}
+	}
+
+	return chosen;
+}
+
+/* Trained net, read while the patterns are loaded */
+typedef struct {
+	perceptron per;
+	const char * path;
+	int ok;
+} reading_job_t;
+
+static void reading_weights(void * arg, int worker){
+	reading_job_t * job = (reading_job_t *) arg;
+
+	job->ok = perceptron_readpath(&(job->per), job->path);
+}
+
+/* Batches in flight per thread when testing */
+#define TESTING_DEPTH 2
+
+/* A batch of patterns going through the testing pipeline */
+typedef struct {
+	size_t first, n;        /* First pattern and number of patterns */
+	unsigned char * bytes;  /* Raw image data (batch x size) */
+	real ** input;          /* Patterns (batch x (ni + 1)) */
+	real * input_raw;
+	real * outputs;         /* Output layer (batch x no) */
+	real * qout;            /* Output layer of the quantized net */
+	int * codes;            /* Code of every pattern */
+	int * qcodes;           /* Code of every pattern with the quantized net */
+} testing_slot_t;
+
+/* Testing work shared by all threads.
+ * Any thread decodes batches into free slots, passes the decoded ones
+ * through the net and prints the finished ones, always in pattern order.
+ * Slots go back to be free once printed, so no more than depth batches are
+ * in memory at once, whatever the number of patterns. */
+typedef struct {
+	perceptron per;
+	qperceptron qper;
+	patternset pset;
+	threadpool pool;
+	size_t batch, nbatches;
+	double min;
+
+	perceptron * replicas;  /* Copy of the net on each NUMA node, if any */
+	int * replicated;       /* Copy already made for each node, atomic */
+	int nnodes;
+
+	png_decoder_t * decoders;  /* Png decoder of each worker */
+	perceptron_batch * batches;  /* Batch scratch of each worker */
+	void ** qscratch;            /* Quantized net scratch of each worker */
+	testing_slot_t * slots;
+	size_t depth;
+	queue free;               /* Slots to decode a batch into */
+	queue decoded;            /* Slots to pass through the net */
+	testing_slot_t ** window; /* Finished slots waiting to be printed */
+
+	size_t next;       /* Next batch to decode, atomic */
+	size_t printed;    /* Batches already printed, atomic */
+	int printing;      /* A thread is printing, atomic */
+	size_t agree;      /* Patterns both nets agree on */
+	int failed;
+} testing_job_t;
+
+/* Decodes a batch of patterns into a slot */
+static void testing_decode(testing_job_t * job, testing_slot_t * slot, size_t b, int worker){
+	patternset pset = job->pset;
+	size_t i = 0;
+
+	slot->first = b * job->batch;
+	slot->n = (pset->npats - slot->first < job->batch) ? pset->npats - slot->first : job->batch;
+
+	/* Patterns that can't be read are left blank */
+	for(i = 0; i < slot->n; ++i)
+		if( patternset_decode(pset, slot->first + i, &(slot->bytes[i * pset->size]),
+					slot->input[i], &(job->decoders[worker])) == FALSE ) {
+			memset(&(slot->bytes[i * pset->size]), 0, pset->size);
+			memset(slot->input[i], 0, pset->ni * sizeof(real));
+		}
+}
+
+/* Copies the net in the first thread running on each NUMA node, so its
+ * weights are written, and placed, there */
+static void testing_replicate(void * arg, size_t begin, size_t end, int worker){
+	testing_job_t * job = (testing_job_t *) arg;
+	int node = threadpool_node(job->pool, worker);
+
+	if( node >= job->nnodes || __atomic_exchange_n(&(job->replicated[node]), 1, __ATOMIC_RELAXED) )
+		return;
+
+	if( perceptron_copy(&(job->replicas[node]), job->per) == 0 ) {
+		printerr("WARNING: Couldn't copy the net on node %d. Using the shared one.\n", node);
+		job->replicas[node] = NULL;
+	}
+}
+
+/* Classifies the patterns of a decoded slot, with the copy of the net on
+ * the node of the worker if there is one */
+static void testing_classify(testing_job_t * job, testing_slot_t * slot, int worker){
+	patternset pset = job->pset;
+	perceptron per = job->per;
+	size_t b = 0, no = job->per->n[2];
+	int node = 0;
+
+	if( job->replicas != NULL && (node = threadpool_node(job->pool, worker)) < job->nnodes &&
+			job->replicas[node] != NULL )
+		per = job->replicas[node];
+
+	if( perceptron_feedforward_batch(per, job->batches[worker], slot->input, slot->n,
+				slot->outputs) == 0 )
+		__atomic_store_n(&(job->failed), TRUE, __ATOMIC_RELAXED);
+
+	for(b = 0; b < slot->n; ++b){
+		/* Find the most excited neuron */
+		slot->codes[b] = classify(&(slot->outputs[b * no]), pset->no, job->min);
+
+		/* Classify with the quantized net too */
+		if( job->qper != NULL ) {
+			if( perceptron_feedforward_quant(job->qper, job->qscratch[worker],
+						&(slot->bytes[b * pset->size]), slot->qout) == 0 )
+				__atomic_store_n(&(job->failed), TRUE, __ATOMIC_RELAXED);
+			slot->qcodes[b] = classify(slot->qout, pset->no, job->min);
+		}
+	}
+}
+
+/* Prints the output of every finished batch next in order, unless another
+ * thread is already doing it. */
+static void testing_print(testing_job_t * job){
+	patternset pset = job->pset;
+	testing_slot_t * slot = NULL;
+	size_t b = 0, pat = 0, n = 0, no = job->per->n[2];
+	real * output = NULL;
+	int idle = 0;
+
+	for(;;) {
+		if( !__atomic_compare_exchange_n(&(job->printing), &idle, 1, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED) )
+			return;
+
+		for(b = job->printed; b < job->nbatches &&
+				(slot = __atomic_load_n(&(job->window[b % job->depth]), __ATOMIC_ACQUIRE)) != NULL; ++b){
+			for(pat = 0; pat < slot->n; ++pat){
+				output = &(slot->outputs[pat * no]);
+
+				printf("Pattern %zd ", slot->first + pat);
+				printf("Raw output layer:\n");
+				for(n = 0; n < pset->no; ++n)
+					printf("%f\t", output[n]);
+
+				printf("\nPattern %zd ", slot->first + pat);
+				if( slot->codes[pat] != -1 )
+					printf("recognized as %s (%d)\n",
+							pset->names[slot->codes[pat]], slot->codes[pat]);
+				else
+					printf("is undecidible\n");
+
+				/* Compare with the quantized net classification */
+				if( job->qper != NULL )
+					job->agree += (slot->qcodes[pat] == slot->codes[pat]);
+			}
+
+			/* Give the slot back to be decoded into */
+			__atomic_store_n(&(job->window[b % job->depth]), NULL, __ATOMIC_RELAXED);
+			queue_push(job->free, slot);
+			__atomic_store_n(&(job->printed), b + 1, __ATOMIC_RELEASE);
+		}
+
+		__atomic_store_n(&(job->printing), 0, __ATOMIC_RELEASE);
+
+		/* The next one may have finished right before leaving */
+		if( b >= job->nbatches ||
+				__atomic_load_n(&(job->window[b % job->depth]), __ATOMIC_ACQUIRE) == NULL )
+			return;
+	}
+}
+
+/* Each thread takes whatever there is to do until all batches are printed.
+ * Classifying comes first, so decoded batches don't pile up. */
+static void testing_pipeline(void * arg, size_t begin, size_t end, int worker){
+	testing_job_t * job = (testing_job_t *) arg;
+	testing_slot_t * slot = NULL;
+	void * item = NULL;
+	size_t b = 0;
+
+	while( __atomic_load_n(&(job->printed), __ATOMIC_ACQUIRE) < job->nbatches ){
+		if( queue_pop(job->decoded, &item) ) {
+			slot = (testing_slot_t *) item;
+			testing_classify(job, slot, worker);
+			__atomic_store_n(&(job->window[(slot->first / job->batch) % job->depth]),
+					slot, __ATOMIC_RELEASE);
+			testing_print(job);
+
+		} else if( queue_pop(job->free, &item) ) {
+			/* Slots are taken before batches, so the batches in flight are
+			 * always the next ones to be printed */
+			if( (b = __atomic_fetch_add(&(job->next), 1, __ATOMIC_RELAXED)) < job->nbatches ) {
+				testing_decode(job, (testing_slot_t *) item, b, worker);
+				queue_push(job->decoded, item);
+			} else {
+				queue_push(job->free, item);
+				sched_yield();
+			}
+
+		} else {
+			sched_yield();
+		}
+	}
+}
+
+/* Allocs the slots and queues of the pipeline */
+static int testing_job_init(testing_job_t * job, size_t depth){
+	patternset pset = job->pset;
+	testing_slot_t * slot = NULL;
+	size_t s = 0, i = 0, batch = job->batch, no = job->per->n[2];
+	int t = 0, nthreads = threadpool_size(job->pool);
+
+	if( (job->decoders = (png_decoder_t *) malloc (nthreads * sizeof(png_decoder_t))) == NULL )
+		return FALSE;
+	for(t = 0; t < nthreads; ++t)
+		png_decoder_init(&(job->decoders[t]));
+
+	/* Replicas have the same layers, so they share the scratch too */
+	if( (job->batches = (perceptron_batch *) calloc (nthreads, sizeof(perceptron_batch))) == NULL )
+		return FALSE;
+	for(t = 0; t < nthreads; ++t)
+		if( perceptron_batch_create(job->per, &(job->batches[t]), batch) == 0 )
+			return FALSE;
+
+	if( job->qper != NULL ) {
+		if( (job->qscratch = (void **) calloc (nthreads, sizeof(void *))) == NULL )
+			return FALSE;
+		for(t = 0; t < nthreads; ++t)
+			if( (job->qscratch[t] = malloc (perceptron_quant_scratch(job->qper))) == NULL )
+				return FALSE;
+	}
+
+	job->depth = depth;
+	job->slots = (testing_slot_t *) calloc (depth, sizeof(testing_slot_t));
+	job->window = (testing_slot_t **) calloc (depth, sizeof(testing_slot_t *));
+	if( job->slots == NULL || job->window == NULL ||
+			queue_create(&(job->free), depth) == 0 || queue_create(&(job->decoded), depth) == 0 )
+		return FALSE;
+
+	for(s = 0; s < depth; ++s){
+		slot = &(job->slots[s]);
+		slot->bytes = (unsigned char *) malloc (batch * pset->size);
+		slot->input = (real **) malloc (sizeof(real *) * batch);
+		slot->input_raw = (real *) malloc (sizeof(real) * batch * (pset->ni + 1));
+		slot->outputs = (real *) malloc (sizeof(real) * batch * no);
+		slot->qout = (real *) malloc (sizeof(real) * no);
+		slot->codes = (int *) malloc (sizeof(int) * batch);
+		slot->qcodes = (int *) malloc (sizeof(int) * batch);
+		if( slot->bytes == NULL || slot->input == NULL || slot->input_raw == NULL ||
+				slot->outputs == NULL || slot->qout == NULL || slot->codes == NULL ||
+				slot->qcodes == NULL )
+			return FALSE;
+
+		/* Associate each input row and set its bias */
+		for(i = 0; i < batch; ++i){
+			slot->input[i] = &(slot->input_raw[i * (pset->ni + 1)]);
+			slot->input[i][pset->ni] = 1;
+		}
+
+		queue_push(job->free, slot);
+	}
+
+	return TRUE;
+}
+
+static void testing_job_free(testing_job_t * job){
+	size_t s = 0;
+	int node = 0, t = 0;
+
+	if( job->decoders != NULL )
+		for(t = 0; t < threadpool_size(job->pool); ++t)
+			png_decoder_free(&(job->decoders[t]));
+	free(job->decoders);
+
+	if( job->batches != NULL )
+		for(t = 0; t < threadpool_size(job->pool); ++t)
+			if( job->batches[t] != NULL )
+				perceptron_batch_free(&(job->batches[t]));
+	free(job->batches);
+
+	if( job->qscratch != NULL )
+		for(t = 0; t < threadpool_size(job->pool); ++t)
+			free(job->qscratch[t]);
+	free(job->qscratch);
+
+	if( job->replicas != NULL )
+		for(node = 0; node < job->nnodes; ++node)
+			if( job->replicas[node] != NULL )
+				perceptron_free(&(job->replicas[node]));
+	free(job->replicas);
+	free(job->replicated);
+
+	if( job->slots != NULL )
+		for(s = 0; s < job->depth; ++s){
+			free(job->slots[s].bytes);
+			free(job->slots[s].input);
+			free(job->slots[s].input_raw);
+			free(job->slots[s].outputs);
+			free(job->slots[s].qout);
+			free(job->slots[s].codes);
+			free(job->slots[s].qcodes);
+		}
+
+	if( job->free != NULL )
+		queue_free(&(job->free));
+	if( job->decoded != NULL )
+		queue_free(&(job->decoded));
+
+	free(job->slots);
+	free(job->window);
+}
+
+int testing(perceptron per, patternset pset, threadpool pool, double radio, int batch,
+		int quantized, int nnodes, char * tinfo_path){
+	testing_job_t job;
+	int nthreads = threadpool_size(pool);
 
 	/* Testing phase uses an already trained net to try to clasificate
 	 * new unknown patterns.
 	 *
 	 * 1. Recuperate patterns code-name associations from training.
-	 * 2. Recuperate trained perceptron weights.
-	 * 3. Pass each pattern through the net and save the output.
-	 * 4. Calculate stats.
+	 * 2. Decode each batch of patterns, pass it through the trained net and
+	 *    print the output in order, all at once in every thread.
+	 * 3. Calculate stats.
 	 */
 
 	/* Recuperate training patterns info. */
 		if( patternset_read_traininginfo(pset, tinfo_path) == FALSE)
 			return FALSE;
 
-		/* Recuperate trained net. Read weights. */
-		if( perceptron_readpath(&per, weights_path) == FALSE )
+		if( pset->npats <= 0 )
 			return FALSE;
 
-		if( pset->npats <= 0 )
+		memset(&job, 0, sizeof(job));
+		job.per = per;
+		job.pset = pset;
+		job.pool = pool;
+		job.batch = batch;
+		job.nbatches = (pset->npats + batch - 1) / batch;
+		job.min = 1.0 - radio;
+
+		/* Quantize the trained net to compare with it */
+		if( quantized && perceptron_quantize(per, pset->bpp, &(job.qper)) == 0 ) {
+			printerr("WARNING: Couldn't quantize the net. Testing without it.\n");
+			job.qper = NULL;
+		}
+
+		/* Space for a few batches per thread */
+		if( testing_job_init(&job, TESTING_DEPTH * nthreads) == FALSE ){
+			printerr("ERROR: Out of memory for testing batches.\n");
+			testing_job_free(&job);
+			if( job.qper != NULL )
+				perceptron_quant_free(&(job.qper));
 			return FALSE;
+		}
 
-		/* Alloc space for all patterns output */
-		codes = (int *) malloc (sizeof(int) * pset->npats);
-
-		/* Use trained net per each input pattern
-		 * and put the output in a vector */
-		for(pat = 0; pat < pset->npats; ++pat){
-			perceptron_feedforward(per, pset->input[pat]);
-
-			/* Find the most excited neuron
-			 *
-			 * Undecidible (not found, -1) if:
-			 * - Most excited neuron doesn't get close enough (> min)
-			 * - More than 1 neuron has been activated (matches > 1).
-			 */
-			matches = 0;
-			chosen = -1;
-			for(n = 0; n < pset->no; ++n){
-				if( per->net[2][n] > min ) {
-					chosen = n;
-					++matches;
-
-					/* 1 active neuron at most */
-					if( matches > 1 ) {
-						chosen = -1;
-						break;
-					}
-				}
-			}
+		/* Copy the net on every node with threads, to read it locally */
+		if( nnodes > 1 ) {
+			job.nnodes = nnodes;
+			job.replicas = (perceptron *) calloc (nnodes, sizeof(perceptron));
+			job.replicated = (int *) calloc (nnodes, sizeof(int));
+			if( job.replicas != NULL && job.replicated != NULL )
+				threadpool_static(pool, nthreads, testing_replicate, &job);
+			else
+				printerr("WARNING: Couldn't copy the net on every node. Using the shared one.\n");
+		}
 
-			codes[pat] = chosen;
+		threadpool_for(pool, nthreads, 1, testing_pipeline, &job);
 
-			printf("Pattern %zd ", pat);
-			printf("Raw output layer:\n");
-			for(n = 0; n < pset->no; ++n)
-				printf("%f\t", per->net[2][n]);
+		if( job.failed )
+			printerr("ERROR: Out of memory while testing. Results are not complete.\n");
 
-			printf("\nPattern %zd ", pat);
-			if( codes[pat] != -1 )
-				printf("recognized as %s (%d)\n",
-						pset->names[codes[pat]], codes[pat]);
-			else
-				printf("is undecidible\n");
+		if( job.qper != NULL ) {
+			printf("INFO: Quantized net agreement %zd/%zd (%.2f%%)\n",
+					job.agree, pset->npats, 100.0 * job.agree / pset->npats);
+			perceptron_quant_free(&(job.qper));
 		}
 
-		return TRUE;
+		testing_job_free(&job);
+
+		return !job.failed;
+}
+
+/* NUMA node of every thread */
+typedef struct {
+	threadpool pool;
+	int * nodes;
+} layout_job_t;
+
+static void layout_nodes(void * arg, size_t begin, size_t end, int worker){
+	layout_job_t * job = (layout_job_t *) arg;
+
+	job->nodes[worker] = threadpool_node(job->pool, worker);
+}
+
+/* Prints the threads on each NUMA node, the training patterns they decoded
+ * and the copies of the net they test with */
+static void layout_print(threadpool pool, patternset pset, int nnodes, int do_training, int replicate){
+	layout_job_t job;
+	int node = 0, worker = 0, nthreads = threadpool_size(pool), found = 0;
+	size_t begin = 0, end = 0, npats = 0,
+		   patsize = (pset->ni + 1) * sizeof(real) + pset->size;
+
+	job.pool = pool;
+	if( (job.nodes = (int *) calloc (nthreads, sizeof(int))) == NULL )
+		return;
+
+	threadpool_static(pool, nthreads, layout_nodes, &job);
+
+	printf("INFO: NUMA nodes: %d%s\n", nnodes,
+			threadpool_core(pool, 0) == -1 ? ", threads not pinned, may move" : "");
+
+	for(node = 0; node < nnodes; ++node) {
+		npats = 0;
+		found = 0;
+		for(worker = 0; worker < nthreads; ++worker)
+			if( job.nodes[worker] == node ) {
+				if( !found++ )
+					printf("INFO: Node %d: threads", node);
+				printf(" %d", worker);
+				threadpool_static_range(pool, pset->npats, worker, &begin, &end);
+				npats += end - begin;
+			}
+
+		if( !found )
+			continue;
+
+		if( do_training )
+			printf(", %zd patterns (%.1f MB)", npats, (double) npats * patsize / (1 << 20));
+		if( !do_training && replicate && nnodes > 1 )
+			printf(", copy of the net");
+		printf("\n");
+	}
+
+	free(job.nodes);
 }
 
 int main(int argc, char * argv[] ) {
@@ -158,22 +589,34 @@ int main(int argc, char * argv[] ) {
 		    radio = 0.1;
 
 	int nin = 1, nh = 1, nout = 1,
-		max_epoch = 2000, fps = 10,
+		max_epoch = 2000, fps = 10, batch = 32, train_batch = 1, threads = 1,
+		seed = 1, worker = 0,
 		verbose = FALSE,
+		deterministic = FALSE,
+		pin = FALSE,
+		replicate = FALSE,
 		do_training = FALSE,
+		quantized = FALSE,
 		normalize = FALSE;
 
 	char c = 0,
 		 * dir_path = NULL,
+		 * mode = "exact",
+		 * activation = "bsigmoid",
 		 * errorlog_path = "error.dat",
 		 * weights_path = "weights.dat",
 		 * traininginfo_path = "tinfo.dat";
 
 	perceptron per = NULL;
+	perceptron_activation_t act = PERCEPTRON_BSIGMOID;
 	patternset pset = NULL;
+	threadpool pool = NULL;
+	threadpool_group group = NULL;
+	threadpool_topology_t topo;
+	reading_job_t reading;
 
 	/* Check arguments */
-	if( argc > 20 ) {
+	if( argc > 25 ) {
 		printerr("ERROR: Too many arguments\n");
 		printerr(usage, argv[0]);
 		exit(EXIT_FAILURE);
@@ -187,7 +630,7 @@ int main(int argc, char * argv[] ) {
 	/* Read arguments */
 	dir_path = argv[1];  /* Patternset directory */
 
-	while( (c = getopt(argc, argv, "vnti:h:o:a:e:m:w:")) != EOF ){
+	while( (c = getopt(argc, argv, "vntqdPRi:h:o:a:e:m:f:r:w:z:b:B:j:S:s:A:")) != EOF ){
 		switch(c) {
 			/* Args */
 			case 'i': nin = atoi(optarg); break;    /* Input neurons */
@@ -197,12 +640,22 @@ int main(int argc, char * argv[] ) {
 			case 'f': fps = atoi(optarg); break;   /* Video fps */
 			case 'a': alpha = atof(optarg); break;  /* Learning rate */
 			case 'r': radio = atof(optarg); break;  /* Neuron radio */
+			case 'b': batch = atoi(optarg); break;  /* Testing batch size */
+			case 'B': train_batch = atoi(optarg); break;  /* Training batch size */
+			case 'j': threads = atoi(optarg); break;  /* Threads */
+			case 'S': seed = atoi(optarg); break;  /* Random seed */
+			case 's': mode = optarg; break;   /* Transition function mode */
+			case 'A': activation = optarg; break;   /* Transition function */
 			case 'e': errorlog_path = optarg; break;   /* Error logging */
 			case 'w': weights_path = optarg; break;   /* Weights */
 			case 'z': traininginfo_path = optarg; break;   /* Training names */
 
 			/* Flags */
 			case 't': do_training = 1; break;      /* Train net */
+			case 'q': quantized = 1; break;     /* Test quantized net too */
+			case 'd': deterministic = 1; break;     /* Reproducible training */
+			case 'P': pin = 1; break;     /* Pin threads to CPUs */
+			case 'R': replicate = 1; break;     /* Copy the net on every node */
 			case 'v': verbose = 1; break;       /* Verbose */
 			case 'n': normalize = 1; break;     /* Previous data normalization */
 
@@ -211,19 +664,69 @@ int main(int argc, char * argv[] ) {
 	}
 
 	/* Check arguments read */
-	if( nout <= 0 || nin <= 0 || nh <= 0 || alpha <= 0 ){
-		printerr("ERROR: Invalid net sizes or learning rate\n");
+	if( nout <= 0 || nin <= 0 || nh <= 0 || alpha <= 0 || batch <= 0 || train_batch <= 0
+			|| threads < 0 ){
+		printerr("ERROR: Invalid net sizes, learning rate, batch size or threads\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Set transition function mode */
+	if( strcmp(mode, "exact") == 0 )
+		perceptron_setmode(PERCEPTRON_EXACT);
+	else if( strcmp(mode, "poly") == 0 )
+		perceptron_setmode(PERCEPTRON_POLY);
+	else if( strcmp(mode, "table") == 0 )
+		perceptron_setmode(PERCEPTRON_TABLE);
+	else {
+		printerr("ERROR: Unknown transition function mode '%s'\n", mode);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Set transition function */
+	if( strcmp(activation, "bsigmoid") == 0 )
+		act = PERCEPTRON_BSIGMOID;
+	else if( strcmp(activation, "logistic") == 0 )
+		act = PERCEPTRON_LOGISTIC;
+	else if( strcmp(activation, "tanh") == 0 )
+		act = PERCEPTRON_TANH;
+	else if( strcmp(activation, "relu") == 0 )
+		act = PERCEPTRON_RELU;
+	else {
+		printerr("ERROR: Unknown transition function '%s'\n", activation);
 		exit(EXIT_FAILURE);
 	}
 
-	/* Read training patterns.
-	 * BEWARE IO operations and lots of memory being allocated here.  */
-	if( patternset_readpath(&pset, dir_path) == FALSE ) {
+	/* Start worker threads, one per usable CPU unless told.
+	 * More than that are throttled by the cgroup quota or share CPUs. */
+	threadpool_topology(&topo);
+	if( threads > topo.ncpus )
+		printerr("WARNING: %d threads but only %d CPUs available\n", threads, topo.ncpus);
+
+	if( threadpool_create(&pool, threads, pin) == 0 || threadpool_group_create(&group, pool) == 0 ) {
+		printerr("ERROR: Couldn't start worker threads.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* When testing, read the trained net while the patterns are loaded */
+	memset(&reading, 0, sizeof(reading));
+	if( !do_training ) {
+		reading.path = weights_path;
+		threadpool_group_run(group, reading_weights, &reading);
+	}
+
+	/* Read training patterns, decoding them in all threads.
+	 * BEWARE IO operations and lots of memory being allocated here.
+	 * Test patterns are only listed, and decoded while testing.  */
+	if( (do_training ? patternset_readpath_pool(&pset, dir_path, pool) :
+				patternset_openpath(&pset, dir_path)) == FALSE ) {
 		printerr("ERROR: Failed to load patternset: '%s'\n", dir_path);
+		threadpool_group_free(&group);
 		patternset_free(&pset);
 		exit(EXIT_FAILURE);
 	}
 
+	threadpool_group_free(&group);
+
 	/* Set net sizes from patterns if not provided by user */
 	if( nin == 1)
 		nin = pset->ni;
@@ -232,19 +735,55 @@ int main(int argc, char * argv[] ) {
 	if( nh == 1 )
 		nh = pset->no * 2;
 
-	/* Create perceptron */
-	if( perceptron_create(&per, nin, nh, nout) == 0 ) {
-		printerr("ERROR: Couldn't create perceptron.\n");
-		perceptron_free(&per);
-		patternset_free(&pset);
-		exit(EXIT_FAILURE);
+	/* Create perceptron, or take the trained one */
+	if( do_training ) {
+		/* Initial weights only depend on the seed */
+		srand(seed);
+
+		if( perceptron_create(&per, nin, nh, nout) == 0 ) {
+			printerr("ERROR: Couldn't create perceptron.\n");
+			perceptron_free(&per);
+			patternset_free(&pset);
+			exit(EXIT_FAILURE);
+		}
+	} else {
+		if( reading.ok == 0 ) {
+			printerr("ERROR: Couldn't read trained perceptron from '%s'.\n", weights_path);
+			if( reading.per != NULL )
+				perceptron_free(&(reading.per));
+			patternset_free(&pset);
+			exit(EXIT_FAILURE);
+		}
+		per = reading.per;
+	}
+
+	/* Weights file doesn't keep the transition function */
+	perceptron_setactivation(per, act);
+
+	if( verbose ) {
+		printf("INFO: Using %s kernels in %s precision\n", simd.name, REAL_NAME);
+		printf("INFO: Using %d threads. CPUs: %d online, %d in affinity mask, "\
+				"quota %g (0 for none), %d usable\n", threadpool_size(pool), topo.online,
+				topo.affinity, topo.quota, topo.ncpus);
+
+		if( threadpool_core(pool, 0) != -1 ) {
+			printf("INFO: Threads pinned to CPUs");
+			for(worker = 0; worker < threadpool_size(pool); ++worker)
+				printf(" %d", threadpool_core(pool, worker));
+			printf("\n");
+		}
+
+		layout_print(pool, pset, topo.nnodes, do_training, replicate);
 	}
 
 	if( do_training )
-		training(per, pset, max_epoch, alpha, weights_path, traininginfo_path, errorlog_path);
+		training(per, pset, pool, max_epoch, alpha, train_batch, deterministic,
+				weights_path, traininginfo_path, errorlog_path);
 	else
-		testing(per, pset, radio, weights_path, traininginfo_path);
+		testing(per, pset, pool, radio, batch, quantized, replicate ? topo.nnodes : 1,
+				traininginfo_path);
 
+	threadpool_free(&pool);
 	patternset_free(&pset);
 	perceptron_free(&per);
 
@@ -0,0 +1,25 @@
+/*
+ *       Filename:  geometry.h
+ *    Description:  Fixed perceptron geometry for specialized builds
+ *         Author:  Javier Santacruz <francisco.santacruz@estudiante.uam.es>
+ *
+ *   When the geometry of the nets is known at build time, either with
+ *   make GEOMETRY="NI NH NO" or by defining it below, the layer loops are
+ *   also built with constant lengths, so the compiler can fully unroll and
+ *   vectorize them, and weight rows are aligned to 64 bytes.
+ *   Perceptrons of any other geometry use the generic code as usual.
+ */
+
+#ifndef _GEOMETRY_H_
+#define _GEOMETRY_H_
+
+/* 128x64 frames from make slice_videos, for example */
+/* #define PERCEPTRON_FIXED_NI 8192 */
+/* #define PERCEPTRON_FIXED_NH 32 */
+/* #define PERCEPTRON_FIXED_NO 4 */
+
+#if defined(PERCEPTRON_FIXED_NI) && defined(PERCEPTRON_FIXED_NH) && defined(PERCEPTRON_FIXED_NO)
+ #define PERCEPTRON_FIXED 1
+#endif
+
+#endif
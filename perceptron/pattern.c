@@ -56,7 +56,7 @@ static int png_select(const struct dirent * dire);
  * npsets: Pattern length
  * dist: Min val to consider a number as 1.
  */
-size_t pattern_to_code(double * pattern, size_t npsets, double min){
+size_t pattern_to_code(real * pattern, size_t npsets, double min){
 	size_t pos = npsets - 1;
 
 	/* Find the 1 in pattern */
@@ -65,15 +65,15 @@ size_t pattern_to_code(double * pattern, size_t npsets, double min){
 	return pos;
 }
 
-/* Convert uchar raw image data to double pattern
- * Convert each pixel in a double number
+/* Convert uchar raw image data to real pattern
+ * Convert each pixel in a real number
  *
- * pattern: Initialized double pattern vector.
+ * pattern: Initialized real pattern vector.
  * upattern: Initialized raw image data.
  * size: Total size of upattern.
  * bpp: Bytes per pixel.
  *
- * Returns the final size of pattern double vector.
+ * Returns the final size of pattern real vector.
  *         0 in case of error;
  */
 int pattern_create(pattern * pat, unsigned char * upattern, size_t size, size_t bpp) {
@@ -100,48 +100,43 @@ int pattern_create(pattern * pat, unsigned char * upattern, size_t size, size_t
 		return FALSE;
 	
 	/* Set each bpp bytes together as a single
-	 * number and convert it to double */
-	for(n = 0, b = 0; i < size; i += bpp) {
+	 * number and convert it to real */
+	for(; i < size; i += bpp) {
+		n = b = 0;  /* New pixel */
 		while( b < bpp ) {
 			/* Add each byte in its position */
-			n |= upattern[i+b] << (b * 8);
+			n |= (size_t) upattern[i+b] << (b * 8);
 			++b;  /* Next byte */
 		}
 
-		/* One double value per pixel */
-		(*pat)[i/bpp] = (double) n;
+		/* One real value per pixel */
+		(*pat)[i/bpp] = (real) n;
 	}
 
 	return size/bpp;
 }
 
-static int patternset_init(patternset pset, size_t npsets,
-		size_t npats, size_t patsize) {
-	int i = 0;
-
-	if( pset == NULL )
-		return FALSE;
-
-	/* Init values */
-	pset->npsets = npsets;
-	pset->npats = npats;
-	pset->size = pset->w = pset->h = pset->bpp = 0;
+/* Allocs the input patterns of a listed patternset */
+static int patternset_init(patternset pset) {
+	size_t i = 0, npats = pset->npats, patsize = pset->ni;
 
 	/* Alloc row pointers for each pattern */
-	pset->input = (double **) malloc (sizeof(double *) * npats);
+	pset->input = (real **) malloc (sizeof(real *) * npats);
 
 	/* Alloc contiguous input memory as a whole.
 	 * Add 1 to patsize to fit perceptron input lenght
 	 * which includes a bias fake value. */
 	patsize += 1;
-	pset->input_raw = (double *) malloc (npats * patsize * sizeof(double));
+	pset->input_raw = (real *) calloc (npats * patsize, sizeof(real));
 	if( pset->input_raw == NULL ){
 		printerr("Couldn't alloc enogh memory for patterns.\n");
 		free(pset->input);
+		pset->input = NULL;
 		return FALSE;
 	}
 
-	/* Associate each input row */
+	/* Associate each input row. Rows are left untouched, so the
+	 * thread decoding them is the first to write their memory. */
 	for(i = 0; i < npats; ++i)
 		pset->input[i] = &(pset->input_raw[i * patsize]);
 
@@ -288,11 +283,13 @@ int patternset_print_traininginfo(patternset training, const char * path){
  * @param png_paths Uninitialized list of strings by reference. To be freed by the user.
  * @param png_codes Unitialized list of codes for each png by reference.
  * @param pset_names Unitialized list of names for each code by reference.
+ * @param probe Probe the header of every png. Otherwise only the first one
+ *              is, to get the sizes, and the rest are checked when decoded.
  *
  * @return png_paths length. <= 0 on error */
 static size_t list_valid_pngs(const char * dir_path, size_t * npats, size_t * npsets,
 		size_t * w, size_t * h, size_t * b, char *** png_paths, size_t ** png_codes,
-		char *** pset_names) {
+		char *** pset_names, int probe) {
 	int ndirs = 0, listlen = 0, ndirvalidpngs = 0, ndirvalid = 0, ndirpngs = 0,
 		npngs = 0, d = 0, p = 0, ret = 0;
 	struct dirent ** dirs = NULL,
@@ -320,7 +317,7 @@ static size_t list_valid_pngs(const char * dir_path, size_t * npats, size_t * np
 	 *
 	 * 1. Open dir and list pdirs
 	 * 2. Open each pdir and list the pngs
-	 * 3. Open each png and check if its valid
+	 * 3. Probe each png header and check if its valid
 	 *    (First opened png will provide the sizes)
 	 * 4. Save valid png full path
      *
@@ -376,7 +373,7 @@ static size_t list_valid_pngs(const char * dir_path, size_t * npats, size_t * np
 		}
 
 		/* Expand png paths and codes list if neccesary */
-		if( npngs >= listlen ) {
+		if( npngs + ndirpngs > listlen ) {
 			listlen = npngs + ndirpngs;
 
 			(*png_paths) = (char **) realloc (*png_paths,
@@ -399,15 +396,19 @@ static size_t list_valid_pngs(const char * dir_path, size_t * npats, size_t * np
 			/* Get png file full path */
 			sprintf(full_png_path, "%s/%s", full_dir_path, files[p]->d_name);
 
-			/* Try to open image */
-			if( (ret = png_open_file(&image, full_png_path)) != PNG_NO_ERROR){
-				printerr("WARNING: Couldn't open PNG image: '%s': %s\n",
-						full_png_path, png_error_string(ret));
-				continue;
+			/* Read just its header, if it will not be decoded right away */
+			if( *w == -1 || probe ) {
+				if( (ret = png_probe_file(&image, full_png_path)) != PNG_NO_ERROR){
+					printerr("WARNING: Couldn't open PNG image: '%s': %s\n",
+							full_png_path, png_error_string(ret));
+					continue;
+				}
+			} else {
+				image.width = *w;
+				image.height = *h;
+				image.bpp = *b;
 			}
 
-			png_close_file(&image);
-
 			/* Get reference sizes if first time */
 			if( *w == -1 ){
 				*w = image.width;
@@ -416,7 +417,7 @@ static size_t list_valid_pngs(const char * dir_path, size_t * npats, size_t * np
 
 				printf("INFO: First PNG loaded. "\
 						"Sizes: %ldx%ld (%ld Bpp) (pattern %ld KB) (raw %ld KB)\n",
-						*w, *h, *b, (sizeof(double) * *w * *h)/1024, (*w * *h)/1024);
+						*w, *h, *b, (sizeof(real) * *w * *h)/1024, (*w * *h)/1024);
 			}
 
 
@@ -424,7 +425,7 @@ static size_t list_valid_pngs(const char * dir_path, size_t * npats, size_t * np
 			if( *w == image.width && *h == image.height && *b == image.bpp ){
 
 				/* Copy full path to the png_paths list */
-				(*png_paths)[npngs] = (char *) malloc (strlen(full_png_path));
+				(*png_paths)[npngs] = (char *) malloc (strlen(full_png_path) + 1);
 				if( (*png_paths)[npngs] == NULL ){
 					printerr("ERROR: Out of memory for png pathname.\n");
 					return 0;
@@ -454,7 +455,7 @@ static size_t list_valid_pngs(const char * dir_path, size_t * npats, size_t * np
 					full_dir_path);
 		} else {
 			/* Another valid dir.  Copy its name */
-			(*pset_names)[ndirvalid] = (char *) malloc (strlen(dirs[d]->d_name));
+			(*pset_names)[ndirvalid] = (char *) malloc (strlen(dirs[d]->d_name) + 1);
 			strcpy((*pset_names)[ndirvalid], dirs[d]->d_name);
 			++ndirvalid;
 		}
@@ -467,79 +468,225 @@ static size_t list_valid_pngs(const char * dir_path, size_t * npats, size_t * np
 	return npngs;
 }
 
-int patternset_readpath(patternset * pset_ptr, const char * dir_path) {
-	size_t npngs = 0, npats = 0, npsets = 0, i = 0, w, h, bpp;
+/* Decoding work shared by all threads */
+typedef struct {
+	patternset pset;
+	png_decoder_t * decoders;  /* Png decoder of each worker */
+	unsigned char * bytes;     /* Raw image data of each worker (size) */
+	char * valid;              /* Png of each pattern was decoded */
+} patternset_load_t;
+
+/* Decodes a png into bytes and input.
+ * @return -1 if it couldn't be opened or its sizes are not the ones of
+ *         the patternset, 0 if its data couldn't be read, 1 otherwise. */
+static int decode_png(patternset pset, size_t pat, unsigned char * bytes, pattern input,
+		png_decoder_t * decoder){
 	int ret = 0;
-	unsigned char * rawdata = NULL;
-	char ** png_paths = NULL;
-	patternset pset = NULL;
 	png_t image;
 
+	if( (ret = png_open_file_map(&image, pset->paths[pat])) != PNG_NO_ERROR) {
+		printerr("WARNING: Couldn't open PNG image: '%s': %s\n",
+				pset->paths[pat], png_error_string(ret));
+		return -1;
+	}
+
+	/* It may not have been probed, or may have changed since */
+	if( image.width != pset->w || image.height != pset->h || image.bpp != pset->bpp ) {
+		printerr("WARNING: Ignoring PNG file '%s'. It's %dx%d (%d Bpp)"\
+				" instead of %ldx%ld (%ld Bpp) as it should be.\n",
+				pset->paths[pat], image.width, image.height,
+				image.bpp, pset->w, pset->h, pset->bpp);
+		png_close_file(&image);
+		return -1;
+	}
+
+	/* Get png raw data, convert it to real and set it as
+	 * pattern input, associating it with the patternset
+	 * directory code */
+	if( (ret = (decoder != NULL) ? png_get_data_decoder(&image, decoder, bytes) :
+				png_get_data(&image, bytes)) != PNG_NO_ERROR){
+		printerr("WARNING: Couldn't get data from '%s': %s. Ignoring file.\n",
+				pset->paths[pat], png_error_string(ret));
+	} else {
+		pattern_create(&input, bytes, pset->size, pset->bpp);
+	}
+
+	png_close_file(&image);
+
+	return ret == PNG_NO_ERROR;
+}
+
+/* Decodes the pngs in [begin, end) into their place in the patternset
+ * and sets their bias */
+static void patternset_load(void * arg, size_t begin, size_t end, int worker){
+	patternset_load_t * job = (patternset_load_t *) arg;
+	patternset pset = job->pset;
+	size_t i = 0;
+
+	for(i = begin; i < end; ++i) {
+		pset->input[i][pset->ni] = 1;
+		job->valid[i] = decode_png(pset, i, &(job->bytes[worker * pset->size]), pset->input[i],
+				&(job->decoders[worker])) > 0;
+	}
+}
+
+/* Drops the patterns whose png turned out not to be valid, and the
+ * patternsets left with none, keeping the order of both.
+ * @return Number of patterns left. */
+static size_t patternset_compact(patternset pset, const char * valid, const char * dir_path){
+	size_t i = 0, j = 0, c = 0, npsets = 0, * codes = NULL;
+
+	/* New code of each patternset, npsets if it is left empty */
+	if( (codes = (size_t *) malloc (pset->npsets * sizeof(size_t))) == NULL ) {
+		printerr("ERROR: Out of memory for patternset codes.\n");
+		return 0;
+	}
+	for(c = 0; c < pset->npsets; ++c)
+		codes[c] = pset->npsets;
+
+	/* Patterns are listed by patternset, so codes keep their order */
+	for(i = 0; i < pset->npats; ++i) {
+		if( !valid[i] ) {
+			free(pset->paths[i]);
+			continue;
+		}
+
+		c = pset->codes[i];
+		if( codes[c] == pset->npsets )
+			codes[c] = npsets++;
+
+		pset->paths[j] = pset->paths[i];
+		pset->codes[j] = codes[c];
+		pset->input[j] = pset->input[i];
+		++j;
+	}
+
+	for(c = 0; c < pset->npsets; ++c) {
+		if( codes[c] == pset->npsets ) {
+			printerr("WARNING: No valid PNG file was read from '%s/%s' dir.\n",
+					dir_path, pset->names[c]);
+			free(pset->names[c]);
+		} else {
+			pset->names[codes[c]] = pset->names[c];
+		}
+	}
+
+	free(codes);
+
+	pset->npats = j;
+	pset->npsets = pset->no = npsets;
+
+	return j;
+}
+
+int patternset_decode(patternset pset, size_t pat, unsigned char * bytes, pattern input,
+		png_decoder_t * decoder){
+	return decode_png(pset, pat, bytes, input, decoder) > 0;
+}
+
+/* Lists the pngs of a patternset.
+ * @param probe Probe the header of every png, not just the first one. */
+static int patternset_list(patternset * pset_ptr, const char * dir_path, int probe) {
+	size_t npngs = 0, npats = 0, npsets = 0, w, h, bpp;
+	patternset pset = NULL;
+
 	/* Create patternset */
-	pset = (patternset) malloc (sizeof(patternset_t));
+	if( (pset = (patternset) calloc (1, sizeof(patternset_t))) == NULL )
+		return FALSE;
 
 	/* List all pngs to be read */
 	if( (npngs = list_valid_pngs(dir_path, &npats, &npsets, &w, &h, &bpp,
-					&png_paths, &pset->codes, &(pset->names))) <= 0 ) {
+					&(pset->paths), &pset->codes, &(pset->names), probe)) <= 0 ) {
 		free(pset);
-		return TRUE;
+		return FALSE;
 	}
 
-	/* Initialize patternset values */
-	patternset_init(pset, npsets, npats, w*h);
+	/* Set patternset values */
+	pset->npats = npats;
+	pset->npsets = npsets;
 	pset->w = w;
 	pset->h = h;
 	pset->bpp = bpp;
 	pset->size = w * h * bpp;
+	pset->ni = w * h;
+	pset->no = npsets;
 
-	/* Temp buffer to store raw image data
-	 * before converting it to double in the pattern */
-	rawdata = (unsigned char *) malloc (sizeof(unsigned char) * pset->size);
-
-	/* Initialize pnglite */
+	/* Initialize pnglite before any thread uses it */
 	png_init(NULL, NULL);
 
-	/* Open each valid image */
-	for(i = 0; i < npngs; ++i){
-		if( (ret = png_open_file(&image, png_paths[i])) != PNG_NO_ERROR) {
-			printerr("WARNING: Couldn't open PNG image: '%s': %s\n",
-					png_paths[i], png_error_string(ret));
-			continue;
-		}
+	*pset_ptr = pset;
 
-		/* Get png raw data, convert it to double and set it as
-		 * pattern input, associating it with the patternset
-		 * directory code */
-		if( (ret = png_get_data(&image, rawdata)) != PNG_NO_ERROR){
-			printerr("WARNING: Couldn't get data from '%s': %s. Ignoring file.\n",
-					png_paths[i], png_error_string(ret));
-		}
+	return npats;
+}
 
-		png_close_file(&image);
-	}
+int patternset_openpath(patternset * pset_ptr, const char * dir_path) {
+	return patternset_list(pset_ptr, dir_path, TRUE);
+}
+
+int patternset_readpath(patternset * pset_ptr, const char * dir_path) {
+	return patternset_readpath_pool(pset_ptr, dir_path, NULL);
+}
 
-	for(i = 0; i < npngs; ++i)
-		free(png_paths[i]);
-	free(png_paths);
+int patternset_readpath_pool(patternset * pset_ptr, const char * dir_path, threadpool pool) {
+	patternset pset = NULL;
+	patternset_load_t job;
+	int t = 0, nthreads = (pool != NULL) ? threadpool_size(pool) : 1;
 
-	printerr("Pattern loading finished. %zd patterns read from '%s'\n", npats, dir_path);
+	/* List all pngs to be read. They are checked as they are decoded,
+	 * so each one is opened only once. */
+	if( patternset_list(&pset, dir_path, FALSE) == FALSE )
+		return FALSE;
 
-	if( npats > 0 ) {
-		/* Set patternset values */
-		pset->npats = npats;
-		pset->npsets = npsets;
-		pset->ni = pset->size / pset->bpp;
-		pset->no = npsets;
-		*pset_ptr = pset;
-	} else {
-		free(pset);
+	/* Alloc all input patterns */
+	if( patternset_init(pset) == FALSE ) {
+		patternset_free(&pset);
+		return FALSE;
+	}
+
+	/* A png decoder and raw image data per thread, reused for all its
+	 * images. Only the real patterns are kept. */
+	job.valid = (char *) malloc (pset->npats);
+	job.bytes = (unsigned char *) malloc (nthreads * pset->size);
+	if( (job.decoders = (png_decoder_t *) malloc (nthreads * sizeof(png_decoder_t))) == NULL ||
+			job.valid == NULL || job.bytes == NULL ) {
+		printerr("ERROR: Out of memory for png decoders.\n");
+		free(job.decoders);
+		free(job.bytes);
+		free(job.valid);
+		patternset_free(&pset);
+		return FALSE;
+	}
+	for(t = 0; t < nthreads; ++t)
+		png_decoder_init(&(job.decoders[t]));
+
+	/* Open each valid image. Every thread decodes the same shard the
+	 * static loops of the trainers give it, so it lands on its NUMA node. */
+	job.pset = pset;
+	if( pool != NULL )
+		threadpool_static(pool, pset->npats, patternset_load, &job);
+	else
+		patternset_load(&job, 0, pset->npats, 0);
+
+	for(t = 0; t < nthreads; ++t)
+		png_decoder_free(&(job.decoders[t]));
+	free(job.decoders);
+	free(job.bytes);
+
+	/* Drop the ones that weren't pngs of the right sizes or
+	 * whose data couldn't be read */
+	if( patternset_compact(pset, job.valid, dir_path) == 0 ) {
+		printerr("ERROR: No valid PNG file was read from '%s'\n", dir_path);
+		free(job.valid);
+		patternset_free(&pset);
+		return FALSE;
 	}
+	free(job.valid);
 
-	/* Free temporals */
-	if( rawdata != NULL )
-		free(rawdata);
+	printerr("Pattern loading finished. %zd patterns read from '%s'\n", pset->npats, dir_path);
 
-	return npats;
+	*pset_ptr = pset;
+
+	return pset->npats;
 }
 
 int patternset_free(patternset * p) {
@@ -566,6 +713,14 @@ int patternset_free(patternset * p) {
 		pset->input_raw = NULL;
 	}
 
+	/* Free png paths */
+	if( pset->paths != NULL ) {
+		for(i = 0; i < pset->npats; ++i)
+			free(pset->paths[i]);
+		free(pset->paths);
+		pset->paths = NULL;
+	}
+
 	/* Free codes */
 	if( pset->codes != NULL ) {
 		free(pset->codes);
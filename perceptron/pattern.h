@@ -9,17 +9,22 @@
  *   A patternset holds a list of patterns with its associated output.
  */
 
+#include "real.h"
+#include "threadpool.h"
+#include "../pnglite/pnglite.h"
+
 typedef struct {
 	size_t npats, npsets, w, h, bpp, size, ni, no;
 	char ** names;     /* Name for each patternset. name[code] */
 
-	double ** input;   /* All input patterns */
-	double * input_raw;   /* All input patterns in contiguous memory */
+	real ** input;   /* All input patterns */
+	real * input_raw;   /* All input patterns in contiguous memory */
+	char ** paths;     /* Png file of each pattern. paths[npat] */
 	size_t * codes;    /* Code for each pattern. codes[npat] */
 } patternset_t;
 
 typedef patternset_t * patternset;
-typedef double * pattern;
+typedef real * pattern;
 
 /* Macro to know if a neuron should be active or not depending on the
  * code */
@@ -35,17 +40,54 @@ typedef double * pattern;
  */
 int patternset_readpath(patternset * pset_ptr, const char * dir_path); 
 
+/* 
+ * Reads image patterns from dir path, decoding them in parallel.
+ * Each thread decodes its threadpool_static_range() of them, so they are
+ * placed on its NUMA node. Every png is opened just once: only the first
+ * one is probed for the sizes, the rest are checked as they are decoded
+ * and dropped if they don't match.
+ * @param pset_ptr Uninitialized patternset by reference.
+ * @param dir_path Path to the root patternsets directory.
+ * @param pool Initialized thread pool, NULL to read them serially.
+ * @return != 0 on success.
+ */
+int patternset_readpath_pool(patternset * pset_ptr, const char * dir_path, threadpool pool); 
+
+/* 
+ * Lists image patterns from dir path without decoding them, so they can be
+ * decoded later one at a time with patternset_decode(). Only the header of
+ * each png is read, to check its sizes.
+ * @param pset_ptr Uninitialized patternset by reference.
+ * @param dir_path Path to the root patternsets directory.
+ * @return != 0 on success.
+ */
+int patternset_openpath(patternset * pset_ptr, const char * dir_path); 
+
+/* 
+ * Decodes a single pattern of a listed patternset.
+ * @param pset Initialized patternset.
+ * @param pat Pattern to decode.
+ * @param bytes Space for the raw image data (size bytes).
+ * @param input Space for the real pattern (ni values).
+ * @param decoder Png decoder of the calling thread, reused between
+ *                patterns. NULL to use a new one.
+ * @return 0 if something went wrong or its sizes are not the ones of the
+ *         patternset, 1 otherwise.
+ */
+int patternset_decode(patternset pset, size_t pat, unsigned char * bytes, pattern input,
+		png_decoder_t * decoder); 
+
 /* Frees an allocated patternset */
 int patternset_free(patternset * pset_ptr); 
 
-/* Convert uchar raw image data to double pattern 
- * Convert each pixel in a double number 
+/* Convert uchar raw image data to real pattern 
+ * Convert each pixel in a real number 
  *
- * @param pattern Uninitialized double pattern vector.
+ * @param pattern Uninitialized real pattern vector.
  * @param upattern Initialized raw image data.
  * @param size Total size of upattern.
  * @param bpp Bytes per pixel.
- * @return the final size of pattern double vector.
+ * @return the final size of pattern real vector.
  */
 int pattern_create(pattern * pat, unsigned char * upattern, size_t size, size_t bpp); 
 
@@ -55,7 +97,7 @@ int pattern_create(pattern * pat, unsigned char * upattern, size_t size, size_t
  * @param npsets Pattern length
  * @param min Min val to consider a number as 1.
  */
-size_t pattern_to_code(double * pattern, size_t npsets, double min);
+size_t pattern_to_code(real * pattern, size_t npsets, double min);
 
 /* Sets needed info obtained in training phase in the test patternset 
  * Basically copy the names for consulting the output net codes.
@@ -5,7 +5,11 @@
  *
  */
 
+#define _POSIX_C_SOURCE 200112L  /* Allows stdlib.h posix_memalign() */
+
 #include "perceptron.h"
+#include "simd.h"
+#include "geometry.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -34,18 +38,69 @@
  #define TRUE !FALSE
 #endif
 
-static double perceptron_mean_square_error(double * actual, size_t code, int n){
-	int i = 0;
+/* Forward declaration */
+static int perceptron_backpropagation_free_dw(const perceptron_t * per, real * ***dw_ptr);
+static int perceptron_backpropagation_free_rw(const perceptron_t * per, real * **dw_ptr);
+static int perceptron_backpropagation_free_d(const perceptron_t * per, real * **d_ptr);
+static int perceptron_backpropagation_alloc_rw(const perceptron_t * per, real * **dw_ptr);
+static int perceptron_backpropagation_alloc_dw(const perceptron_t * per, real * ***dw_ptr);
+static int perceptron_backpropagation_alloc_d(const perceptron_t * per, real * **d_ptr);
+
+/* Transition functions: (name, id, low value, f(x), f'(x) given y = f(x))
+ * Every one is expanded into a specialized layer loop and derivative loop,
+ * so there is no call per neuron. */
+#define PERCEPTRON_ACTIVATIONS(X) \
+	X(bsigmoid, PERCEPTRON_BSIGMOID, -1.0, 2.0 / (1 + exp(-x)) - 1, 0.5 * (1 + y) * (1 - y)) \
+	X(logistic, PERCEPTRON_LOGISTIC, 0.0, 1.0 / (1 + exp(-x)), y * (1 - y)) \
+	X(tanh, PERCEPTRON_TANH, -1.0, tanh(x), 1 - y * y) \
+	X(relu, PERCEPTRON_RELU, 0.0, (x > 0) ? x : 0, (y > 0) ? 1 : 0)
+
+#define PERCEPTRON_ACTIVATION_LOOPS(name, id, low, fx, fprima) \
+static void perceptron_##name##_layer(real * out, const real * in, int n){ \
+	int i; \
+	double x; \
+	for(i = 0; i < n; ++i) { \
+		x = in[i]; \
+		out[i] = fx; \
+	} \
+} \
+static void perceptron_##name##_delta(real * d, const real * out, int n){ \
+	int i; \
+	double y; \
+	for(i = 0; i < n; ++i) { \
+		y = out[i]; \
+		d[i] *= fprima; \
+	} \
+}
+
+PERCEPTRON_ACTIVATIONS(PERCEPTRON_ACTIVATION_LOOPS)
+
+#define PERCEPTRON_ACTIVATION_LOW(name, id, low, fx, fprima) [id] = low,
+
+/* Output value of inactive neurons for each transition function */
+static const double perceptron_low[] = {
+	PERCEPTRON_ACTIVATIONS(PERCEPTRON_ACTIVATION_LOW)
+};
+
+/* Desired value of output neuron i for a pattern with the given code */
+#define PERCEPTRON_TARGET(per, i, code) \
+	(((i) == (code)) ? 1.0 : perceptron_low[(per)->activation])
+
+/**
+ * Mean square error of the output layer against the desired output.
+ *
+ * @param per Initialized perceptron
+ * @param actual Output layer values
+ * @param code Active neuron in output pattern
+ * @return Error value
+ */
+static double perceptron_error(const perceptron_t * per, const real * actual, size_t code){
+	int i = 0, n = per->n[2];
 	double dif,sum; 
 	dif = sum = 0.0;
 
-	if( n == 0 ){
-		printerr("perceptron_mean_square_error: Lenght 0\n");
-		return 0;
-	}
-
 	for(; i < n; ++i) {
-		dif = actual[i] - (ISACTIVE(i, code));
+		dif = actual[i] - PERCEPTRON_TARGET(per, i, code);
 		sum += dif * dif;
 	}
 
@@ -73,143 +128,1111 @@ static double perceptron_bipolarsigmoid(double x){
 
 /**
  * Perceptron transition function prima (bipolarsigmoid)
+ * Computed from the already computed transition value, so there is no
+ * need to evaluate the transition function again.
  *
- * @param Value
- * @return Filtered value between [-1,1]
+ * @param fx Transition function value
+ * @return Derivative value between [0,0.5]
  */
-static double perceptron_bipolarsigmoid_prima(double x){
-	double fx = perceptron_bipolarsigmoid(x);
+static double perceptron_bipolarsigmoid_prima(double fx){
 	return 0.5 * (1 + fx) * (1 - fx);
 }
 
+/* Interpolation table for the bipolar sigmoid in [-TABLE_MAX, TABLE_MAX]
+ * Out of it the function is +-1 within 2.3e-7 */
+#define PERCEPTRON_TABLE_MAX 16.0
+#define PERCEPTRON_TABLE_LEN 4096
 
-/** 
- * Computes forward feeding for perceptron given a pattern.
+static perceptron_mode_t perceptron_mode = PERCEPTRON_EXACT;
+static real perceptron_table[PERCEPTRON_TABLE_LEN + 1];
+
+/**
+ * Sets how the transition function is evaluated for all perceptrons.
+ *
+ * @param mode Evaluation mode
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int perceptron_setmode(perceptron_mode_t mode){
+	int i;
+	double step = 2 * PERCEPTRON_TABLE_MAX / PERCEPTRON_TABLE_LEN;
+
+	switch( mode ) {
+		case PERCEPTRON_TABLE:
+			for(i = 0; i <= PERCEPTRON_TABLE_LEN; ++i)
+				perceptron_table[i] = perceptron_bipolarsigmoid(i * step - PERCEPTRON_TABLE_MAX);
+			break;
+		case PERCEPTRON_POLY:
+			simd_init();
+			break;
+		case PERCEPTRON_EXACT:
+			break;
+		default:
+			printerr("perceptron_setmode: Unknown mode %d\n", mode);
+			return 0;
+	}
+
+	perceptron_mode = mode;
+
+	return 1;
+}
+
+/**
+ * Transition function for a whole layer (bipolarsigmoid)
+ * Evaluated as set by perceptron_setmode.
+ *
+ * @param y Filtered values between [-1,1] (length n)
+ * @param x Values (length n). Can be the same as y.
+ * @param n Number of values
+ */
+static void perceptron_bipolarsigmoid_layer(real * y, const real * x, int n){
+	int i, t;
+	double u, scale = PERCEPTRON_TABLE_LEN / (2 * PERCEPTRON_TABLE_MAX);
+
+	switch( perceptron_mode ) {
+		case PERCEPTRON_POLY:
+			simd.bsigmoid(y, x, n);
+			break;
+
+		case PERCEPTRON_TABLE:
+			for(i = 0; i < n; ++i) {
+				u = (x[i] + PERCEPTRON_TABLE_MAX) * scale;
+				u = (u < 0) ? 0 : (u > PERCEPTRON_TABLE_LEN) ? PERCEPTRON_TABLE_LEN : u;
+				t = (int) u;
+				t = (t == PERCEPTRON_TABLE_LEN) ? t - 1 : t;
+				y[i] = perceptron_table[t] + (u - t) * (perceptron_table[t + 1] - perceptron_table[t]);
+			}
+			break;
+
+		default:
+			perceptron_bsigmoid_layer(y, x, n);
+	}
+}
+
+#define PERCEPTRON_ACTIVATION_LAYER_CASE(name, id, low, fx, fprima) \
+	case id: perceptron_##name##_layer(y, x, n); break;
+
+/**
+ * Transition function for a whole layer.
+ * The sigmoid functions are evaluated as set by perceptron_setmode, all of
+ * them from the bipolar sigmoid:
+ * logistic(x) = (bsigmoid(x) + 1) / 2 and tanh(x) = bsigmoid(2x)
+ *
+ * @param activation Transition function
+ * @param y Filtered values (length n)
+ * @param x Values (length n). Can be the same as y.
+ * @param n Number of values
+ */
+static void perceptron_transition_layer(perceptron_activation_t activation,
+		real * y, const real * x, int n){
+	int i;
+
+	if( perceptron_mode == PERCEPTRON_EXACT || activation == PERCEPTRON_RELU ) {
+		switch( activation ) {
+			PERCEPTRON_ACTIVATIONS(PERCEPTRON_ACTIVATION_LAYER_CASE)
+		}
+		return;
+	}
+
+	switch( activation ) {
+		case PERCEPTRON_LOGISTIC:
+			perceptron_bipolarsigmoid_layer(y, x, n);
+			for(i = 0; i < n; ++i)
+				y[i] = 0.5 * (y[i] + 1);
+			break;
+
+		case PERCEPTRON_TANH:
+			simd.scale(y, 2.0, x, n);
+			perceptron_bipolarsigmoid_layer(y, y, n);
+			break;
+
+		default:
+			perceptron_bipolarsigmoid_layer(y, x, n);
+	}
+}
+
+#define PERCEPTRON_ACTIVATION_DELTA_CASE(name, id, low, fx, fprima) \
+	case id: perceptron_##name##_delta(d, y, n); break;
+
+/**
+ * Multiplies the deltas of a whole layer by the transition function
+ * derivative, computed from the already computed layer values.
+ *
+ * @param activation Transition function
+ * @param d Deltas (length n)
+ * @param y Layer values (length n)
+ * @param n Number of values
+ */
+static void perceptron_transition_delta(perceptron_activation_t activation,
+		real * d, const real * y, int n){
+	/* Vectorized kernel for the default one */
+	if( activation == PERCEPTRON_BSIGMOID ) {
+		simd.delta(d, y, n);
+		return;
+	}
+
+	switch( activation ) {
+		PERCEPTRON_ACTIVATIONS(PERCEPTRON_ACTIVATION_DELTA_CASE)
+	}
+}
+
+/**
+ * Measures the transition function error of the current mode against the
+ * exact one, along all the range where it is not saturated.
+ *
+ * @param prima_error Where to set the max error of the derivative, or NULL
+ * @return Max absolute error of the transition function
+ */
+double perceptron_mode_maxerror(double * prima_error){
+	int i, j, n = 1024;
+	real x[1024], y[1024];
+	double err = 0, perr = 0, e, exact;
+
+	/* Sweep [-40, 40] in steps of 1/1024 */
+	for(i = -40; i < 40; ++i) {
+		for(j = 0; j < n; ++j)
+			x[j] = i + j / (double) n;
+
+		perceptron_bipolarsigmoid_layer(y, x, n);
+
+		for(j = 0; j < n; ++j) {
+			exact = perceptron_bipolarsigmoid(x[j]);
+
+			e = fabs(y[j] - exact);
+			err = (e > err) ? e : err;
+
+			e = fabs(perceptron_bipolarsigmoid_prima(y[j]) - perceptron_bipolarsigmoid_prima(exact));
+			perr = (e > perr) ? e : perr;
+		}
+	}
+
+	if( prima_error != NULL )
+		*prima_error = perr;
+
+	return err;
+}
+
+
+#ifdef PERCEPTRON_FIXED
+
+#define PERCEPTRON_FIXED_I (PERCEPTRON_FIXED_NI + 1)
+#define PERCEPTRON_FIXED_H (PERCEPTRON_FIXED_NH + 1)
+
+/* Partial sums of the fixed dot products. They are kept in separate lanes
+ * (four vectors of the widest instruction set) so the compiler can vectorize
+ * them with no reordering of the additions. */
+#define PERCEPTRON_FIXED_LANES (256 / sizeof(real))
+
+/**
+ * Layer loops for the geometry in geometry.h.
+ * All lengths are constants in every instantiation, so each is built fully
+ * unrolled and vectorized for the instruction set of its clone.
+ */
+static inline __attribute__((always_inline)) void perceptron_fixed_dots_body(
+		const real * in, real * const * w, real * rin, const int nin, int nout){
+	const int lanes = PERCEPTRON_FIXED_LANES;
+	int k, j, l;
+	const real * x, * row;
+	real acc[PERCEPTRON_FIXED_LANES], sum;
+
+	for(k = 0; k < nout; ++k) {
+		x = in;
+		row = __builtin_assume_aligned(w[k], 64);
+		for(l = 0; l < lanes; ++l)
+			acc[l] = 0;
+
+		/* Whole blocks of lanes, then the remaining values */
+		for(j = 0; j < nin / lanes; ++j, x += lanes, row += lanes)
+			for(l = 0; l < lanes; ++l)
+				acc[l] += x[l] * row[l];
+
+		for(sum = 0, j = 0; j < nin % lanes; ++j)
+			sum += x[j] * row[j];
+		for(l = 0; l < lanes; ++l)
+			sum += acc[l];
+
+		rin[k] = sum;
+	}
+}
+
+static inline __attribute__((always_inline)) void perceptron_fixed_update_body(
+		real * const * w, const real * d, real lrate, const real * in,
+		const int nin, int nout){
+	int k, j;
+	real * row, a;
+
+	for(k = 0; k < nout; ++k) {
+		row = __builtin_assume_aligned(w[k], 64);
+		a = lrate * d[k];
+		for(j = 0; j < nin; ++j)
+			row[j] += a * in[j];
+	}
+}
+
+static inline __attribute__((always_inline)) void perceptron_fixed_back_body(
+		real * din, const real * d, real * const * w, int j0, int nin, const int nout){
+	int k, j;
+	const real * row;
+
+	memset(din, 0, nin * sizeof(real));
+	for(k = 0; k < nout; ++k) {
+		row = (const real *) __builtin_assume_aligned(w[k], 64) + j0;
+		for(j = 0; j < nin; ++j)
+			din[j] += d[k] * row[j];
+	}
+}
+
+/* Instantiates the fixed layer loops for an instruction set.
+ * Each value is computed on its own, so they can be split in slices of
+ * neurons with the same results.
+ * dots: rin = w . in for nout neurons of layer i (0: input to hidden,
+ *       1: hidden to output)
+ * update: w[k] += lrate * d[k] * in for nout neurons of layer i
+ * back: din = sum_k d[k] * w[k][j0..j0+nin) for the hidden to output layer
+ *       (no bias) */
+#define PERCEPTRON_FIXED_ISA(isa, target) \
+target static void perceptron_fixed_dots_##isa(int i, const real * in, \
+		real * const * w, real * rin, int nout){ \
+	if( i == 0 ) \
+		perceptron_fixed_dots_body(in, w, rin, PERCEPTRON_FIXED_I, nout); \
+	else \
+		perceptron_fixed_dots_body(in, w, rin, PERCEPTRON_FIXED_H, nout); \
+} \
+target static void perceptron_fixed_update_##isa(int i, real * const * w, \
+		const real * d, real lrate, const real * in, int nout){ \
+	if( i == 0 ) \
+		perceptron_fixed_update_body(w, d, lrate, in, PERCEPTRON_FIXED_I, nout); \
+	else \
+		perceptron_fixed_update_body(w, d, lrate, in, PERCEPTRON_FIXED_H, nout); \
+} \
+target static void perceptron_fixed_back_##isa(real * din, const real * d, \
+		real * const * w, int j0, int nin){ \
+	perceptron_fixed_back_body(din, d, w, j0, nin, PERCEPTRON_FIXED_NO); \
+}
+
+typedef struct {
+	void (*dots)(int i, const real * in, real * const * w, real * rin, int nout);
+	void (*update)(int i, real * const * w, const real * d, real lrate, const real * in,
+			int nout);
+	void (*back)(real * din, const real * d, real * const * w, int j0, int nin);
+} perceptron_fixed_t;
+
+PERCEPTRON_FIXED_ISA(scalar, )
+
+static perceptron_fixed_t perceptron_fixed = {
+	perceptron_fixed_dots_scalar, perceptron_fixed_update_scalar, perceptron_fixed_back_scalar
+};
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+PERCEPTRON_FIXED_ISA(sse2, __attribute__((target("sse2"))))
+PERCEPTRON_FIXED_ISA(avx2, __attribute__((target("avx2"))))
+PERCEPTRON_FIXED_ISA(avx512, __attribute__((target("avx512f"))))
+#endif
+
+/**
+ * Picks the fixed layer loops for the instruction set of the simd kernels,
+ * so they follow the same CPU detection and CAVEBOY_SIMD cap.
+ */
+static void perceptron_fixed_init(void){
+	static const perceptron_fixed_t scalar = {
+		perceptron_fixed_dots_scalar, perceptron_fixed_update_scalar, perceptron_fixed_back_scalar
+	};
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	static const perceptron_fixed_t sse2 = {
+		perceptron_fixed_dots_sse2, perceptron_fixed_update_sse2, perceptron_fixed_back_sse2
+	};
+	static const perceptron_fixed_t avx2 = {
+		perceptron_fixed_dots_avx2, perceptron_fixed_update_avx2, perceptron_fixed_back_avx2
+	};
+	static const perceptron_fixed_t avx512 = {
+		perceptron_fixed_dots_avx512, perceptron_fixed_update_avx512, perceptron_fixed_back_avx512
+	};
+
+	if( strcmp(simd.name, "avx512") == 0 ) { perceptron_fixed = avx512; return; }
+	if( strcmp(simd.name, "avx2") == 0 ) { perceptron_fixed = avx2; return; }
+	if( strcmp(simd.name, "sse2") == 0 ) { perceptron_fixed = sse2; return; }
+#endif
+	perceptron_fixed = scalar;
+}
+
+/**
+ * Tells which fixed layer loops can compute a layer.
+ *
+ * @param nin Previous layer length (bias included)
+ * @param nout Next layer length (no bias)
+ * @return 0 or 1 for the fixed input or hidden layer, -1 if none
+ */
+static int perceptron_fixed_layer(int nin, int nout){
+	if( nin == PERCEPTRON_FIXED_I && nout == PERCEPTRON_FIXED_NH )
+		return 0;
+	if( nin == PERCEPTRON_FIXED_H && nout == PERCEPTRON_FIXED_NO )
+		return 1;
+	return -1;
+}
+
+/* Perceptron with the fixed geometry */
+#define PERCEPTRON_ISFIXED(per) ((per)->n[0] == PERCEPTRON_FIXED_NI && \
+		(per)->n[1] == PERCEPTRON_FIXED_NH && (per)->n[2] == PERCEPTRON_FIXED_NO)
+
+/* Weight rows start at 64 byte boundaries */
+#define PERCEPTRON_ROW(n) (((n) * sizeof(real) + 63) / 64 * (64 / sizeof(real)))
+
+#else
+
+#define PERCEPTRON_ROW(n) (n)
+
+#endif /* PERCEPTRON_FIXED */
+
+/**
+ * Computes the raw inputs of the neurons [k0, k1) of a layer, each one as
+ * the weighted sum of all neurons in the previous layer (+ bias) by its
+ * weight row w[k], which is contiguous in memory. Any slice of neurons gets
+ * the same values as the whole layer.
+ *
+ * @param in Previous layer values (length nin, bias included)
+ * @param w Weight rows for the next layer (nout x nin)
+ * @param rin Raw neuron inputs (length nout)
+ * @param nin Previous layer length (bias included)
+ * @param nout Next layer length (no bias)
+ * @param k0 First neuron
+ * @param k1 Last neuron + 1
+ */
+static void perceptron_layer_dots(const real * in, real ** w, real * rin, int nin, int nout,
+		int k0, int k1){
+	int k;
+
+#ifdef PERCEPTRON_FIXED
+	if( (k = perceptron_fixed_layer(nin, nout)) >= 0 ) {
+		perceptron_fixed.dots(k, in, &(w[k0]), &(rin[k0]), k1 - k0);
+		return;
+	}
+#endif
+	for(k = k0; k < k1; ++k)
+		rin[k] = simd.dot(in, w[k], nin);
+}
+
+/**
+ * Updates the weight rows of the neurons [k0, k1) of layer i as
+ * w[k] += lrate * d[k] * in. Any slice of neurons gets the same weights as
+ * the whole layer.
  *
  * @param per Initialized perceptron
+ * @param i Layer (0: input to hidden, 1: hidden to output)
+ * @param d Neuron deltas of the next layer
+ * @param lrate Learning rate
+ * @param in Layer values (bias included)
+ * @param k0 First neuron
+ * @param k1 Last neuron + 1
+ */
+static void perceptron_layer_update(perceptron per, int i, const real * d, double lrate,
+		const real * in, int k0, int k1){
+	int k;
+
+#ifdef PERCEPTRON_FIXED
+	if( PERCEPTRON_ISFIXED(per) ) {
+		perceptron_fixed.update(i, &(per->w[i][k0]), &(d[k0]), lrate, in, k1 - k0);
+		return;
+	}
+#endif
+	/* To all neurons in the next layer from each neuron (+ bias) */
+	for(k = k0; k < k1; ++k)
+		simd.axpy(per->w[i][k], lrate * d[k], in, per->n[i] + 1);
+}
+
+/**
+ * Adds up the hidden neurons [j0, j1) deltas from the output layer deltas
+ * and weights, before the transition derivative. Any slice of neurons gets
+ * the same values as the whole layer.
+ *
+ * @param per Initialized perceptron
+ * @param dhidden Hidden layer deltas (length n[1])
+ * @param dout Output layer deltas
+ * @param j0 First hidden neuron
+ * @param j1 Last hidden neuron + 1
+ */
+static void perceptron_hidden_back(const perceptron_t * per, real * dhidden, const real * dout,
+		int j0, int j1){
+	int k;
+
+#ifdef PERCEPTRON_FIXED
+	if( PERCEPTRON_ISFIXED(per) ) {
+		perceptron_fixed.back(&(dhidden[j0]), dout, per->w[1], j0, j1 - j0);
+		return;
+	}
+#endif
+	memset(&(dhidden[j0]), 0, (j1 - j0) * sizeof(real));
+	for(k = 0; k < per->n[2]; ++k)
+		simd.axpy(&(dhidden[j0]), dout[k], &(per->w[1][k][j0]), j1 - j0);
+}
+
+/**
+ * Computes the values of a whole layer given the values of the previous one.
+ *
+ * Each neuron k in the next layer is computed once as the weighted sum of
+ * all neurons in the previous layer (+ bias) by its weight row w[k], which
+ * is contiguous in memory.
+ *
+ * @param activation Transition function
+ * @param in Previous layer values (length nin, bias included)
+ * @param w Weight rows for the next layer (nout x nin)
+ * @param rin Where to save raw neuron inputs (length nout) or NULL
+ * @param out Next layer values (length nout, no bias)
+ * @param nin Previous layer length (bias included)
+ * @param nout Next layer length (no bias)
+ */
+static void perceptron_layer_forward(perceptron_activation_t activation,
+		const real * in, real ** w, real * rin, real * out, int nin, int nout){
+	/* Raw inputs are saved to be used later */
+	if( rin == NULL )
+		rin = out;
+
+	/* For all neurons in next layer (no bias)
+	 * sum all neurons in layer (+ bias) by its weight w[k][j] */
+	perceptron_layer_dots(in, w, rin, nin, nout, 0, nout);
+
+	perceptron_transition_layer(activation, out, rin, nout);
+}
+
+/**
+ * Computes forward feeding through the perceptron of a context.
+ * Output layer values are left in ctx->net[2].
+ *
+ * @param ctx Initialized context
  * @param pat Initialized pattern
  * @return 0 if unsuccessful, 1 otherwise
  */
-int perceptron_feedforward(perceptron per, pattern pat){
-	int i, j, k, n;
-	double sum = 0;
+int perceptron_ctx_feedforward(perceptron_ctx ctx, pattern pat){
+	int i;
+	const perceptron_t * per = ctx->per;
 
 	/* Set input pattern */
-	per->net[0] = pat;
+	ctx->net[0] = pat;
 
 	/* Calculate output layer value */
 
 	/* For the input and hidden layers */
 	for(i = 0; i < 2; ++i)
-		/* For all neurons in layer (+ bias) */
-		for(j = 0; j < per->n[i] + 1; ++j)
-			/* For all neurons in next layer (no bias) */
-			for(k = 0; k < per->n[i+1]; ++k) {
-				/* Sum all neurons (j=n[i]) in layer by its
-				 * weight w[j][k] to a certain neuron (k) */
-
-				/* sum = perceptron_weighted_sum(per->net[i], per->w[i], k, per->n[i] + 1); */
-				sum = 0;
-				n = per->n[i] + 1;
-				while( n-- )
-					sum += per->net[i][n] * per->w[i][n][k];
-
-				per->net[i+1][k] = perceptron_bipolarsigmoid(sum);
+		perceptron_layer_forward(per->activation, ctx->net[i], per->w[i], NULL, ctx->net[i+1],
+				per->n[i] + 1, per->n[i+1]);
+
+	return 1;
+}
+
+/** 
+ * Computes forward feeding for perceptron given a pattern.
+ *
+ * @param per Initialized perceptron
+ * @param pat Initialized pattern
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int perceptron_feedforward(perceptron per, pattern pat){
+	return perceptron_ctx_feedforward(per->ctx, pat);
+}
+
+/* Scratch space for the computations over a batch of patterns */
+typedef struct perceptron_batch_t {
+	int nbatch;        /* Max number of patterns */
+	real * hidden;   /* Hidden layer values (nbatch x nh+1) */
+	real ** hrows;   /* Hidden layer values of each pattern */
+	real * out;      /* Output layer values (nbatch x no) */
+	real * dout;     /* Output layer deltas (nbatch x no) */
+	real * dhidden;  /* Hidden layer deltas (nbatch x nh) */
+} perceptron_batch_t;
+
+static void perceptron_batch_release(perceptron_batch_t * bt){
+	free(bt->hidden);
+	free(bt->hrows);
+	free(bt->out);
+	free(bt->dout);
+	free(bt->dhidden);
+}
+
+static int perceptron_batch_alloc(perceptron per, perceptron_batch_t * bt, int nbatch){
+	int b, nh = per->n[1] + 1, no = per->n[2];
+
+	bt->nbatch = nbatch;
+	bt->hidden = (real *) calloc (nbatch * nh, sizeof(real));
+	bt->hrows = (real **) malloc (nbatch * sizeof(real *));
+	bt->out = (real *) calloc (nbatch * no, sizeof(real));
+	bt->dout = (real *) calloc (nbatch * no, sizeof(real));
+	bt->dhidden = (real *) calloc (nbatch * (nh - 1), sizeof(real));
+
+	if( bt->hidden == NULL || bt->hrows == NULL || bt->out == NULL
+			|| bt->dout == NULL || bt->dhidden == NULL ){
+		printerr("perceptron_batch_alloc: Couldn't alloc space for %d patterns.\n", nbatch);
+		perceptron_batch_release(bt);
+		return 0;
+	}
+
+	for(b = 0; b < nbatch; ++b)
+		bt->hrows[b] = &(bt->hidden[b * nh]);
+
+	return 1;
+}
+
+/**
+ * Computes forward feeding for a batch of patterns into the batch scratch.
+ *
+ * Each layer is computed for all patterns as a blocked matrix product, so
+ * the weights are brought from memory once per batch instead of once per
+ * pattern.
+ *
+ * @param per Initialized perceptron
+ * @param bt Batch scratch for at least nbatch patterns
+ * @param patterns Initialized patterns (nbatch)
+ * @param nbatch Number of patterns
+ * @param out Output layer values for each pattern (nbatch x n[2])
+ */
+static void perceptron_batch_forward(perceptron per, perceptron_batch_t * bt,
+		pattern * patterns, int nbatch, real * out){
+	int b, nh = per->n[1] + 1, no = per->n[2];
+
+	/* Hidden layer values for all patterns (nbatch x nh) */
+	memset(bt->hidden, 0, nbatch * nh * sizeof(real));
+	simd_gemm(bt->hidden, nh, patterns, nbatch, per->w[0], per->n[1], per->n[0] + 1);
+
+	for(b = 0; b < nbatch; ++b) {
+		perceptron_transition_layer(per->activation, bt->hrows[b], bt->hrows[b], per->n[1]);
+		bt->hrows[b][nh - 1] = 1;  /* Bias */
+	}
+
+	/* Output layer values for all patterns (nbatch x no) */
+	memset(out, 0, nbatch * no * sizeof(real));
+	simd_gemm(out, no, bt->hrows, nbatch, per->w[1], no, nh);
+
+	perceptron_transition_layer(per->activation, out, out, nbatch * no);
+}
+
+/**
+ * Computes the output and hidden layer deltas for a batch of patterns
+ * already fed forward with perceptron_batch_forward().
+ *
+ * @param per Initialized perceptron
+ * @param bt Batch scratch with the layer values
+ * @param codes Active neuron in output pattern, for each pattern
+ * @param nbatch Number of patterns
+ */
+static void perceptron_batch_deltas(perceptron per, perceptron_batch_t * bt,
+		const size_t * codes, int nbatch){
+	int b, k, nh = per->n[1], no = per->n[2];
+	real * dout, * dhidden;
+
+	for(b = 0; b < nbatch; ++b) {
+		dout = &(bt->dout[b * no]);
+		dhidden = &(bt->dhidden[b * nh]);
+
+		/* Output layer deltas against desired output */
+		for(k = 0; k < no; ++k)
+			dout[k] = PERCEPTRON_TARGET(per, k, codes[b]) - bt->out[b * no + k];
+		perceptron_transition_delta(per->activation, dout, &(bt->out[b * no]), no);
+
+		/* Hidden layer deltas from the output deltas and weights */
+		perceptron_hidden_back(per, dhidden, dout, 0, nh);
+		perceptron_transition_delta(per->activation, dhidden, bt->hrows[b], nh);
+	}
+}
+
+/**
+ * Computes forward feeding for a batch of patterns at once.
+ *
+ * @param per Initialized perceptron
+ * @param bt Batch scratch for at least nbatch patterns, NULL to use a new one
+ * @param patterns Initialized patterns (nbatch)
+ * @param nbatch Number of patterns
+ * @param out Output layer values for each pattern (nbatch x n[2])
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int perceptron_feedforward_batch(perceptron per, perceptron_batch bt, pattern * patterns,
+		int nbatch, real * out){
+	perceptron_batch_t tmp;
+
+	/* Temporary scratch */
+	if( bt == NULL ) {
+		if( perceptron_batch_alloc(per, &tmp, nbatch) == 0 )
+			return 0;
+
+		perceptron_batch_forward(per, &tmp, patterns, nbatch, out);
+		perceptron_batch_release(&tmp);
+
+		return 1;
+	}
+
+	if( nbatch > bt->nbatch ) {
+		printerr("perceptron_feedforward_batch: Scratch for %d patterns, %d given.\n",
+				bt->nbatch, nbatch);
+		return 0;
+	}
+
+	perceptron_batch_forward(per, bt, patterns, nbatch, out);
+
+	return 1;
+}
+
+/**
+ * Creates the scratch space to feed batches of patterns forward.
+ *
+ * @param per Initialized perceptron
+ * @param bt_ptr Uninitialized batch scratch by reference
+ * @param nbatch Max number of patterns per batch
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int perceptron_batch_create(perceptron per, perceptron_batch * bt_ptr, int nbatch){
+	perceptron_batch bt = NULL;
+
+	if( (bt = (perceptron_batch) malloc (sizeof(perceptron_batch_t))) == NULL ||
+			perceptron_batch_alloc(per, bt, nbatch) == 0 ) {
+		printerr("perceptron_batch_create: Couldn't alloc space for %d patterns.\n", nbatch);
+		free(bt);
+		return 0;
+	}
+
+	*bt_ptr = bt;
+
+	return 1;
+}
+
+/**
+ * Frees a batch scratch.
+ *
+ * @param bt_ptr Initialized batch scratch by reference
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int perceptron_batch_free(perceptron_batch * bt_ptr){
+	if( *bt_ptr == NULL ) {
+		printerr("perceptron_batch_free: Batch scratch already freed.");
+		return 0;
+	}
+
+	perceptron_batch_release(*bt_ptr);
+	free(*bt_ptr);
+	*bt_ptr = NULL;
+
+	return 1;
+}
+
+/**
+ * Quantizes a trained perceptron to 8 bit weights with per neuron scales.
+ *
+ * Each weight row is scaled so its largest weight is 127, and rounded.
+ * Bias weights are kept apart in full precision.
+ *
+ * @param per Initialized perceptron
+ * @param bpp Bytes per pixel of the input patterns
+ * @param qper_ptr Uninitialized quantized perceptron by reference
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int perceptron_quantize(perceptron per, int bpp, qperceptron * qper_ptr){
+	int i, j, k, len;
+	double max, scale;
+	signed char * row;
+	qperceptron qper = NULL;
+
+	if( bpp <= 0 || bpp > sizeof(size_t) ) {
+		printerr("perceptron_quantize: Unsupported pixel size (%d bpp)\n", bpp);
+		return 0;
+	}
+
+	if( (qper = (qperceptron) calloc (1, sizeof(qperceptron_t))) == NULL ) {
+		printerr("perceptron_quantize: Couldn't alloc space for quantized perceptron.\n");
+		return 0;
+	}
+
+	*qper_ptr = qper;
+
+	for(i = 0; i < 3; ++i)
+		qper->n[i] = per->n[i];
+	qper->bpp = bpp;
+	qper->activation = per->activation;
+
+	/* For the input and hidden layers */
+	for(i = 0; i < 2; ++i) {
+		len = per->n[i];  /* Weight rows length with no bias */
+
+		qper->q[i] = (signed char **) malloc (per->n[i+1] * sizeof(signed char *));
+		qper->scale[i] = (real *) malloc (per->n[i+1] * sizeof(real));
+		qper->qsum[i] = (int *) malloc (per->n[i+1] * sizeof(int));
+		qper->bias[i] = (real *) malloc (per->n[i+1] * sizeof(real));
+		row = (signed char *) malloc (per->n[i+1] * len);
+
+		if( qper->q[i] == NULL || qper->scale[i] == NULL || qper->qsum[i] == NULL
+				|| qper->bias[i] == NULL || row == NULL ) {
+			printerr("perceptron_quantize: Couldn't alloc space for quantized weights.\n");
+			free(row);
+			perceptron_quant_free(qper_ptr);
+			return 0;
+		}
+
+		/* For all neurons (no bias) in the next layer */
+		for(k = 0; k < per->n[i+1]; ++k) {
+			qper->q[i][k] = &(row[k * len]);
+
+			for(max = 0, j = 0; j < len; ++j)
+				max = (fabs(per->w[i][k][j]) > max) ? fabs(per->w[i][k][j]) : max;
+
+			scale = (max > 0) ? max / 127 : 1;
+
+			for(qper->qsum[i][k] = 0, j = 0; j < len; ++j) {
+				qper->q[i][k][j] = (signed char) lrint(per->w[i][k][j] / scale);
+				qper->qsum[i][k] += qper->q[i][k][j];
 			}
 
+			qper->scale[i][k] = scale;
+
+			/* Bias is always 1 */
+			qper->bias[i][k] = per->w[i][k][len];
+		}
+	}
+
 	return 1;
 }
 
 /**
- * Computes backpropagation for a perceptron and a given pattern.
- * Raw version which perform the calculations and 
+ * Frees a quantized perceptron
+ *
+ * @param qper_ptr Initialized quantized perceptron by reference
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int perceptron_quant_free(qperceptron * qper_ptr){
+	int i;
+	qperceptron qper = *qper_ptr;
+
+	if( qper == NULL ) {
+		printerr("perceptron_quant_free: Quantized perceptron already freed.");
+		return 0;
+	}
+
+	for(i = 0; i < 2; ++i) {
+		if( qper->q[i] != NULL )
+			free(qper->q[i][0]);  /* Free contiguous data */
+		free(qper->q[i]);
+		free(qper->scale[i]);
+		free(qper->qsum[i]);
+		free(qper->bias[i]);
+	}
+
+	free(qper);
+	*qper_ptr = NULL;
+
+	return 1;
+}
+
+/**
+ * Dot product of unsigned bytes u and signed bytes q (length n), done in
+ * blocks short enough for the 32 bit accumulation of qdot to be exact.
+ */
+static double perceptron_qdot(const unsigned char * u, const signed char * q, int n){
+	int j, len;
+	double sum = 0;
+
+	for(j = 0; j < n; j += SIMD_QDOT_MAX) {
+		len = (n - j < SIMD_QDOT_MAX) ? n - j : SIMD_QDOT_MAX;
+		sum += simd.qdot(&(u[j]), &(q[j]), len);
+	}
+
+	return sum;
+}
+
+/**
+ * Size of the scratch space for perceptron_feedforward_quant().
+ *
+ * Neuron raw inputs (nh), quantized hidden values (nh) and input planes
+ * (bpp x ni).
+ *
+ * @param qper Initialized quantized perceptron
+ * @return Scratch size in bytes
+ */
+size_t perceptron_quant_scratch(qperceptron qper){
+	return qper->n[1] * sizeof(real) + qper->n[1] + (size_t) qper->bpp * qper->n[0];
+}
+
+/**
+ * Computes forward feeding for a quantized perceptron given the raw
+ * image data of a pattern, as read from the PNG file.
+ *
+ * The quantized perceptron is only read, so it is safe to be called from
+ * several threads, each one with its own scratch.
+ *
+ * @param qper Initialized quantized perceptron
+ * @param scratch perceptron_quant_scratch() bytes, NULL to use a new one
+ * @param bytes Raw image data (n[0] x bpp bytes)
+ * @param out Output layer values (n[2])
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int perceptron_feedforward_quant(qperceptron qper, void * scratch, const unsigned char * bytes,
+		real * out){
+	int b, j, k, ni = qper->n[0], nh = qper->n[1], no = qper->n[2];
+	double sum, min, max, step;
+	const unsigned char * planes = bytes;
+	unsigned char * split = NULL, * hidden = NULL;
+	real * rin = (real *) scratch;
+
+	/* Temporary scratch */
+	if( scratch == NULL &&
+			(rin = (real *) malloc (perceptron_quant_scratch(qper))) == NULL ) {
+		printerr("perceptron_feedforward_quant: Couldn't alloc space for scratch.\n");
+		return 0;
+	}
+
+	hidden = (unsigned char *) &(rin[nh]);
+	split = &(hidden[nh]);
+
+	/* Split the bytes of each pixel in planes */
+	if( qper->bpp > 1 ) {
+		for(j = 0; j < ni; ++j)
+			for(b = 0; b < qper->bpp; ++b)
+				split[b * ni + j] = bytes[j * qper->bpp + b];
+
+		planes = split;
+	}
+
+	/* Hidden layer. Pixel value planes are weighted by 256^b */
+	for(k = 0; k < nh; ++k) {
+		for(sum = 0, b = qper->bpp - 1; b >= 0; --b)
+			sum = sum * 256 + perceptron_qdot(&(planes[b * ni]), qper->q[0][k], ni);
+
+		rin[k] = qper->scale[0][k] * sum + qper->bias[0][k];
+	}
+
+	perceptron_transition_layer(qper->activation, rin, rin, nh);
+
+	/* Quantize hidden values along their range */
+	for(min = max = rin[0], k = 1; k < nh; ++k) {
+		min = (rin[k] < min) ? rin[k] : min;
+		max = (rin[k] > max) ? rin[k] : max;
+	}
+
+	step = (max > min) ? (max - min) / 255 : 1;
+
+	for(k = 0; k < nh; ++k)
+		hidden[k] = (unsigned char) lrint((rin[k] - min) / step);
+
+	/* Output layer. h ~ min + u * step */
+	for(k = 0; k < no; ++k)
+		out[k] = qper->scale[1][k] * (step * perceptron_qdot(hidden, qper->q[1][k], nh)
+				+ min * qper->qsum[1][k]) + qper->bias[1][k];
+
+	perceptron_transition_layer(qper->activation, out, out, no);
+
+	if( scratch == NULL )
+		free(rin);
+
+	return 1;
+}
+
+/**
+ * Computes backpropagation for a batch of patterns with a single weight
+ * update. All deltas are computed with the weights previous to the update,
+ * and the weight gradient of all patterns is accumulated into each weight
+ * row in one blocked pass.
  *
  * @param per Initialized perceptron
+ * @param bt Batch scratch for at least nbatch patterns
+ * @param patterns Initialized patterns (nbatch)
+ * @param codes Active neuron in output pattern, for each pattern
+ * @param nbatch Number of patterns
+ * @param lrate Learning rate
+ * @return Sum of the error for all patterns in the batch
+ */
+static double perceptron_backpropagation_batch(perceptron per, perceptron_batch_t * bt,
+		pattern * patterns, const size_t * codes, int nbatch, double lrate){
+	int b;
+	double error = 0;
+
+	perceptron_batch_forward(per, bt, patterns, nbatch, bt->out);
+	perceptron_batch_deltas(per, bt, codes, nbatch);
+
+	for(b = 0; b < nbatch; ++b)
+		error += perceptron_error(per, &(bt->out[b * per->n[2]]), codes[b]);
+
+	/* Update weights with the gradient of the whole batch */
+	simd_gemm_tn(per->w[1], per->n[2], bt->dout, per->n[2], lrate,
+			bt->hrows, nbatch, per->n[1] + 1);
+	simd_gemm_tn(per->w[0], per->n[1], bt->dhidden, per->n[1], lrate,
+			patterns, nbatch, per->n[0] + 1);
+
+	return error;
+}
+
+/**
+ * Computes the neuron deltas of a perceptron for a given pattern.
+ * Both layer deltas are computed with the current weights.
+ *
+ * @param ctx Initialized context
  * @param pat Initialized pattern
  * @param code Active neuron in output pattern
- * @param lrate Learning rate 
- * @return 0 if unsuccessful, 1 otherwise
  */
-int perceptron_backpropagation_raw(perceptron per, pattern pat, size_t code,
-		double lrate){
-	int n = 0, i = 0, j = 0, k = 0, err = 1;
-	double Dj_in, Dj, sum;
+static void perceptron_backpropagation_deltas(perceptron_ctx ctx, pattern pat, size_t code){
+	int i = 0, k = 0;
+	const perceptron_t * per = ctx->per;
 
 	/* Rename temp delta vectors */
-	double ** d = per->d,     /* Deltas */
-		   ** rin = per->rw, /* Raw neuron inputs */
-		   *** dw = per->dw;  /* Weight Deltas */
+	real ** d = ctx->d,     /* Deltas */
+		   ** rin = ctx->rw, /* Raw neuron inputs */
+		   ** net = ctx->net;
 
 	/* Set input layer values 
 	 * We just make net[0] to point to the pattern so we don't have to copy all
 	 * of it each time. */
-	per->net[0] = pat;
+	net[0] = pat;
 
-	/* Compute feed forward */
+	/* Compute feed forward saving raw inputs */
 
 	/* For the input and hidden layers */
 	for(i = 0; i < 2; ++i)
-		/* For all neurons in layer (+ bias) */
-		for(j = 0; j < per->n[i] + 1; ++j)
-			/* For all neurons in next layer (no bias) */
-			for(k = 0; k < per->n[i+1]; ++k) {
-				/* Sum all neurons (j=n[i]) in layer by its
-				 * weight w[j][k] to a certain neuron (k) */
-
-				/* sum = perceptron_weighted_sum(per->net[i], per->w[i], k, per->n[i] + 1); */
-				sum = 0;
-				n = per->n[i] + 1;
-				while( n-- )
-					sum += per->net[i][n] * per->w[i][n][k];
-
-				rin[i][k] = sum;  /* Save raw input to be used later */
-				per->net[i+1][k] = perceptron_bipolarsigmoid(sum);
-			}
-
+		perceptron_layer_forward(per->activation, net[i], per->w[i], rin[i], net[i+1],
+				per->n[i] + 1, per->n[i+1]);
 
 	/* Calculate output layer (i = 2) backpropagation */
-	for(k = 0; k < per->n[2]; ++k){
-		/* Get the already computed Yk in */
-		/* Yk_in = perceptron_weighted_sum(per->net[1], per->w[1], k, per->n[1] + 1); */
-		/* Yk_in = rin[1][k]; */
-
-		/* Calculate dk against desired output (neuron k should match the code) */
-		d[1][k] = (ISACTIVE(k, code) - per->net[2][k]) * perceptron_bipolarsigmoid_prima(rin[1][k]);
 
-		/* Calculate weight deltas for all weights to this neuron from the previous layer */
-		for(j = 0; j < per->n[1] + 1; ++j)
-			dw[1][j][k] = lrate * d[1][k] * per->net[1][j];
-	}
+	/* Calculate dk against desired output (neuron k should match the code).
+	 * The derivative is taken from the already computed output values. */
+	for(k = 0; k < per->n[2]; ++k)
+		d[1][k] = PERCEPTRON_TARGET(per, k, code) - net[2][k];
+	perceptron_transition_delta(per->activation, d[1], net[2], per->n[2]);
 
 	/* Calculate hidden layer (i = 1) backpropagation */
-	for(j = 0; j < per->n[1]; ++j){
-		/* Get the already computed Zj_in */ 
-		/* Zj_in = perceptron_weighted_sum(per->net[0], per->w[0], j, per->n[0] + 1); */
-		/* Zj_in = rin[0][j]; */
 
-		/* Calculate Dj_in based on output layer deltas and the hidden layer weights */
-		Dj_in = 0;
-		for(k = 0; k < per->n[2]; ++k)
-			Dj_in += d[1][k] * per->w[1][j][k];
+	/* Calculate Dj_in based on output layer deltas and the hidden layer
+	 * weights, adding up the weight rows of each output neuron */
+	perceptron_hidden_back(per, d[0], d[1], 0, per->n[1]);
 
-		/* Calculate delta */
-		Dj = Dj_in * perceptron_bipolarsigmoid_prima(rin[0][j]);
+	/* Calculate deltas */
+	perceptron_transition_delta(per->activation, d[0], net[1], per->n[1]);
+}
 
-		/* Calculate weight deltas for all weights to this neuron from the previous layer */
-		for(i = 0; i < per->n[0] + 1; ++i)
-			dw[0][i][j] = lrate * Dj * per->net[0][i];
-	}
+/**
+ * Computes backpropagation for a perceptron and a given pattern in a
+ * context, and updates the weights in place.
+ *
+ * Every weight row is updated in a single pass as w[k] += lrate * d[k] * net,
+ * once all deltas have been computed with the weights previous to the update.
+ *
+ * @param per Initialized perceptron, the one of the context
+ * @param ctx Initialized context
+ * @param pat Initialized pattern
+ * @param code Active neuron in output pattern
+ * @param lrate Learning rate 
+ */
+static void perceptron_ctx_backpropagation(perceptron per, perceptron_ctx ctx,
+		pattern pat, size_t code, double lrate){
+	int i = 0;
+
+	perceptron_backpropagation_deltas(ctx, pat, code);
 
-	/* Update weights */
-	/* For the weighted layers */
+	/* Update weights of the weighted layers */
 	for(i = 0; i < 2; ++i)
-		/* For each neuron (+ bias) */
-		for(j = 0; j < per->n[i] + 1; ++j)
-			/* To all neurons in the next layer */
-			for(k = 0; k < per->n[i + 1]; ++k)
-				per->w[i][j][k] += dw[i][j][k];
+		perceptron_layer_update(per, i, ctx->d[i], lrate, ctx->net[i], 0, per->n[i + 1]);
+}
 
-	return err;
+/**
+ * Computes backpropagation for a perceptron and a given pattern.
+ * Raw version which perform the calculations and updates the weights
+ * in place, with no checks.
+ *
+ * @param per Initialized perceptron
+ * @param pat Initialized pattern
+ * @param code Active neuron in output pattern
+ * @param lrate Learning rate 
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int perceptron_backpropagation_raw(perceptron per, pattern pat, size_t code,
+		double lrate){
+	perceptron_ctx_backpropagation(per, per->ctx, pat, code, lrate);
+
+	return 1;
+}
+
+/* Input layer weights below which a single pattern is not worth splitting */
+#define PERCEPTRON_SLICES_MIN 65536
+
+/* Work shared by all threads backpropagating a single pattern */
+typedef struct {
+	perceptron per;
+	perceptron_ctx ctx;
+	double lrate;
+} perceptron_slices_t;
+
+/* Hidden neurons [begin, end): raw inputs and values */
+static void perceptron_slices_forward(void * arg, size_t begin, size_t end, int worker){
+	perceptron_slices_t * job = (perceptron_slices_t *) arg;
+	perceptron per = job->per;
+	perceptron_ctx ctx = job->ctx;
+
+	perceptron_layer_dots(ctx->net[0], per->w[0], ctx->rw[0], per->n[0] + 1, per->n[1],
+			(int) begin, (int) end);
+
+	perceptron_transition_layer(per->activation, &(ctx->net[1][begin]),
+			&(ctx->rw[0][begin]), (int) (end - begin));
+}
+
+/* Hidden neurons [begin, end): deltas with the output layer weights previous
+ * to the update, and update of their input weight rows */
+static void perceptron_slices_backward(void * arg, size_t begin, size_t end, int worker){
+	perceptron_slices_t * job = (perceptron_slices_t *) arg;
+	perceptron per = job->per;
+	perceptron_ctx ctx = job->ctx;
+	int n = (int) (end - begin);
+
+	perceptron_hidden_back(per, ctx->d[0], ctx->d[1], (int) begin, (int) end);
+	perceptron_transition_delta(per->activation, &(ctx->d[0][begin]), &(ctx->net[1][begin]), n);
+
+	perceptron_layer_update(per, 0, ctx->d[0], job->lrate, ctx->net[0], (int) begin, (int) end);
+}
+
+/**
+ * Computes backpropagation for a perceptron and a given pattern, with the
+ * hidden neurons split in one slice per thread.
+ *
+ * Each thread computes the values and deltas of its own hidden neurons and
+ * updates their input weight rows, which are most of the work. The output
+ * layer is computed by the caller between both steps, and its weights are
+ * updated at the end, so all deltas use the weights previous to the update
+ * as in perceptron_backpropagation_raw(). Small nets are not split.
+ *
+ * @param per Initialized perceptron
+ * @param pat Initialized pattern
+ * @param code Active neuron in output pattern
+ * @param lrate Learning rate 
+ * @param pool Initialized thread pool
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int perceptron_backpropagation_parallel(perceptron per, pattern pat, size_t code,
+		double lrate, threadpool pool){
+	int k, nh = per->n[1], no = per->n[2], nthreads = threadpool_size(pool);
+	perceptron_ctx ctx = per->ctx;
+	perceptron_slices_t job;
+
+	if( ctx->d == NULL || ctx->rw == NULL ){
+		printerr("perceptron_backpropagation_parallel: Couldn't alloc space for deltas.\n");
+		return 0;
+	}
+
+	if( nthreads == 1 || (per->n[0] + 1) * nh < PERCEPTRON_SLICES_MIN )
+		return perceptron_backpropagation_raw(per, pat, code, lrate);
+
+	job.per = per;
+	job.ctx = ctx;
+	job.lrate = lrate;
+
+	ctx->net[0] = pat;
+
+	/* Hidden layer, a slice per thread */
+	threadpool_for(pool, nh, (nh + nthreads - 1) / nthreads, perceptron_slices_forward, &job);
+
+	/* Output layer and its deltas */
+	perceptron_layer_forward(per->activation, ctx->net[1], per->w[1], ctx->rw[1], ctx->net[2],
+			nh + 1, no);
+
+	for(k = 0; k < no; ++k)
+		ctx->d[1][k] = PERCEPTRON_TARGET(per, k, code) - ctx->net[2][k];
+	perceptron_transition_delta(per->activation, ctx->d[1], ctx->net[2], no);
+
+	/* Hidden layer deltas and input weights, a slice per thread */
+	threadpool_for(pool, nh, (nh + nthreads - 1) / nthreads, perceptron_slices_backward, &job);
+
+	/* Output layer weights */
+	perceptron_layer_update(per, 1, ctx->d[1], lrate, ctx->net[1], 0, no);
+
+	return 1;
 }
 
 /**
@@ -223,11 +1246,9 @@ int perceptron_backpropagation_raw(perceptron per, pattern pat, size_t code,
  */
 int perceptron_backpropagation(perceptron per, pattern pat, size_t code, double lrate){
 	int ret;
-	double ** d = per->d;     /* Neuron deltas */
-	double *** dw = per->dw;   /* Weight deltas */
 
 	/* Check allocations */
-	if( d == NULL || dw == NULL ){
+	if( per->ctx->d == NULL || per->ctx->rw == NULL ){
 		ret = 0;
 		printerr("perceptron_backpropagation: Couldn't alloc space for deltas.\n");
 	} else {
@@ -295,7 +1316,7 @@ int perceptron_read(perceptron * per_ptr, FILE * perfile){
 					return 0;
 				}
 
-				per->w[i][j][k] = tmp;
+				per->w[i][k][j] = tmp;
 			}
 
 	return 1;
@@ -359,7 +1380,7 @@ int perceptron_print(perceptron per, FILE * perfile){
 
 			/* For all neurons weights (no bias) in next layer */
 			for(k = 0; k < per->n[i + 1]; ++k){
-				fprintf(perfile, "%lf ", per->w[i][j][k]);
+				fprintf(perfile, "%lf ", per->w[i][k][j]);
 			}
 
 			fprintf(perfile, "\n");
@@ -415,8 +1436,8 @@ int perceptron_reset(perceptron per){
 
 		/* For all neuron + bias (if any) */
 		for(j = 0; j < n; ++j)
-			/* Set all to rand, bias (at last pos + 1) to 1 */
-			per->net[i][j] = (j == per->n[i] + 1) ? 1 : (*(per->init))();  
+			/* Set all to rand, bias (at last pos) to 1 */
+			per->ctx->net[i][j] = (j == per->n[i]) ? 1 : (*(per->init))();  
 	}
 
 	/*  Reset weights */
@@ -427,7 +1448,7 @@ int perceptron_reset(perceptron per){
 		for(j = 0; j < per->n[i] + 1; ++j)
 			/* Each of them are related to a neuron in the next layer (no bias) */
 			for(k = 0; k < per->n[i + 1]; ++k)
-				per->w[i][j][k] = (*(per->init))();
+				per->w[i][k][j] = (*(per->init))();
 
 	return 1;
 }
@@ -436,7 +1457,7 @@ int perceptron_reset(perceptron per){
  * Sets a given pattern as input.
  *
  * @param per Initialized perceptron.
- * @param in Vector of double with the in pattern. Length must be the same as perceptron->n[0]
+ * @param in Vector of real with the in pattern. Length must be the same as perceptron->n[0]
  * @return 0 if unsuccessful, 1 otherwise
  */
 int perceptron_setpattern(perceptron per, pattern pat){
@@ -444,21 +1465,13 @@ int perceptron_setpattern(perceptron per, pattern pat){
 	int i = 0;
 
 	for(; i < per->n[0]; ++i)
-		per->net[0][i] = pat[i];
+		per->ctx->net[0][i] = pat[i];
 		*/
-	per->net[0] = pat;
+	per->ctx->net[0] = pat;
 
 	return 1;
 }
 
-/* Forward declaration */
-static int perceptron_backpropagation_free_dw(perceptron per, double * ***dw_ptr);
-static int perceptron_backpropagation_free_rw(perceptron per, double * **dw_ptr);
-static int perceptron_backpropagation_free_d(perceptron per, double * **d_ptr);
-static int perceptron_backpropagation_alloc_rw(perceptron per, double * **dw_ptr);
-static int perceptron_backpropagation_alloc_dw(perceptron per, double * ***dw_ptr);
-static int perceptron_backpropagation_alloc_d(perceptron per, double * **d_ptr);
-
 /**
  * Frees the perceptron structure
  *
@@ -473,38 +1486,134 @@ int perceptron_free(perceptron * per_ptr){
 		return 0;
 	}
 
-	/* Free Net */
-	free(*(per->net));
-	free(per->net);
+	/* Free default context */
+	perceptron_ctx_free(&(per->ctx));
 
 	/* Free Weights */
-	free(*(per->w));
+	free(per->w[0][0]);  /* Free contiguous data */
+	free(per->w[0]);
+	free(per->w[1]);
 	free(per->w);
 
-	perceptron_backpropagation_free_d(per, &(per->d));
-	perceptron_backpropagation_free_dw(per, &(per->dw));
-	perceptron_backpropagation_free_rw(per, &(per->rw));
-
 	free(per);
 	*per_ptr = NULL;
 
-	return 1;
+	return 1;
+}
+
+/**
+ * Creates an execution context for a perceptron.
+ * The weight deltas cube is only allocated when accumulating.
+ *
+ * @param per Initialized perceptron
+ * @param ctx_ptr Uninitialized context by reference
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int perceptron_ctx_create(perceptron per, perceptron_ctx * ctx_ptr){
+	int ni = per->n[0] + 1, nh = per->n[1] + 1, no = per->n[2];
+	real * raw = NULL;
+	perceptron_ctx ctx = NULL;
+
+	if( (ctx = (perceptron_ctx) calloc (1, sizeof(perceptron_ctx_t))) == NULL )
+		return 0;
+
+	ctx->per = per;
+
+	/* Alloc contiguous memory for net and split it in layers */
+	ctx->net = (real **) malloc (3 * sizeof(real*));
+	raw = (real *) calloc (ni + nh + no, sizeof(real));
+
+	if( ctx->net == NULL || raw == NULL
+			|| perceptron_backpropagation_alloc_d(per, &(ctx->d)) == 0
+			|| perceptron_backpropagation_alloc_rw(per, &(ctx->rw)) == 0 ){
+		printerr("perceptron_ctx_create: Couldn't alloc space for context.\n");
+		free(raw);
+		free(ctx->net);
+		perceptron_backpropagation_free_d(per, &(ctx->d));
+		perceptron_backpropagation_free_rw(per, &(ctx->rw));
+		free(ctx);
+
+		return 0;
+	}
+
+	ctx->net[0] = &(raw[0]);
+	ctx->net[1] = &(raw[ni]);
+	ctx->net[2] = &(raw[ni+nh]);
+
+	/*  Bias value its always 1. 
+	 *  Will be set at last position in both layers by convention */
+	ctx->net[0][ni-1] = 1;
+	ctx->net[1][nh-1] = 1;
+
+	*ctx_ptr = ctx;
+
+	return 1;
+}
+
+/**
+ * Frees an execution context. The perceptron is not modified.
+ *
+ * @param ctx_ptr Initialized context by reference
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int perceptron_ctx_free(perceptron_ctx * ctx_ptr){
+	perceptron_ctx ctx = *ctx_ptr;
+
+	if( ctx == NULL ) {
+		printerr("perceptron_ctx_free: Context already freed.");
+		return 0;
+	}
+
+	/* Free Net.
+	 * net[0] may point to the last fed pattern, the contiguous
+	 * block starts n[0] + 1 values before the hidden layer */
+	free(ctx->net[1] - (ctx->per->n[0] + 1));
+	free(ctx->net);
+
+	perceptron_backpropagation_free_d(ctx->per, &(ctx->d));
+	perceptron_backpropagation_free_dw(ctx->per, &(ctx->dw));
+	perceptron_backpropagation_free_rw(ctx->per, &(ctx->rw));
+
+	free(ctx);
+	*ctx_ptr = NULL;
+
+	return 1;
+}
+
+/**
+ * Allocates the contiguous block for the weight rows.
+ * In fixed geometry builds it is aligned to 64 bytes.
+ *
+ * @param size Size in bytes
+ * @return Allocated block, NULL if unsuccessful
+ */
+static void * perceptron_alloc_rows(size_t size){
+#ifdef PERCEPTRON_FIXED
+	void * raw = NULL;
+
+	if( posix_memalign(&raw, 64, size) != 0 )
+		return NULL;
+
+	return raw;
+#else
+	return malloc(size);
+#endif
 }
 
 /**
- * Initializes a perceptron given by reference
+ * Allocs a perceptron given by reference, with no values set.
  *
- * @parak per Uninitialized perceptron by reference
+ * @param per Uninitialized perceptron by reference
  * @param nin Number of neurons in the input layer
  * @param nhidden Number of neurons in the hidden layer
  * @param nout Number of neurons in the output layer
  * @return 0 if unsuccessful, 1 otherwise
  * */
-int perceptron_create(perceptron * per_ptr, int nin, int nhidden, int nout){
+static int perceptron_alloc(perceptron * per_ptr, int nin, int nhidden, int nout){
 
 	int ni, nh, no;
 	int i, j;
-	double * raw = NULL;
+	real * raw = NULL;
 	perceptron per = NULL; 
 
 	if((per = (perceptron) malloc (sizeof(perceptron_t))) == NULL)
@@ -512,59 +1621,39 @@ int perceptron_create(perceptron * per_ptr, int nin, int nhidden, int nout){
 
 	*per_ptr = per;
 
+	/* Pick the vector kernels for this CPU */
+	simd_init();
+#ifdef PERCEPTRON_FIXED
+	perceptron_fixed_init();
+#endif
+
 	/* Set perceptron dimensions */
 	ni = per->n[0] = nin;
 	nh = per->n[1] = nhidden;
 	no = per->n[2] = nout;
-	per->net = NULL;
+	per->ctx = NULL;
 	per->w = NULL;
 
 	/* Set perceptron default functions */
 	perceptron_setfunc_init(per, perceptron_rand);
-	perceptron_setfunc_error(per, perceptron_mean_square_error);
-	perceptron_setfunc_trans(per, perceptron_bipolarsigmoid);
-	perceptron_setfunc_trans_prima(per, perceptron_bipolarsigmoid_prima);
+	perceptron_setactivation(per, PERCEPTRON_BSIGMOID);
 
 	/*  Use bias as a regular neuron placed at 0 and always valued 1 */
 	ni += 1;
 	nh += 1;
 
-	/*  Net: Neuron values */
-	per->net = (double **) malloc (3 * sizeof(double*));
-	if( per->net == NULL )
-		return 1;
-
-	/* Alloc contiguous memory for net and split it in layers */
-	raw = (double *) malloc ((ni + nh + no) * sizeof(double));
-	per->net[0] = &(raw[0]);
-	per->net[1] = &(raw[ni]);
-	per->net[2] = &(raw[ni+nh]);
-
-	if( raw == NULL ){
-
+	/*  Net: Neuron values and deltas in the default context */
+	if( perceptron_ctx_create(per, &(per->ctx)) == 0 ){
 		printerr("perceptron_create: Couldn't alloc space for net.\n");
-
-		if( per->net[0] != NULL ) free(per->net[0]);
-		if( per->net[1] != NULL ) free(per->net[1]);
-		if( per->net[2] != NULL ) free(per->net[2]);
-		if( per->net != NULL ) free(per->net);
-
 		return 0;
 	}
 
-	/*  Bias value its always 1. 
-	 *  Will be set at last position in both layers by convention */
-	per->net[0][ni-1] = 1;
-	per->net[1][nh-1] = 1;
-
 	/*  Weights */
-	per->w = (double ***) malloc (2 * sizeof(double**));
+	per->w = (real ***) malloc (2 * sizeof(real**));
 
 	if( per->w == NULL ){
 		printerr("perceptron_create: Couldn't alloc space for weights.");
-		for(i = 0; i < 2; ++i)
-			free(per->net[i]);
-		free(per->net);
+		perceptron_ctx_free(&(per->ctx));
 
 		return 0;
 	}
@@ -572,29 +1661,74 @@ int perceptron_create(perceptron * per_ptr, int nin, int nhidden, int nout){
 	/* Input and hidden layers
 	 * ninput neurons + bias to nhidden neurons  */
 
-	/* Alloc contiguous memory for weights and split it within the cube */
-	raw = (double *) malloc (((ni * (nh-1)) + (nh * no)) * sizeof(double));
+	/* Alloc contiguous memory for weights and split it within the cube.
+	 * Rows are padded to PERCEPTRON_ROW() values, which only aligns them
+	 * in fixed geometry builds. */
+	raw = (real *) perceptron_alloc_rows(
+			((PERCEPTRON_ROW(ni) * (nh-1)) + (PERCEPTRON_ROW(nh) * no)) * sizeof(real));
 	if( raw == NULL ){
 		printerr("perceptron_create: Couldn't alloc space for weight values.");
 		return 0;
 	}
 
-	/* For all neuron and bias weight in the input and hidden layer */
+	/* For the input and hidden layer */
 	for(i = 0; i < 2; ++i) {
-		per->w[i] = (double **) malloc ((per->n[i] + 1) * sizeof(double *));
+		per->w[i] = (real **) malloc (per->n[i+1] * sizeof(real *));
 
-		/* For all neuron (no bias) in the next layer */
-		for(j = 0; j < per->n[i] + 1; ++j)
-			per->w[i][j] = &(raw[ (i * ni * (nh-1)) + (j * per->n[i+1]) ]);
+		/* For all neuron (no bias) in the next layer
+		 * a row with the weights from all neurons and bias */
+		for(j = 0; j < per->n[i+1]; ++j)
+			per->w[i][j] = &(raw[ (i * PERCEPTRON_ROW(ni) * (nh-1))
+					+ (j * PERCEPTRON_ROW(per->n[i] + 1)) ]);
 	}
 
-	/* Init delta temporal matrix and cube */
-	perceptron_backpropagation_alloc_d(per, &(per->d));
-	perceptron_backpropagation_alloc_dw(per, &(per->dw));
-	perceptron_backpropagation_alloc_rw(per, &(per->rw));
+	return 1;
+}
+
+/**
+ * Initializes a perceptron given by reference
+ *
+ * @parak per Uninitialized perceptron by reference
+ * @param nin Number of neurons in the input layer
+ * @param nhidden Number of neurons in the hidden layer
+ * @param nout Number of neurons in the output layer
+ * @return 0 if unsuccessful, 1 otherwise
+ * */
+int perceptron_create(perceptron * per_ptr, int nin, int nhidden, int nout){
+	int ret = perceptron_alloc(per_ptr, nin, nhidden, nout);
 
 	/* Set all neurons and weights */
-	return perceptron_reset(per);
+	return (ret == 1 && *per_ptr != NULL && (*per_ptr)->w != NULL) ?
+		perceptron_reset(*per_ptr) : ret;
+}
+
+/**
+ * Initializes a perceptron given by reference as a copy of another one.
+ * The weights are written by the calling thread, so on NUMA machines they
+ * are placed in its node.
+ *
+ * @param copy_ptr Uninitialized perceptron by reference
+ * @param per Initialized perceptron to copy
+ * @return 0 if unsuccessful, 1 otherwise
+ * */
+int perceptron_copy(perceptron * copy_ptr, const perceptron_t * per){
+	int i, k;
+	perceptron copy = NULL;
+
+	if( perceptron_alloc(copy_ptr, per->n[0], per->n[1], per->n[2]) != 1 ||
+			(copy = *copy_ptr) == NULL || copy->w == NULL ) {
+		printerr("perceptron_copy: Couldn't alloc space for the copy.\n");
+		return 0;
+	}
+
+	copy->init = per->init;
+	perceptron_setactivation(copy, per->activation);
+
+	for(i = 0; i < 2; ++i)
+		for(k = 0; k < per->n[i+1]; ++k)
+			memcpy(copy->w[i][k], per->w[i][k], (per->n[i] + 1) * sizeof(real));
+
+	return 1;
 }
 
 /**
@@ -627,7 +1761,7 @@ int perceptron_training(perceptron per, patternset pset, double lrate, double th
 			}
 
 			/* Calculate error */
-			error += (*(per->error))(per->net[2], pset->codes[i], per->n[2]);
+			error += perceptron_error(per, per->ctx->net[2], pset->codes[i]);
 		}
 	}
 
@@ -646,7 +1780,29 @@ int perceptron_training(perceptron per, patternset pset, double lrate, double th
  * @return 0 if unsuccessful, 1 otherwise
  */
 int perceptron_trainingprint(perceptron per, patternset pset, double lrate, double thres, int limit, FILE * stream) {
-	int epoch, i;
+	return perceptron_trainingprint_slices(per, pset, lrate, thres, limit, NULL, stream);
+}
+
+/**
+ * Computes backpropagation for a perceptron and a patternset, one pattern
+ * at a time, with the hidden neurons of each pattern split among threads.
+ * Every neuron does the same operations as with one thread, so the results
+ * are bit-identical to perceptron_trainingprint() for any number of them,
+ * as long as the same kernels are used.
+ * Logs the error per epoch to stream.
+ *
+ * @param per Initialized perceptron
+ * @param pset Initialized patternset
+ * @param lrate Learning rate 
+ * @param thres Error threshold. Iteration stop condition.
+ * @param limit Max number of epochs allowed for the learning.
+ * @param pool Initialized thread pool, NULL to use only the caller
+ * @param stream Output stream
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int perceptron_trainingprint_slices(perceptron per, patternset pset, double lrate,
+		double thres, int limit, threadpool pool, FILE * stream) {
+	int epoch, i, ret;
 	double error = thres + 1;
 	double prev_error = error + 1;
 
@@ -672,13 +1828,16 @@ int perceptron_trainingprint(perceptron per, patternset pset, double lrate, doub
 
 		/* Calculate epoch */
 		for(i = 0; i < pset->npats; ++i) {
-			if( perceptron_backpropagation(per, pset->input[i], pset->codes[i], lrate) == 0 ) {
+			ret = (pool != NULL) ?
+				perceptron_backpropagation_parallel(per, pset->input[i], pset->codes[i], lrate, pool) :
+				perceptron_backpropagation(per, pset->input[i], pset->codes[i], lrate);
+			if( ret == 0 ) {
 				printerr("perceptron_training: Error applying backpropagation at pattern:%i epoch:%i\n", i, epoch);
 				return 0;
 			}
 
 			/* Calculate error */
-			error += (*(per->error))(per->net[2], pset->codes[i], per->n[2]);
+			error += perceptron_error(per, per->ctx->net[2], pset->codes[i]);
 
 			printf("Pattern %d\n", i);
 		}
@@ -693,51 +1852,476 @@ int perceptron_trainingprint(perceptron per, patternset pset, double lrate, doub
 }
 
 /**
- * Sets init function
- * @param fun Function to set.
- * @return old function
+ * Computes mini-batch backpropagation for a perceptron and a patternset.
+ * Weights are updated once per batch of patterns.
+ * Logs the error per epoch to stream.
+ *
+ * @param per Initialized perceptron
+ * @param pset Initialized patternset
+ * @param lrate Learning rate 
+ * @param thres Error threshold. Iteration stop condition.
+ * @param limit Max number of epochs allowed for the learning.
+ * @param batch Number of patterns per weight update.
+ * @param stream Output stream
+ * @return 0 if unsuccessful, 1 otherwise
  */
-perceptron_fun_init perceptron_setfunc_init(perceptron per, double(*fun)()) {
-	double (*tmp)() = per->init;
-	per->init = fun;
-	return tmp;
+int perceptron_trainingprint_batch(perceptron per, patternset pset, double lrate,
+		double thres, int limit, int batch, FILE * stream) {
+	int epoch, i, b, nbatch;
+	double error = thres + 1;
+	perceptron_batch_t bt;
+
+	if(pset->npats == 0){
+		printerr("perceptron_training: empty patternset\n");
+		return 0;
+	}
+
+	if( per->n[2] > pset->ni ) {
+		printerr("perceptron_training: Incompatible output layer sizes for perceptron and patterns.\n");
+		return 0;
+	}
+
+	if( perceptron_batch_alloc(per, &bt, batch) == 0 )
+		return 0;
+
+	/* Print header */
+	if( stream ) fprintf(stream, "#epoch\tneurons\talpha\terror\n");
+
+	/* Until error reaches threshold or epoch limit is reached */
+	for(epoch = 0; error >= thres && epoch < limit; ++epoch){
+		error = 0;
+
+		printf("Epoch: %d\n", epoch);
+
+		/* Calculate epoch a batch at a time */
+		for(i = 0; i < pset->npats; i += nbatch) {
+			nbatch = (pset->npats - i < batch) ? pset->npats - i : batch;
+
+			error += perceptron_backpropagation_batch(per, &bt, &(pset->input[i]),
+					&(pset->codes[i]), nbatch, lrate);
+
+			for(b = i; b < i + nbatch; ++b)
+				printf("Pattern %d\n", b);
+		}
+
+		error /= pset->npats;  /* Error per pattern */
+
+		if( stream )
+			fprintf(stream, "%i\t%i\t%f\t%f\n", epoch, per->n[1], lrate, error);
+	}
+
+	perceptron_batch_release(&bt);
+
+	return 1;
+}
+
+/* Length of the blocks in which gradient buffers are added up */
+#define PERCEPTRON_REDUCE_BLOCK 4096
+
+/* Work shared by all threads in synchronous data-parallel training */
+typedef struct {
+	perceptron per;
+	patternset pset;
+	double lrate;
+
+	int nshards;
+	perceptron_ctx * ctxs;     /* Gradient buffer of each shard (ctx->dw) */
+	perceptron_batch_t * bts;  /* Batch scratch of each shard */
+	double * errors;           /* Error of each shard in the step */
+
+	size_t first, npats;       /* Patterns of the current step */
+	size_t size;               /* Length of the gradient buffers */
+	size_t nblocks;            /* Reduction blocks in a gradient buffer */
+	int stride;                /* Distance between added buffers */
+} perceptron_parallel_t;
+
+/* Flat gradient buffer of a shard, which is contiguous from its first row */
+#define PERCEPTRON_GRADIENT(job, s) ((job)->ctxs[(s)]->dw[0][0])
+
+/* Patterns of a shard in the current step */
+static void perceptron_parallel_shard(perceptron_parallel_t * job, int s,
+		size_t * first, int * npats){
+	size_t begin = job->npats * s / job->nshards,
+		   end = job->npats * (s + 1) / job->nshards;
+
+	*first = job->first + begin;
+	*npats = (int) (end - begin);
+}
+
+/* Computes the gradient of a shard of patterns into its own buffer */
+static void perceptron_parallel_gradient(void * arg, size_t begin, size_t end, int worker){
+	perceptron_parallel_t * job = (perceptron_parallel_t *) arg;
+	perceptron per = job->per;
+	perceptron_batch_t * bt;
+	real *** dw;
+	size_t first;
+	int s, b, npats;
+
+	for(s = (int) begin; s < (int) end; ++s) {
+		bt = &(job->bts[s]);
+		dw = job->ctxs[s]->dw;
+		job->errors[s] = 0;
+
+		memset(PERCEPTRON_GRADIENT(job, s), 0, job->size * sizeof(real));
+
+		perceptron_parallel_shard(job, s, &first, &npats);
+		if( npats == 0 )
+			continue;
+
+		/* Deltas with the weights of the step, as in mini-batch training */
+		perceptron_batch_forward(per, bt, &(job->pset->input[first]), npats, bt->out);
+		perceptron_batch_deltas(per, bt, &(job->pset->codes[first]), npats);
+
+		for(b = 0; b < npats; ++b)
+			job->errors[s] += perceptron_error(per, &(bt->out[b * per->n[2]]),
+					job->pset->codes[first + b]);
+
+		/* Gradient of the whole shard into the shard buffer */
+		simd_gemm_tn(dw[1], per->n[2], bt->dout, per->n[2], job->lrate,
+				bt->hrows, npats, per->n[1] + 1);
+		simd_gemm_tn(dw[0], per->n[1], bt->dhidden, per->n[1], job->lrate,
+				&(job->pset->input[first]), npats, per->n[0] + 1);
+	}
+}
+
+/* One level of the reduction tree: buffer s += buffer s + stride,
+ * for every s multiple of 2 * stride, a block at a time */
+static void perceptron_parallel_reduce(void * arg, size_t begin, size_t end, int worker){
+	perceptron_parallel_t * job = (perceptron_parallel_t *) arg;
+	size_t i, pair, block, off, len;
+	int dst, src;
+
+	for(i = begin; i < end; ++i) {
+		pair = i / job->nblocks;
+		block = i % job->nblocks;
+		dst = (int) pair * 2 * job->stride;
+		src = dst + job->stride;
+
+		off = block * PERCEPTRON_REDUCE_BLOCK;
+		len = (off + PERCEPTRON_REDUCE_BLOCK < job->size) ? PERCEPTRON_REDUCE_BLOCK : job->size - off;
+
+		if( src < job->nshards )
+			simd.axpy(&(PERCEPTRON_GRADIENT(job, dst)[off]), 1.0,
+					&(PERCEPTRON_GRADIENT(job, src)[off]), (int) len);
+	}
+}
+
+/* Adds the reduced gradient (first buffer) to the weight rows */
+static void perceptron_parallel_update(void * arg, size_t begin, size_t end, int worker){
+	perceptron_parallel_t * job = (perceptron_parallel_t *) arg;
+	perceptron per = job->per;
+	real *** dw = job->ctxs[0]->dw;
+	size_t r;
+	int i, k;
+
+	/* Rows of both layers one after the other */
+	for(r = begin; r < end; ++r) {
+		i = (r < (size_t) per->n[1]) ? 0 : 1;
+		k = (i == 0) ? (int) r : (int) r - per->n[1];
+		simd.axpy(per->w[i][k], 1.0, dw[i][k], per->n[i] + 1);
+	}
+}
+
+static void perceptron_parallel_free(perceptron_parallel_t * job){
+	int s;
+
+	for(s = 0; s < job->nshards; ++s) {
+		if( job->ctxs != NULL && job->ctxs[s] != NULL )
+			perceptron_ctx_free(&(job->ctxs[s]));
+		if( job->bts != NULL )
+			perceptron_batch_release(&(job->bts[s]));
+	}
+
+	free(job->ctxs);
+	free(job->bts);
+	free(job->errors);
+}
+
+static int perceptron_parallel_alloc(perceptron_parallel_t * job, int batch){
+	int s, nshards = job->nshards, ok = 1;
+	perceptron per = job->per;
+
+	job->ctxs = (perceptron_ctx *) calloc (nshards, sizeof(perceptron_ctx));
+	job->bts = (perceptron_batch_t *) calloc (nshards, sizeof(perceptron_batch_t));
+	job->errors = (double *) calloc (nshards, sizeof(double));
+
+	if( job->ctxs == NULL || job->bts == NULL || job->errors == NULL ) {
+		free(job->ctxs);
+		free(job->bts);
+		free(job->errors);
+		return 0;
+	}
+
+	/* Every shard gets its own gradient buffer and batch scratch */
+	for(s = 0; ok && s < nshards; ++s)
+		ok = perceptron_ctx_create(per, &(job->ctxs[s]))
+			&& perceptron_backpropagation_alloc_dw(per, &(job->ctxs[s]->dw))
+			&& perceptron_batch_alloc(per, &(job->bts[s]), (batch + nshards - 1) / nshards);
+
+	if( !ok ) {
+		printerr("perceptron_parallel_alloc: Couldn't alloc space for %d shards.\n", nshards);
+		perceptron_parallel_free(job);
+		return 0;
+	}
+
+	job->size = per->n[1] * (per->n[0] + 1) + per->n[2] * (per->n[1] + 1);
+	job->nblocks = (job->size + PERCEPTRON_REDUCE_BLOCK - 1) / PERCEPTRON_REDUCE_BLOCK;
+
+	return 1;
 }
 
 /**
- * Sets error function
- * @param fun Function to set.
- * @return old function
+ * Computes synchronous data-parallel backpropagation for a perceptron and
+ * a patternset. Weights are updated once per batch of patterns, as in
+ * perceptron_trainingprint_batch().
+ *
+ * Each batch is split in shards of patterns, one per thread unless given,
+ * and every shard gradient is computed into its own buffer. Buffers are
+ * then added up in a binary tree, each level in parallel by blocks, and the
+ * result is added to the weights. The shards and the tree only depend on
+ * the batch and the number of shards, not on the threads taking them, so
+ * neither do the weights nor the errors.
+ * Logs the error per epoch to stream.
+ *
+ * @param per Initialized perceptron
+ * @param pset Initialized patternset
+ * @param lrate Learning rate 
+ * @param thres Error threshold. Iteration stop condition.
+ * @param limit Max number of epochs allowed for the learning.
+ * @param batch Number of patterns per weight update.
+ * @param nshards Shards per batch, 0 for one per thread.
+ * @param pool Initialized thread pool
+ * @param stream Output stream
+ * @return 0 if unsuccessful, 1 otherwise
  */
-perceptron_fun_error perceptron_setfunc_error(perceptron per, double(*fun)(double*,size_t,int)) {
-	double(*tmp)(double*,size_t,int) = per->error;
-	per->error = fun;
-	return tmp;
+int perceptron_trainingprint_parallel(perceptron per, patternset pset, double lrate,
+		double thres, int limit, int batch, int nshards, threadpool pool, FILE * stream) {
+	int epoch, s, b;
+	size_t i, nbatch;
+	double error = thres + 1;
+	perceptron_parallel_t job;
+
+	if(pset->npats == 0){
+		printerr("perceptron_training: empty patternset\n");
+		return 0;
+	}
+
+	if( per->n[2] > pset->ni ) {
+		printerr("perceptron_training: Incompatible output layer sizes for perceptron and patterns.\n");
+		return 0;
+	}
+
+	memset(&job, 0, sizeof(job));
+	job.per = per;
+	job.pset = pset;
+	job.lrate = lrate;
+	if( nshards <= 0 )
+		nshards = threadpool_size(pool);
+	job.nshards = (nshards < batch) ? nshards : batch;
+
+	if( perceptron_parallel_alloc(&job, batch) == 0 )
+		return 0;
+
+	/* Print header */
+	if( stream ) fprintf(stream, "#epoch\tneurons\talpha\terror\n");
+
+	/* Until error reaches threshold or epoch limit is reached */
+	for(epoch = 0; error >= thres && epoch < limit; ++epoch){
+		error = 0;
+
+		printf("Epoch: %d\n", epoch);
+
+		/* Calculate epoch a batch at a time */
+		for(i = 0; i < pset->npats; i += nbatch) {
+			nbatch = (pset->npats - i < (size_t) batch) ? pset->npats - i : (size_t) batch;
+			job.first = i;
+			job.npats = nbatch;
+
+			/* Shard gradients */
+			threadpool_for(pool, job.nshards, 1, perceptron_parallel_gradient, &job);
+
+			/* Tree reduction into the first buffer */
+			for(job.stride = 1; job.stride < job.nshards; job.stride *= 2)
+				threadpool_for(pool, ((job.nshards + 2 * job.stride - 1) / (2 * job.stride)) * job.nblocks,
+						1, perceptron_parallel_reduce, &job);
+
+			/* Update weights by rows */
+			threadpool_for(pool, per->n[1] + per->n[2], 16, perceptron_parallel_update, &job);
+
+			for(s = 0; s < job.nshards; ++s)
+				error += job.errors[s];
+
+			for(b = (int) i; b < (int) (i + nbatch); ++b)
+				printf("Pattern %d\n", b);
+		}
+
+		error /= pset->npats;  /* Error per pattern */
+
+		if( stream )
+			fprintf(stream, "%i\t%i\t%f\t%f\n", epoch, per->n[1], lrate, error);
+	}
+
+	perceptron_parallel_free(&job);
+
+	return 1;
+}
+
+/* Work shared by all threads in asynchronous training */
+typedef struct {
+	perceptron per;
+	patternset pset;
+	double lrate;
+
+	perceptron_ctx * ctxs;  /* Context of each worker */
+	double * errors;        /* Error of each worker in the epoch */
+} perceptron_hogwild_t;
+
+/* Creates the context of the worker running it, in its own memory */
+static void perceptron_hogwild_ctx(void * arg, size_t begin, size_t end, int worker){
+	perceptron_hogwild_t * job = (perceptron_hogwild_t *) arg;
+
+	if( !perceptron_ctx_create(job->per, &(job->ctxs[worker])) )
+		job->ctxs[worker] = NULL;
+}
+
+/* Backpropagates the shard of patterns of a worker, updating the shared weights */
+static void perceptron_hogwild_chunk(void * arg, size_t begin, size_t end, int worker){
+	perceptron_hogwild_t * job = (perceptron_hogwild_t *) arg;
+	perceptron_ctx ctx = job->ctxs[worker];
+	size_t i;
+
+	for(i = begin; i < end; ++i) {
+		perceptron_ctx_backpropagation(job->per, ctx, job->pset->input[i],
+				job->pset->codes[i], job->lrate);
+		job->errors[worker] += perceptron_error(job->per, ctx->net[2], job->pset->codes[i]);
+	}
+}
+
+/**
+ * Computes asynchronous (Hogwild) backpropagation for a perceptron and a
+ * patternset.
+ *
+ * Every thread takes the same shard of patterns in every epoch, the one it
+ * decoded if they were read by patternset_readpath_pool() with the same
+ * pool, so they are on its NUMA node. It backpropagates them as the
+ * online trainer does, in its own context, updating the shared weights
+ * in place with no locks at all. Weights may be read while other threads
+ * update them and some concurrent updates may be lost, which is tolerated
+ * as the gradients of each pattern are small and sparse: each weight is
+ * loaded and stored whole, never torn, as they are aligned.
+ * Results depend on the thread timing, so they are not reproducible.
+ * Logs the error per epoch to stream.
+ *
+ * @param per Initialized perceptron
+ * @param pset Initialized patternset
+ * @param lrate Learning rate 
+ * @param thres Error threshold. Iteration stop condition.
+ * @param limit Max number of epochs allowed for the learning.
+ * @param pool Initialized thread pool
+ * @param stream Output stream
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int perceptron_trainingprint_hogwild(perceptron per, patternset pset, double lrate,
+		double thres, int limit, threadpool pool, FILE * stream) {
+	int epoch, t, ok = 1, nthreads = threadpool_size(pool);
+	size_t i;
+	double error = thres + 1;
+	perceptron_hogwild_t job;
+
+	if(pset->npats == 0){
+		printerr("perceptron_training: empty patternset\n");
+		return 0;
+	}
+
+	if( per->n[2] > pset->ni ) {
+		printerr("perceptron_training: Incompatible output layer sizes for perceptron and patterns.\n");
+		return 0;
+	}
+
+	job.per = per;
+	job.pset = pset;
+	job.lrate = lrate;
+	job.ctxs = (perceptron_ctx *) calloc (nthreads, sizeof(perceptron_ctx));
+	job.errors = (double *) calloc (nthreads, sizeof(double));
+
+	if( job.ctxs == NULL || job.errors == NULL )
+		ok = 0;
+
+	/* Each thread creates its own context, so it is local to it */
+	if( ok )
+		threadpool_static(pool, nthreads, perceptron_hogwild_ctx, &job);
+
+	for(t = 0; ok && t < nthreads; ++t)
+		ok = job.ctxs[t] != NULL;
+
+	if( !ok ) {
+		printerr("perceptron_trainingprint_hogwild: Couldn't alloc space for %d threads.\n", nthreads);
+		for(t = 0; job.ctxs != NULL && t < nthreads; ++t)
+			if( job.ctxs[t] != NULL )
+				perceptron_ctx_free(&(job.ctxs[t]));
+		free(job.ctxs);
+		free(job.errors);
+		return 0;
+	}
+
+	/* Print header */
+	if( stream ) fprintf(stream, "#epoch\tneurons\talpha\terror\n");
+
+	/* Until error reaches threshold or epoch limit is reached */
+	for(epoch = 0; error >= thres && epoch < limit; ++epoch){
+		error = 0;
+		memset(job.errors, 0, nthreads * sizeof(double));
+
+		printf("Epoch: %d\n", epoch);
+
+		/* Calculate epoch, patterns are shared among all threads */
+		threadpool_static(pool, pset->npats, perceptron_hogwild_chunk, &job);
+
+		for(t = 0; t < nthreads; ++t)
+			error += job.errors[t];
+
+		for(i = 0; i < pset->npats; ++i)
+			printf("Pattern %zd\n", i);
+
+		error /= pset->npats;  /* Error per pattern */
+
+		if( stream )
+			fprintf(stream, "%i\t%i\t%f\t%f\n", epoch, per->n[1], lrate, error);
+	}
+
+	for(t = 0; t < nthreads; ++t)
+		perceptron_ctx_free(&(job.ctxs[t]));
+	free(job.ctxs);
+	free(job.errors);
+
+	return 1;
 }
 
 /**
- * Sets trans function
+ * Sets init function
  * @param fun Function to set.
  * @return old function
  */
-perceptron_fun_trans perceptron_setfunc_trans(perceptron per, double(*fun)(double)) {
-	double (*tmp)(double) = per->trans;
-	per->trans = fun;
+perceptron_fun_init perceptron_setfunc_init(perceptron per, double(*fun)()) {
+	double (*tmp)() = per->init;
+	per->init = fun;
 	return tmp;
 }
 
 /**
- * Sets trans_prima function * @param fun Function to set.
- * @return old function
+ * Sets the transition function
+ * @param activation Transition function to set.
+ * @return old transition function
  */
-perceptron_fun_trans perceptron_setfunc_trans_prima(perceptron per, double(*fun)(double)) {
-	double (*tmp)(double) = per->trans_prima;
-	per->trans_prima = fun;
+perceptron_activation_t perceptron_setactivation(perceptron per, perceptron_activation_t activation) {
+	perceptron_activation_t tmp = per->activation;
+	per->activation = activation;
 	return tmp;
 }
 
-static int perceptron_backpropagation_alloc_rw(perceptron per, double * **d_ptr){
-	double ** rw = (double **) malloc (2 * sizeof(double *));
-	double * rw_raw = (double *) malloc ((per->n[1] + per->n[2]) * sizeof(double));
+static int perceptron_backpropagation_alloc_rw(const perceptron_t * per, real * **d_ptr){
+	real ** rw = (real **) malloc (2 * sizeof(real *));
+	real * rw_raw = (real *) malloc ((per->n[1] + per->n[2]) * sizeof(real));
 	if( rw != NULL ){
 		rw[0] = &(rw_raw[0]);
 		rw[1] = &(rw_raw[per->n[1]]);
@@ -748,10 +2332,10 @@ static int perceptron_backpropagation_alloc_rw(perceptron per, double * **d_ptr)
 	return rw != NULL;
 }
 
-static int perceptron_backpropagation_alloc_d(perceptron per, double * **d_ptr){
+static int perceptron_backpropagation_alloc_d(const perceptron_t * per, real * **d_ptr){
 	/* Allocation for Neuron deltas */
-	double ** d = (double **) malloc (3 * sizeof(double *));
-	double * d_raw = (double *) calloc (per->n[1] + per->n[2] * 2, sizeof(double));
+	real ** d = (real **) malloc (3 * sizeof(real *));
+	real * d_raw = (real *) calloc (per->n[1] + per->n[2] * 2, sizeof(real));
 
 	if( d != NULL ) {
 		d[0] = &(d_raw[0]); /* Hidden layer neurons (no bias) */
@@ -764,23 +2348,23 @@ static int perceptron_backpropagation_alloc_d(perceptron per, double * **d_ptr){
 	return d != NULL;
 }
 
-static int perceptron_backpropagation_alloc_dw(perceptron per, double * ***dw_ptr){
+static int perceptron_backpropagation_alloc_dw(const perceptron_t * per, real * ***dw_ptr){
 	/* Allocation for Weight corrections */
 	int i = 0, j = 0, size1, size2;
-	double *** dw = (double ***) malloc (2 * sizeof(double **));
-	double * d_raw = NULL;
+	real *** dw = (real ***) malloc (2 * sizeof(real **));
+	real * d_raw = NULL;
 
 	if( dw == NULL )
 		return 0;
 
-	dw[0] = (double **) malloc ((per->n[0] + 1) * sizeof(double*)); /* Input layer weights (+ bias) */
-	dw[1] = (double **) malloc ((per->n[1] + 1) * sizeof(double*)); /* Hidden layer weights (+ bias) */
+	dw[0] = (real **) malloc (per->n[1] * sizeof(real*)); /* Input layer weights rows */
+	dw[1] = (real **) malloc (per->n[2] * sizeof(real*)); /* Hidden layer weights rows */
 
 	/* Alloc contiguous memory and split it afterwards */
 	size1 = per->n[1] * (per->n[0] + 1);  /* First layer weights */
 	size2 = per->n[2] * (per->n[1] + 1);  /* Second layer weights */
 
-	d_raw = (double *) calloc (size1 + size2, sizeof(double));
+	d_raw = (real *) calloc (size1 + size2, sizeof(real));
 
 	if( d_raw == NULL ){
 		printerr("ERROR: Couldn't alloc space for weight deltas.\n");
@@ -788,21 +2372,21 @@ static int perceptron_backpropagation_alloc_dw(perceptron per, double * ***dw_pt
 		free(dw[1]);
 		free(dw);
 
-		return 1;
+		return 0;
 	}
 
-	/* Associate layers */
+	/* Associate layers, one row (+ bias) per neuron in the next layer */
 	for(i = 0; i < 2; ++i)
-		for(j = 0; j < per->n[i] + 1; ++j)
-			dw[i][j] = &(d_raw[ i * size1 + j * per->n[i+1] ]);
+		for(j = 0; j < per->n[i+1]; ++j)
+			dw[i][j] = &(d_raw[ i * size1 + j * (per->n[i] + 1) ]);
 
 	*dw_ptr = dw;
 
 	return dw != NULL;
 }
 
-static int perceptron_backpropagation_free_rw(perceptron per, double * **d_ptr){
-	double ** rw = *d_ptr;
+static int perceptron_backpropagation_free_rw(const perceptron_t * per, real * **d_ptr){
+	real ** rw = *d_ptr;
 
 	if( rw != NULL ){
 		free(*rw);
@@ -814,8 +2398,8 @@ static int perceptron_backpropagation_free_rw(perceptron per, double * **d_ptr){
 	return 1;
 }
 
-static int perceptron_backpropagation_free_d(perceptron per, double * **d_ptr){
-	double ** d = *d_ptr;
+static int perceptron_backpropagation_free_d(const perceptron_t * per, real * **d_ptr){
+	real ** d = *d_ptr;
 
 	/* Free resources */
 	if( d != NULL ) {
@@ -828,12 +2412,14 @@ static int perceptron_backpropagation_free_d(perceptron per, double * **d_ptr){
 	return 1;
 }
 
-static int perceptron_backpropagation_free_dw(perceptron per, double * ***dw_ptr){
-	double *** dw = *dw_ptr;
+static int perceptron_backpropagation_free_dw(const perceptron_t * per, real * ***dw_ptr){
+	real *** dw = *dw_ptr;
 
 	/* Free resources */
 	if( dw != NULL ) {
-		free(*dw);  /* Free contiguous data */
+		free(dw[0][0]);  /* Free contiguous data */
+		free(dw[0]);
+		free(dw[1]);
 		free(dw);
 	}
 
@@ -8,19 +8,45 @@
 #include <stdio.h>
 
 #include "pattern.h"
+#include "threadpool.h"
+
+/**
+ * Transition functions. Each of them has its own inlined code to compute
+ * a whole layer, and its derivative from the already computed values.
+ * Mean square error is used against 1 for the active output neuron and
+ * the low value of the function for the rest.
+ *
+ * PERCEPTRON_BSIGMOID: Bipolar sigmoid, 2 / (1 + exp(-x)) - 1. Low is -1.
+ * PERCEPTRON_LOGISTIC: Logistic, 1 / (1 + exp(-x)). Low is 0.
+ * PERCEPTRON_TANH: Hyperbolic tangent. Low is -1.
+ * PERCEPTRON_RELU: Rectifier, max(0, x). Low is 0.
+ */
+typedef enum {
+	PERCEPTRON_BSIGMOID = 0,
+	PERCEPTRON_LOGISTIC,
+	PERCEPTRON_TANH,
+	PERCEPTRON_RELU
+} perceptron_activation_t;
+
+struct perceptron_ctx_t;
+struct perceptron_batch_t;
+
+/* Scratch space to feed batches of patterns forward */
+typedef struct perceptron_batch_t * perceptron_batch;
 
 /**
  * n: Layers lengths. 0 for input, 1 for hidden and 2 for output layer.
- * net: Neuron values along iterations (matrix: [ni+1, nh+1, no])
- * w: Neuron weighted conections (cube: [ni+1 x [nh], nh+1 x [no]])
+ * w: Neuron weighted conections (cube: [nh x [ni+1], no x [nh+1]])
+ *    w[i][k][j] is the weight from neuron j in layer i to neuron k in
+ *    layer i+1, so every neuron input weights are contiguous in memory.
+ * ctx: Default execution context, used by all the functions taking a
+ *      perceptron. Other contexts can be created with perceptron_ctx_create().
  *
- * All this functions can be setted to modify the way the perceptron
- * works.
+ * Weights have the precision set in real.h.
  *
  * init: Initialize net weights. (default is rand in [-1,1])
- * error: Net error. (default is mean square error)
- * trans: Transition function. (default is bipolar sigmoid)
- * trans_prima: Transition function for bkpr. (default is bipolar sigmoid prima)
+ *       Can be set to modify the way the perceptron starts.
+ * activation: Transition function. (default is bipolar sigmoid)
  *
  * Perceptron description file format
  *
@@ -36,26 +62,87 @@
 typedef struct {
 	int n[3];
 
-	double ** net; /* neuron values */
-	double *** w;  /* weights */
+	real *** w;  /* weights */
 
-	/* Internals */
-	double ** d;   /* output delta */
-	double ** rw;   /* neuron raw inputs */
-	double *** dw;  /* delta weights */
+	struct perceptron_ctx_t * ctx;  /* default context */
 
 	double(*init)();              /* initialization function */
-	double(*trans)(double);       /* transition function */
-	double(*trans_prima)(double); /* prima transition function */
-	double(*error)(double*,size_t,int); /* error function */
+	perceptron_activation_t activation;  /* transition function */
 } perceptron_t;
 
 typedef perceptron_t * perceptron;
 
+/**
+ * Execution context: all the values that change while a pattern is fed
+ * forward or backpropagated through a perceptron.
+ *
+ * The perceptron is only read through a context, so any number of them can
+ * feed patterns through the same perceptron at once, one per thread, with
+ * no locking and a single copy of the weights.
+ *
+ * per: Perceptron it works with.
+ * net: Neuron values along iterations (matrix: [ni+1, nh+1, no])
+ *      net[0] points to the last pattern fed, net[2] is the output.
+ * d: Neuron deltas (hidden and output layers)
+ * rw: Neuron raw inputs (hidden and output layers)
+ * dw: Weight deltas, only in the gradient buffers of data parallel training
+ */
+typedef struct perceptron_ctx_t {
+	const perceptron_t * per;
+
+	real ** net;
+	real ** d;
+	real ** rw;
+	real *** dw;
+} perceptron_ctx_t;
+
+typedef perceptron_ctx_t * perceptron_ctx;
+
+/**
+ * Transition function evaluation modes.
+ *
+ * PERCEPTRON_EXACT: libm exp for every neuron.
+ * PERCEPTRON_POLY: Vectorized polynomial exp. Max error below 1e-11.
+ * PERCEPTRON_TABLE: Interpolated table lookup. Max error below 1.5e-6.
+ * With float precision rounding adds to them: below 2.5e-7 and 2e-6.
+ */
+typedef enum {
+	PERCEPTRON_EXACT = 0,
+	PERCEPTRON_POLY,
+	PERCEPTRON_TABLE
+} perceptron_mode_t;
+
+/**
+ * Perceptron quantized to 8 bits for inference.
+ *
+ * n: Layers lengths, as in the perceptron.
+ * bpp: Bytes per input pixel. Each byte of the pixels is a plane of
+ *      unsigned bytes, and pixel values are sum(plane[b] * 256^b).
+ * q: Weight rows with no bias, q[i][k] from layer i to neuron k of layer i+1.
+ *    Weights are w[i][k][j] ~ scale[i][k] * q[i][k][j].
+ * scale: Scale of each neuron weight row.
+ * qsum: Sum of each quantized weight row.
+ * bias: Bias weight of each neuron.
+ *
+ * Hidden values of each pattern are quantized as unsigned bytes along their
+ * range, h ~ min + u * step, so both layers are computed as dot products of
+ * unsigned and signed bytes with 32 bit accumulation.
+ */
+typedef struct {
+	int n[3];
+	int bpp;
+	perceptron_activation_t activation;
+
+	signed char ** q[2];
+	real * scale[2];
+	int * qsum[2];
+	real * bias[2];
+} qperceptron_t;
+
+typedef qperceptron_t * qperceptron;
+
 /* Perceptron function types  */
 typedef double(*perceptron_fun_init)();
-typedef double(*perceptron_fun_trans)(double);
-typedef double(*perceptron_fun_error)(double*,size_t,int);
 
 /**
  * Initializes a perceptron passed by reference
@@ -68,6 +155,33 @@ typedef double(*perceptron_fun_error)(double*,size_t,int);
  * */
 int perceptron_create(perceptron * per, int nin, int nhidden, int nout);
 
+/**
+ * Initializes a perceptron passed by reference as a copy of another one,
+ * with its weights written by the calling thread.
+ *
+ * @param copy_ptr Uninitialized perceptron by reference
+ * @param per Initialized perceptron to copy
+ * @return 0 if unsuccessful, 1 otherwise
+ * */
+int perceptron_copy(perceptron * copy_ptr, const perceptron_t * per);
+
+/**
+ * Creates an execution context for a perceptron.
+ *
+ * @param per Initialized perceptron
+ * @param ctx_ptr Uninitialized context by reference
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int perceptron_ctx_create(perceptron per, perceptron_ctx * ctx_ptr);
+
+/**
+ * Frees an execution context. The perceptron is not modified.
+ *
+ * @param ctx_ptr Initialized context by reference
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int perceptron_ctx_free(perceptron_ctx * ctx_ptr);
+
 /**
  * Reads perceptron weights and structure from stream.
  *
@@ -154,6 +268,87 @@ int perceptron_training(perceptron per, patternset pset, double lrate, double th
  */
 int perceptron_trainingprint(perceptron per, patternset pset, double lrate, double thres, int limit, FILE * stream); 
 
+/**
+ * Computes backpropagation for a perceptron and a patternset, one pattern
+ * at a time as perceptron_trainingprint(), sharing the hidden neurons of
+ * each pattern among all threads. Same results for any number of threads
+ * with the same kernels. Threads wait for each other twice per pattern, so
+ * throughput is lower than perceptron_trainingprint_hogwild(), and patterns
+ * of small nets are not split at all.
+ * Logs the error per epoch to stream.
+ *
+ * @param per Initialized perceptron
+ * @param pset Initialized patternset
+ * @param lrate Learning rate 
+ * @param thres Error threshold. Iteration stop condition.
+ * @param limit Max number of epochs allowed for the learning.
+ * @param pool Initialized thread pool
+ * @param stream Output stream
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int perceptron_trainingprint_slices(perceptron per, patternset pset, double lrate,
+		double thres, int limit, threadpool pool, FILE * stream);
+
+/**
+ * Computes mini-batch backpropagation for a perceptron and a patternset.
+ * Weights are updated once per batch of patterns.
+ * Logs the error per epoch to stream.
+ *
+ * @param per Initialized perceptron
+ * @param pset Initialized patternset
+ * @param lrate Learning rate 
+ * @param thres Error threshold. Iteration stop condition.
+ * @param limit Max number of epochs allowed for the learning.
+ * @param batch Number of patterns per weight update.
+ * @param stream Output stream
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int perceptron_trainingprint_batch(perceptron per, patternset pset, double lrate,
+		double thres, int limit, int batch, FILE * stream);
+
+/* Shards per batch for reproducible data-parallel training */
+#define PERCEPTRON_SHARDS 8
+
+/**
+ * Computes synchronous data-parallel backpropagation for a perceptron and
+ * a patternset. Weights are updated once per batch of patterns, with the
+ * gradients that threads compute for each shard of the batch.
+ * Results only depend on the number of shards, so with a fixed one (eg.
+ * PERCEPTRON_SHARDS) they are bit-identical for any number of threads.
+ * Logs the error per epoch to stream.
+ *
+ * @param per Initialized perceptron
+ * @param pset Initialized patternset
+ * @param lrate Learning rate 
+ * @param thres Error threshold. Iteration stop condition.
+ * @param limit Max number of epochs allowed for the learning.
+ * @param batch Number of patterns per weight update.
+ * @param nshards Shards per batch, 0 for one per thread.
+ * @param pool Initialized thread pool
+ * @param stream Output stream
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int perceptron_trainingprint_parallel(perceptron per, patternset pset, double lrate,
+		double thres, int limit, int batch, int nshards, threadpool pool, FILE * stream);
+
+/**
+ * Computes asynchronous (Hogwild) backpropagation for a perceptron and a
+ * patternset. Every thread backpropagates its own patterns and updates the
+ * shared weights in place, with no locks. Results are not reproducible.
+ * Logs the error per epoch to stream.
+ *
+ * @param per Initialized perceptron
+ * @param pset Initialized patternset
+ * @param lrate Learning rate 
+ * @param thres Error threshold. Iteration stop condition.
+ * @param limit Max number of epochs allowed for the learning.
+ * @param pool Initialized thread pool
+ * @param stream Output stream
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int perceptron_trainingprint_hogwild(perceptron per, patternset pset, double lrate,
+		double thres, int limit, threadpool pool, FILE * stream);
+
 /**
  * Computes backpropagation for a perceptron and a given pattern.
  *
@@ -165,6 +360,21 @@ int perceptron_trainingprint(perceptron per, patternset pset, double lrate, doub
  */
 int perceptron_backpropagation(perceptron per, pattern pat, size_t code, double lrate);
 
+/**
+ * Computes backpropagation for a perceptron and a given pattern, sharing
+ * the hidden neurons among all threads of a pool. Same result as
+ * perceptron_backpropagation(), with lower latency for large input layers.
+ *
+ * @param per Initialized perceptron
+ * @param pat Initialized pattern
+ * @param code Output pattern
+ * @param lrate Learning rate 
+ * @param pool Initialized thread pool
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int perceptron_backpropagation_parallel(perceptron per, pattern pat, size_t code,
+		double lrate, threadpool pool);
+
 /** 
  * Computes forward feeding for perceptron given a pattern.
  *
@@ -175,29 +385,120 @@ int perceptron_backpropagation(perceptron per, pattern pat, size_t code, double
 int perceptron_feedforward(perceptron per, pattern pat);
 
 /**
- * Sets init function
- * @param fun Function to set.
- * @return old function
+ * Computes forward feeding through the perceptron of a context.
+ * Output layer values are left in ctx->net[2].
+ * Safe to be called from several threads, each one with its own context.
+ *
+ * @param ctx Initialized context
+ * @param pat Initialized pattern
+ * @return 0 if unsuccessful, 1 otherwise
  */
-perceptron_fun_init perceptron_setfunc_init(perceptron per, double(*fun)());
+int perceptron_ctx_feedforward(perceptron_ctx ctx, pattern pat);
 
 /**
- * Sets error function
- * @param fun Function to set.
- * @return old function
+ * Computes forward feeding for a batch of patterns at once.
+ * Perceptron net values are not modified, so it is safe to be called from
+ * several threads, each one with its own batch scratch.
+ *
+ * @param per Initialized perceptron
+ * @param bt Batch scratch for at least nbatch patterns, NULL to use a new one
+ * @param patterns Initialized patterns (nbatch)
+ * @param nbatch Number of patterns
+ * @param out Output layer values for each pattern (nbatch x n[2])
+ * @return 0 if unsuccessful, 1 otherwise
  */
-perceptron_fun_error perceptron_setfunc_error(perceptron per, double(*fun)(double*,size_t, int));
+int perceptron_feedforward_batch(perceptron per, perceptron_batch bt, pattern * patterns,
+		int nbatch, real * out);
 
 /**
- * Sets trans function
- * @param fun Function to set.
- * @return old function
+ * Creates the scratch space to feed batches of patterns forward, so it is
+ * allocated once instead of for every batch. It can be used with any
+ * perceptron of the same layer lengths.
+ *
+ * @param per Initialized perceptron
+ * @param bt_ptr Uninitialized batch scratch by reference
+ * @param nbatch Max number of patterns per batch
+ * @return 0 if unsuccessful, 1 otherwise
  */
-perceptron_fun_trans perceptron_setfunc_trans(perceptron per, double(*fun)(double));
+int perceptron_batch_create(perceptron per, perceptron_batch * bt_ptr, int nbatch);
 
 /**
- * Sets trans_prima function
+ * Frees a batch scratch.
+ *
+ * @param bt_ptr Initialized batch scratch by reference
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int perceptron_batch_free(perceptron_batch * bt_ptr);
+
+/**
+ * Quantizes a trained perceptron to 8 bit weights with per neuron scales.
+ *
+ * @param per Initialized perceptron
+ * @param bpp Bytes per pixel of the input patterns
+ * @param qper_ptr Uninitialized quantized perceptron by reference
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int perceptron_quantize(perceptron per, int bpp, qperceptron * qper_ptr);
+
+/**
+ * Frees a quantized perceptron
+ *
+ * @param qper_ptr Initialized quantized perceptron by reference
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int perceptron_quant_free(qperceptron * qper_ptr);
+
+/**
+ * Size of the scratch space for perceptron_feedforward_quant(), so it can
+ * be allocated once instead of for every pattern.
+ *
+ * @param qper Initialized quantized perceptron
+ * @return Scratch size in bytes
+ */
+size_t perceptron_quant_scratch(qperceptron qper);
+
+/**
+ * Computes forward feeding for a quantized perceptron given the raw
+ * image data of a pattern, as read from the PNG file.
+ * Safe to be called from several threads, each one with its own scratch.
+ *
+ * @param qper Initialized quantized perceptron
+ * @param scratch perceptron_quant_scratch() bytes, NULL to use a new one
+ * @param bytes Raw image data (n[0] x bpp bytes)
+ * @param out Output layer values (n[2])
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int perceptron_feedforward_quant(qperceptron qper, void * scratch, const unsigned char * bytes,
+		real * out);
+
+/**
+ * Sets how the transition function is evaluated for all perceptrons.
+ * Should be called at startup. Default is PERCEPTRON_EXACT.
+ *
+ * @param mode Evaluation mode
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int perceptron_setmode(perceptron_mode_t mode);
+
+/**
+ * Measures the transition function error of the current mode against the
+ * exact one, along all the range where it is not saturated.
+ *
+ * @param prima_error Where to set the max error of the derivative, or NULL
+ * @return Max absolute error of the transition function
+ */
+double perceptron_mode_maxerror(double * prima_error);
+
+/**
+ * Sets init function
  * @param fun Function to set.
  * @return old function
  */
-perceptron_fun_trans perceptron_setfunc_trans_prima(perceptron per, double(*fun)(double));
+perceptron_fun_init perceptron_setfunc_init(perceptron per, double(*fun)());
+
+/**
+ * Sets the transition function
+ * @param activation Transition function to set.
+ * @return old transition function
+ */
+perceptron_activation_t perceptron_setactivation(perceptron per, perceptron_activation_t activation);
@@ -0,0 +1,146 @@
+/*
+ *       Filename:  queue.c
+ *    Description:  Bounded lock-free queue of pointers
+ *         Author:  Javier Santacruz <francisco.santacruz@estudiante.uam.es>
+ *
+ */
+
+#include "queue.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+/*  Handy macros */
+#ifndef printerr
+ #define printerr(...) fprintf(stderr, __VA_ARGS__)
+#endif
+
+/* Keeps positions written by producers and consumers in their own lines */
+#define QUEUE_LINE 64
+
+/**
+ * seq: Position the slot is ready for. Equal to the tail position when it
+ *      can be written, one more when it can be read.
+ * item: Queued item.
+ */
+typedef struct {
+	size_t seq;
+	void * item;
+} queue_slot_t;
+
+/**
+ * slots: Ring of capacity slots, a power of two.
+ * mask: capacity - 1.
+ * tail: Next position to push to, atomic.
+ * head: Next position to pop from, atomic.
+ */
+struct queue_t {
+	queue_slot_t * slots;
+	size_t mask;
+	char pad0[QUEUE_LINE];
+	size_t tail;
+	char pad1[QUEUE_LINE];
+	size_t head;
+	char pad2[QUEUE_LINE];
+};
+
+int queue_create(queue * queue_ptr, size_t capacity){
+	size_t i, n = 1;
+	queue q = NULL;
+
+	while( n < capacity )
+		n <<= 1;
+
+	if( (q = (queue) calloc (1, sizeof(struct queue_t))) == NULL ||
+			(q->slots = (queue_slot_t *) malloc (n * sizeof(queue_slot_t))) == NULL ) {
+		printerr("queue_create: Couldn't alloc space for %zu items.\n", n);
+		free(q);
+		return 0;
+	}
+
+	for(i = 0; i < n; ++i)
+		q->slots[i].seq = i;
+	q->mask = n - 1;
+
+	*queue_ptr = q;
+
+	return 1;
+}
+
+int queue_free(queue * queue_ptr){
+	if( *queue_ptr == NULL ) {
+		printerr("queue_free: Queue already freed.");
+		return 0;
+	}
+
+	free((*queue_ptr)->slots);
+	free(*queue_ptr);
+	*queue_ptr = NULL;
+
+	return 1;
+}
+
+int queue_push(queue q, void * item){
+	queue_slot_t * slot = NULL;
+	size_t pos = __atomic_load_n(&(q->tail), __ATOMIC_RELAXED), seq;
+	intptr_t dif;
+
+	for(;;) {
+		slot = &(q->slots[pos & q->mask]);
+		seq = __atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE);
+		dif = (intptr_t) seq - (intptr_t) pos;
+
+		/* Free slot, try to take the position */
+		if( dif == 0 ) {
+			if( __atomic_compare_exchange_n(&(q->tail), &pos, pos + 1, 1,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED) )
+				break;
+
+		/* Still holds the item from a lap ago */
+		} else if( dif < 0 ) {
+			return 0;
+
+		/* Someone else took it */
+		} else {
+			pos = __atomic_load_n(&(q->tail), __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->item = item;
+	__atomic_store_n(&(slot->seq), pos + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+int queue_pop(queue q, void ** item_ptr){
+	queue_slot_t * slot = NULL;
+	size_t pos = __atomic_load_n(&(q->head), __ATOMIC_RELAXED), seq;
+	intptr_t dif;
+
+	for(;;) {
+		slot = &(q->slots[pos & q->mask]);
+		seq = __atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE);
+		dif = (intptr_t) seq - (intptr_t) (pos + 1);
+
+		/* Written slot, try to take the position */
+		if( dif == 0 ) {
+			if( __atomic_compare_exchange_n(&(q->head), &pos, pos + 1, 1,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED) )
+				break;
+
+		/* Not written yet */
+		} else if( dif < 0 ) {
+			return 0;
+
+		/* Someone else took it */
+		} else {
+			pos = __atomic_load_n(&(q->head), __ATOMIC_RELAXED);
+		}
+	}
+
+	*item_ptr = slot->item;
+	__atomic_store_n(&(slot->seq), pos + q->mask + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
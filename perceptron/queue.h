@@ -0,0 +1,57 @@
+/*
+ *       Filename:  queue.h
+ *    Description:  Bounded lock-free queue of pointers
+ *         Author:  Javier Santacruz <francisco.santacruz@estudiante.uam.es>
+ *
+ *   Any number of threads can push and pop at once. Every slot has a
+ *   sequence number telling whether it is ready to be written or read, so
+ *   threads only race for the head or the tail position, with no locks.
+ *   Nothing waits: pushing to a full queue or popping from an empty one
+ *   fails right away, and the caller decides what to do meanwhile.
+ */
+
+#ifndef _QUEUE_H_
+#define _QUEUE_H_
+
+#include <stddef.h>
+
+struct queue_t;
+
+typedef struct queue_t * queue;
+
+/**
+ * Creates an empty queue.
+ *
+ * @param queue_ptr Uninitialized queue by reference
+ * @param capacity Max number of items, rounded up to a power of two
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int queue_create(queue * queue_ptr, size_t capacity);
+
+/**
+ * Frees a queue. Items still in it are not freed.
+ *
+ * @param queue_ptr Initialized queue by reference
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int queue_free(queue * queue_ptr);
+
+/**
+ * Adds an item at the tail.
+ *
+ * @param q Initialized queue
+ * @param item Item to add
+ * @return 0 if the queue was full, 1 otherwise
+ */
+int queue_push(queue q, void * item);
+
+/**
+ * Takes the item at the head.
+ *
+ * @param q Initialized queue
+ * @param item_ptr Taken item, by reference
+ * @return 0 if the queue was empty, 1 otherwise
+ */
+int queue_pop(queue q, void ** item_ptr);
+
+#endif
@@ -0,0 +1,22 @@
+/*
+ *       Filename:  real.h
+ *    Description:  Floating point precision for patterns and perceptrons
+ *         Author:  Javier Santacruz <francisco.santacruz@estudiante.uam.es>
+ *
+ *   Patterns, neuron values and weights are double by default.
+ *   Building with -DPERCEPTRON_FLOAT (make PRECISION=float) makes them
+ *   single precision, which halves the memory and doubles the vector width.
+ */
+
+#ifndef _REAL_H_
+#define _REAL_H_
+
+#ifdef PERCEPTRON_FLOAT
+ typedef float real;
+ #define REAL_NAME "float"
+#else
+ typedef double real;
+ #define REAL_NAME "double"
+#endif
+
+#endif
@@ -0,0 +1,915 @@
+/*
+ *       Filename:  simd.c
+ *    Description:  Vectorized kernels for the perceptron layers
+ *         Author:  Javier Santacruz <francisco.santacruz@estudiante.uam.es>
+ *
+ *   The vector versions are compiled with per function target attributes,
+ *   so no special compiler flags are needed and the binary still runs on
+ *   CPUs without them. Loops run forwards over contiguous memory and the
+ *   remainders are done with scalar code (or masks in AVX-512).
+ *
+ *   Kernels which work value by value (axpy, scale, delta, bsigmoid) give
+ *   each value the same operations wherever it is, vector body or
+ *   remainder, so working on a slice of a layer gives the same values as
+ *   working on all of it. AVX2 ones use FMA, so their remainders are masked
+ *   too instead of left to the scalar code.
+ *
+ *   Kernels are written once for both precisions in real.h through the
+ *   v128, v256 and v512 macros below.
+ */
+
+#include "simd.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+ #define SIMD_X86 1
+ #include <immintrin.h>
+#endif
+
+#ifdef SIMD_X86
+ #ifdef PERCEPTRON_FLOAT
+  #define V128_N 4
+  #define v128 __m128
+  #define v128_zero _mm_setzero_ps
+  #define v128_set1 _mm_set1_ps
+  #define v128_load _mm_loadu_ps
+  #define v128_store _mm_storeu_ps
+  #define v128_add _mm_add_ps
+  #define v128_sub _mm_sub_ps
+  #define v128_mul _mm_mul_ps
+
+  #define V256_N 8
+  #define v256 __m256
+  #define v256_zero _mm256_setzero_ps
+  #define v256_set1 _mm256_set1_ps
+  #define v256_load _mm256_loadu_ps
+  #define v256_store _mm256_storeu_ps
+  #define v256_add _mm256_add_ps
+  #define v256_sub _mm256_sub_ps
+  #define v256_mul _mm256_mul_ps
+  #define v256_div _mm256_div_ps
+  #define v256_min _mm256_min_ps
+  #define v256_max _mm256_max_ps
+  #define v256_fmadd _mm256_fmadd_ps
+  #define v256_fnmadd _mm256_fnmadd_ps
+  #define v256_round _mm256_round_ps
+  #define v256_maskload _mm256_maskload_ps
+  #define v256_maskstore _mm256_maskstore_ps
+  #define V256_TAIL(r) _mm256_cmpgt_epi32(_mm256_set1_epi32(r), \
+		_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7))
+
+  #define V512_N 16
+  #define v512 __m512
+  #define v512_mask __mmask16
+  #define v512_zero _mm512_setzero_ps
+  #define v512_set1 _mm512_set1_ps
+  #define v512_load _mm512_loadu_ps
+  #define v512_store _mm512_storeu_ps
+  #define v512_maskz_load _mm512_maskz_loadu_ps
+  #define v512_mask_store _mm512_mask_storeu_ps
+  #define v512_add _mm512_add_ps
+  #define v512_sub _mm512_sub_ps
+  #define v512_mul _mm512_mul_ps
+  #define v512_div _mm512_div_ps
+  #define v512_min _mm512_min_ps
+  #define v512_max _mm512_max_ps
+  #define v512_fmadd _mm512_fmadd_ps
+  #define v512_fnmadd _mm512_fnmadd_ps
+  #define v512_round _mm512_roundscale_ps
+  #define v512_scalef _mm512_scalef_ps
+  #define v512_reduce _mm512_reduce_add_ps
+ #else
+  #define V128_N 2
+  #define v128 __m128d
+  #define v128_zero _mm_setzero_pd
+  #define v128_set1 _mm_set1_pd
+  #define v128_load _mm_loadu_pd
+  #define v128_store _mm_storeu_pd
+  #define v128_add _mm_add_pd
+  #define v128_sub _mm_sub_pd
+  #define v128_mul _mm_mul_pd
+
+  #define V256_N 4
+  #define v256 __m256d
+  #define v256_zero _mm256_setzero_pd
+  #define v256_set1 _mm256_set1_pd
+  #define v256_load _mm256_loadu_pd
+  #define v256_store _mm256_storeu_pd
+  #define v256_add _mm256_add_pd
+  #define v256_sub _mm256_sub_pd
+  #define v256_mul _mm256_mul_pd
+  #define v256_div _mm256_div_pd
+  #define v256_min _mm256_min_pd
+  #define v256_max _mm256_max_pd
+  #define v256_fmadd _mm256_fmadd_pd
+  #define v256_fnmadd _mm256_fnmadd_pd
+  #define v256_round _mm256_round_pd
+  #define v256_maskload _mm256_maskload_pd
+  #define v256_maskstore _mm256_maskstore_pd
+  #define V256_TAIL(r) _mm256_cmpgt_epi64(_mm256_set1_epi64x(r), \
+		_mm256_setr_epi64x(0, 1, 2, 3))
+
+  #define V512_N 8
+  #define v512 __m512d
+  #define v512_mask __mmask8
+  #define v512_zero _mm512_setzero_pd
+  #define v512_set1 _mm512_set1_pd
+  #define v512_load _mm512_loadu_pd
+  #define v512_store _mm512_storeu_pd
+  #define v512_maskz_load _mm512_maskz_loadu_pd
+  #define v512_mask_store _mm512_mask_storeu_pd
+  #define v512_add _mm512_add_pd
+  #define v512_sub _mm512_sub_pd
+  #define v512_mul _mm512_mul_pd
+  #define v512_div _mm512_div_pd
+  #define v512_min _mm512_min_pd
+  #define v512_max _mm512_max_pd
+  #define v512_fmadd _mm512_fmadd_pd
+  #define v512_fnmadd _mm512_fnmadd_pd
+  #define v512_round _mm512_roundscale_pd
+  #define v512_scalef _mm512_scalef_pd
+  #define v512_reduce _mm512_reduce_add_pd
+ #endif
+
+ /* Mask for the first r lanes (all of them if r >= V512_N) */
+ #define V512_TAIL(r) (((r) >= V512_N) ? (v512_mask) ~0u : (v512_mask) ((1u << (r)) - 1))
+#endif
+
+/* Plain C kernels. Used as remainder loops and when nothing else is available. */
+
+static real scalar_dot(const real * a, const real * b, int n){
+	int i;
+	real sum = 0;
+
+	for(i = 0; i < n; ++i)
+		sum += a[i] * b[i];
+
+	return sum;
+}
+
+static void scalar_axpy(real * y, real a, const real * x, int n){
+	int i;
+
+	for(i = 0; i < n; ++i)
+		y[i] += a * x[i];
+}
+
+static void scalar_scale(real * y, real a, const real * x, int n){
+	int i;
+
+	for(i = 0; i < n; ++i)
+		y[i] = a * x[i];
+}
+
+/* Same operations as the SSE2 body, in the precision of real */
+static void scalar_delta(real * d, const real * y, int n){
+	int i;
+	const real half = 0.5, one = 1;
+
+	for(i = 0; i < n; ++i)
+		d[i] = d[i] * (half * ((one + y[i]) * (one - y[i])));
+}
+
+static void scalar_gemm4x4(real * c, int ldc, real * const * a, real * const * b,
+		int k0, int kn){
+	int i, j, k;
+	real sum[4][4] = {{0}};
+
+	for(k = k0; k < k0 + kn; ++k)
+		for(i = 0; i < 4; ++i)
+			for(j = 0; j < 4; ++j)
+				sum[i][j] += a[i][k] * b[j][k];
+
+	for(i = 0; i < 4; ++i)
+		for(j = 0; j < 4; ++j)
+			c[i * ldc + j] += sum[i][j];
+}
+
+static void scalar_axpyn(real * y, const real * a, real * const * x, int nx,
+		int k0, int kn){
+	int i;
+
+	for(i = 0; i < nx; ++i)
+		scalar_axpy(y + k0, a[i], x[i] + k0, kn);
+}
+
+/* Polynomial bipolar sigmoid.
+ *
+ * exp(-x) = 2^n * exp(r) with n = round(-x / ln2) and |r| <= ln2 / 2, where
+ * exp(r) is a degree 9 Taylor polynomial (truncation error below 1e-11).
+ * x is clamped to +-SIMD_SIGMOID_MAX where the sigmoid is 1 to double
+ * precision, so 2^n never overflows. */
+#define SIMD_SIGMOID_MAX 40.0
+#define SIMD_LOG2E 1.4426950408889634
+#define SIMD_LN2 0.6931471805599453
+
+static const real simd_exp_coef[10] = {
+	1.0 / 362880, 1.0 / 40320, 1.0 / 5040, 1.0 / 720, 1.0 / 120,
+	1.0 / 24, 1.0 / 6, 1.0 / 2, 1.0, 1.0
+};
+
+static void scalar_bsigmoid(real * y, const real * x, int n){
+	int i, c;
+	real t, k, r, p;
+
+	for(i = 0; i < n; ++i) {
+		t = -x[i];
+		t = (t > SIMD_SIGMOID_MAX) ? SIMD_SIGMOID_MAX : (t < -SIMD_SIGMOID_MAX) ? -SIMD_SIGMOID_MAX : t;
+
+		k = floor(t * SIMD_LOG2E + 0.5);
+		r = t - k * SIMD_LN2;
+
+		for(p = simd_exp_coef[0], c = 1; c < 10; ++c)
+			p = p * r + simd_exp_coef[c];
+
+		y[i] = 2.0 / (1.0 + ldexp(p, (int)k)) - 1.0;
+	}
+}
+
+static int scalar_qdot(const unsigned char * u, const signed char * q, int n){
+	int i, sum = 0;
+
+	for(i = 0; i < n; ++i)
+		sum += u[i] * q[i];
+
+	return sum;
+}
+
+#ifdef SIMD_X86
+
+/* Sum of the lanes of a stored register, added by adjacent pairs */
+static real simd_hsum(real * sum, int n){
+	int l, w;
+
+	for(w = 1; w < n; w *= 2)
+		for(l = 0; l < n; l += 2 * w)
+			sum[l] += sum[l + w];
+
+	return sum[0];
+}
+
+/* SSE2 kernels. V128_N values per register */
+
+__attribute__((target("sse2")))
+static real sse2_dot(const real * a, const real * b, int n){
+	int i = 0;
+	real sum[V128_N];
+	v128 s0 = v128_zero(), s1 = v128_zero();
+
+	for(; i + 2 * V128_N <= n; i += 2 * V128_N) {
+		s0 = v128_add(s0, v128_mul(v128_load(a + i), v128_load(b + i)));
+		s1 = v128_add(s1, v128_mul(v128_load(a + i + V128_N), v128_load(b + i + V128_N)));
+	}
+
+	v128_store(sum, v128_add(s0, s1));
+
+	return simd_hsum(sum, V128_N) + scalar_dot(a + i, b + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void sse2_axpy(real * y, real a, const real * x, int n){
+	int i = 0;
+	v128 va = v128_set1(a);
+
+	for(; i + V128_N <= n; i += V128_N)
+		v128_store(y + i, v128_add(v128_load(y + i),
+					v128_mul(va, v128_load(x + i))));
+
+	scalar_axpy(y + i, a, x + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void sse2_scale(real * y, real a, const real * x, int n){
+	int i = 0;
+	v128 va = v128_set1(a);
+
+	for(; i + V128_N <= n; i += V128_N)
+		v128_store(y + i, v128_mul(va, v128_load(x + i)));
+
+	scalar_scale(y + i, a, x + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void sse2_delta(real * d, const real * y, int n){
+	int i = 0;
+	v128 one = v128_set1(1.0), half = v128_set1(0.5), vy;
+
+	for(; i + V128_N <= n; i += V128_N) {
+		vy = v128_load(y + i);
+		v128_store(d + i, v128_mul(v128_load(d + i),
+					v128_mul(half, v128_mul(v128_add(one, vy), v128_sub(one, vy)))));
+	}
+
+	scalar_delta(d + i, y + i, n - i);
+}
+
+/* Two rows of b at a time against the four rows of a, so the
+ * accumulators and operands fit in the 16 registers */
+__attribute__((target("sse2")))
+static void sse2_gemm4x4(real * c, int ldc, real * const * a, real * const * b,
+		int k0, int kn){
+	int h, i, j, k, kend = k0 + kn;
+	real sum[V128_N];
+	v128 acc[4][2], va, vb[2];
+
+	for(h = 0; h < 4; h += 2) {
+		for(i = 0; i < 4; ++i)
+			acc[i][0] = acc[i][1] = v128_zero();
+
+		for(k = k0; k + V128_N <= kend; k += V128_N) {
+			vb[0] = v128_load(b[h] + k);
+			vb[1] = v128_load(b[h + 1] + k);
+
+			for(i = 0; i < 4; ++i) {
+				va = v128_load(a[i] + k);
+				acc[i][0] = v128_add(acc[i][0], v128_mul(va, vb[0]));
+				acc[i][1] = v128_add(acc[i][1], v128_mul(va, vb[1]));
+			}
+		}
+
+		for(i = 0; i < 4; ++i)
+			for(j = 0; j < 2; ++j) {
+				v128_store(sum, acc[i][j]);
+				c[i * ldc + h + j] += simd_hsum(sum, V128_N)
+					+ scalar_dot(a[i] + k, b[h + j] + k, kend - k);
+			}
+	}
+}
+
+/* 4 registers of y are kept along all rows of x */
+__attribute__((target("sse2")))
+static void sse2_axpyn(real * y, const real * a, real * const * x, int nx,
+		int k0, int kn){
+	int i, q, k, kend = k0 + kn;
+	v128 acc[4], va;
+
+	for(k = k0; k + 4 * V128_N <= kend; k += 4 * V128_N) {
+		for(q = 0; q < 4; ++q)
+			acc[q] = v128_load(y + k + V128_N * q);
+
+		for(i = 0; i < nx; ++i) {
+			va = v128_set1(a[i]);
+			for(q = 0; q < 4; ++q)
+				acc[q] = v128_add(acc[q], v128_mul(va, v128_load(x[i] + k + V128_N * q)));
+		}
+
+		for(q = 0; q < 4; ++q)
+			v128_store(y + k + V128_N * q, acc[q]);
+	}
+
+	scalar_axpyn(y, a, x, nx, k, kend - k);
+}
+
+/* Bytes are widened to 16 bits and multiplied in pairs into 32 bits.
+ * pmaddubsw would save the widening but saturates at 16 bits with
+ * large pixels and weights. */
+__attribute__((target("sse2")))
+static int sse2_qdot(const unsigned char * u, const signed char * q, int n){
+	int i = 0, sum[4];
+	__m128i vu, vq, zero = _mm_setzero_si128(), acc = _mm_setzero_si128();
+
+	for(; i + 16 <= n; i += 16) {
+		vu = _mm_loadu_si128((const __m128i *)(u + i));
+		vq = _mm_loadu_si128((const __m128i *)(q + i));
+
+		/* u zero extended, q sign extended */
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi8(vu, zero),
+					_mm_srai_epi16(_mm_unpacklo_epi8(vq, vq), 8)));
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpackhi_epi8(vu, zero),
+					_mm_srai_epi16(_mm_unpackhi_epi8(vq, vq), 8)));
+	}
+
+	_mm_storeu_si128((__m128i *) sum, acc);
+
+	return sum[0] + sum[1] + sum[2] + sum[3] + scalar_qdot(u + i, q + i, n - i);
+}
+
+/* AVX2 + FMA kernels. V256_N values per register */
+
+__attribute__((target("avx2,fma")))
+static real avx2_dot(const real * a, const real * b, int n){
+	int i = 0;
+	real sum[V256_N];
+	v256 s0 = v256_zero(), s1 = v256_zero();
+
+	for(; i + 2 * V256_N <= n; i += 2 * V256_N) {
+		s0 = v256_fmadd(v256_load(a + i), v256_load(b + i), s0);
+		s1 = v256_fmadd(v256_load(a + i + V256_N), v256_load(b + i + V256_N), s1);
+	}
+
+	for(; i + V256_N <= n; i += V256_N)
+		s0 = v256_fmadd(v256_load(a + i), v256_load(b + i), s0);
+
+	v256_store(sum, v256_add(s0, s1));
+
+	return simd_hsum(sum, V256_N) + scalar_dot(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+static void avx2_axpy(real * y, real a, const real * x, int n){
+	int i = 0;
+	__m256i m;
+	v256 va = v256_set1(a);
+
+	for(; i + V256_N <= n; i += V256_N)
+		v256_store(y + i, v256_fmadd(va, v256_load(x + i), v256_load(y + i)));
+
+	if( i < n ) {
+		m = V256_TAIL(n - i);
+		v256_maskstore(y + i, m, v256_fmadd(va, v256_maskload(x + i, m), v256_maskload(y + i, m)));
+	}
+}
+
+__attribute__((target("avx2,fma")))
+static void avx2_scale(real * y, real a, const real * x, int n){
+	int i = 0;
+	v256 va = v256_set1(a);
+
+	for(; i + V256_N <= n; i += V256_N)
+		v256_store(y + i, v256_mul(va, v256_load(x + i)));
+
+	scalar_scale(y + i, a, x + i, n - i);
+}
+
+/* 0.5 * (1 + y) * (1 - y) = 0.5 * (1 - y * y) */
+__attribute__((target("avx2,fma")))
+static inline v256 avx2_delta_v(v256 d, v256 y){
+	return v256_mul(d, v256_mul(v256_set1(0.5), v256_fnmadd(y, y, v256_set1(1.0))));
+}
+
+__attribute__((target("avx2,fma")))
+static void avx2_delta(real * d, const real * y, int n){
+	int i = 0;
+	__m256i m;
+
+	for(; i + V256_N <= n; i += V256_N)
+		v256_store(d + i, avx2_delta_v(v256_load(d + i), v256_load(y + i)));
+
+	if( i < n ) {
+		m = V256_TAIL(n - i);
+		v256_maskstore(d + i, m, avx2_delta_v(v256_maskload(d + i, m), v256_maskload(y + i, m)));
+	}
+}
+
+__attribute__((target("avx2,fma")))
+static void avx2_gemm4x4(real * c, int ldc, real * const * a, real * const * b,
+		int k0, int kn){
+	int h, i, j, k, kend = k0 + kn;
+	real sum[V256_N];
+	v256 acc[4][2], va, vb[2];
+
+	/* Two rows of b at a time: 8 accumulators + 3 operands in 16 registers */
+	for(h = 0; h < 4; h += 2) {
+		for(i = 0; i < 4; ++i)
+			acc[i][0] = acc[i][1] = v256_zero();
+
+		for(k = k0; k + V256_N <= kend; k += V256_N) {
+			vb[0] = v256_load(b[h] + k);
+			vb[1] = v256_load(b[h + 1] + k);
+
+			for(i = 0; i < 4; ++i) {
+				va = v256_load(a[i] + k);
+				acc[i][0] = v256_fmadd(va, vb[0], acc[i][0]);
+				acc[i][1] = v256_fmadd(va, vb[1], acc[i][1]);
+			}
+		}
+
+		for(i = 0; i < 4; ++i)
+			for(j = 0; j < 2; ++j) {
+				v256_store(sum, acc[i][j]);
+				c[i * ldc + h + j] += simd_hsum(sum, V256_N)
+					+ scalar_dot(a[i] + k, b[h + j] + k, kend - k);
+			}
+	}
+}
+
+/* 4 registers of y are kept along all rows of x */
+__attribute__((target("avx2,fma")))
+static void avx2_axpyn(real * y, const real * a, real * const * x, int nx,
+		int k0, int kn){
+	int i, q, k, kend = k0 + kn;
+	v256 acc[4], va;
+
+	for(k = k0; k + 4 * V256_N <= kend; k += 4 * V256_N) {
+		for(q = 0; q < 4; ++q)
+			acc[q] = v256_load(y + k + V256_N * q);
+
+		for(i = 0; i < nx; ++i) {
+			va = v256_set1(a[i]);
+			for(q = 0; q < 4; ++q)
+				acc[q] = v256_fmadd(va, v256_load(x[i] + k + V256_N * q), acc[q]);
+		}
+
+		for(q = 0; q < 4; ++q)
+			v256_store(y + k + V256_N * q, acc[q]);
+	}
+
+	for(; k + V256_N <= kend; k += V256_N) {
+		acc[0] = v256_load(y + k);
+
+		for(i = 0; i < nx; ++i)
+			acc[0] = v256_fmadd(v256_set1(a[i]), v256_load(x[i] + k), acc[0]);
+
+		v256_store(y + k, acc[0]);
+	}
+
+	scalar_axpyn(y, a, x, nx, k, kend - k);
+}
+
+/* 2^k for integral k, built in the exponent bits.
+ * k + 1.5 * 2^(mantissa bits) holds k in its low bits. */
+__attribute__((target("avx2,fma")))
+static v256 avx2_exp2i(v256 k){
+#ifdef PERCEPTRON_FLOAT
+	__m256i e = _mm256_castps_si256(_mm256_add_ps(k, _mm256_set1_ps(12582912.0f)));
+	e = _mm256_slli_epi32(_mm256_add_epi32(e, _mm256_set1_epi32(127)), 23);
+	return _mm256_castsi256_ps(e);
+#else
+	__m256i e = _mm256_castpd_si256(_mm256_add_pd(k, _mm256_set1_pd(6755399441055744.0)));
+	e = _mm256_slli_epi64(_mm256_add_epi64(e, _mm256_set1_epi64x(1023)), 52);
+	return _mm256_castsi256_pd(e);
+#endif
+}
+
+__attribute__((target("avx2,fma")))
+static inline v256 avx2_bsigmoid_v(v256 x){
+	int c;
+	v256 t, k, r, p, one = v256_set1(1.0), lim = v256_set1(SIMD_SIGMOID_MAX);
+
+	t = v256_sub(v256_zero(), x);
+	t = v256_max(v256_min(t, lim), v256_sub(v256_zero(), lim));
+
+	k = v256_round(v256_mul(t, v256_set1(SIMD_LOG2E)),
+			_MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+	r = v256_fnmadd(k, v256_set1(SIMD_LN2), t);
+
+	p = v256_set1(simd_exp_coef[0]);
+	for(c = 1; c < 10; ++c)
+		p = v256_fmadd(p, r, v256_set1(simd_exp_coef[c]));
+
+	p = v256_mul(p, avx2_exp2i(k));
+
+	return v256_sub(v256_div(v256_set1(2.0), v256_add(one, p)), one);
+}
+
+__attribute__((target("avx2,fma")))
+static void avx2_bsigmoid(real * y, const real * x, int n){
+	int i = 0;
+	__m256i m;
+
+	for(; i + V256_N <= n; i += V256_N)
+		v256_store(y + i, avx2_bsigmoid_v(v256_load(x + i)));
+
+	if( i < n ) {
+		m = V256_TAIL(n - i);
+		v256_maskstore(y + i, m, avx2_bsigmoid_v(v256_maskload(x + i, m)));
+	}
+}
+
+__attribute__((target("avx2,fma")))
+static int avx2_qdot(const unsigned char * u, const signed char * q, int n){
+	int i = 0, sum[8];
+	__m256i acc0 = _mm256_setzero_si256(), acc1 = _mm256_setzero_si256();
+
+	for(; i + 32 <= n; i += 32) {
+		acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(
+					_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(u + i))),
+					_mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(q + i)))));
+		acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(
+					_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(u + i + 16))),
+					_mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(q + i + 16)))));
+	}
+
+	_mm256_storeu_si256((__m256i *) sum, _mm256_add_epi32(acc0, acc1));
+
+	return (sum[0] + sum[1]) + (sum[2] + sum[3]) + (sum[4] + sum[5]) + (sum[6] + sum[7])
+		+ scalar_qdot(u + i, q + i, n - i);
+}
+
+/* AVX-512 kernels. V512_N values per register, remainders are masked */
+
+__attribute__((target("avx512f")))
+static real avx512_dot(const real * a, const real * b, int n){
+	int i = 0;
+	v512_mask m;
+	v512 s0 = v512_zero(), s1 = v512_zero();
+
+	for(; i + 2 * V512_N <= n; i += 2 * V512_N) {
+		s0 = v512_fmadd(v512_load(a + i), v512_load(b + i), s0);
+		s1 = v512_fmadd(v512_load(a + i + V512_N), v512_load(b + i + V512_N), s1);
+	}
+
+	for(; i < n; i += V512_N) {
+		m = V512_TAIL(n - i);
+		s0 = v512_fmadd(v512_maskz_load(m, a + i), v512_maskz_load(m, b + i), s0);
+	}
+
+	return v512_reduce(v512_add(s0, s1));
+}
+
+__attribute__((target("avx512f")))
+static void avx512_axpy(real * y, real a, const real * x, int n){
+	int i = 0;
+	v512_mask m;
+	v512 va = v512_set1(a);
+
+	for(; i < n; i += V512_N) {
+		m = V512_TAIL(n - i);
+		v512_mask_store(y + i, m, v512_fmadd(va,
+					v512_maskz_load(m, x + i), v512_maskz_load(m, y + i)));
+	}
+}
+
+__attribute__((target("avx512f")))
+static void avx512_scale(real * y, real a, const real * x, int n){
+	int i = 0;
+	v512_mask m;
+	v512 va = v512_set1(a);
+
+	for(; i < n; i += V512_N) {
+		m = V512_TAIL(n - i);
+		v512_mask_store(y + i, m, v512_mul(va, v512_maskz_load(m, x + i)));
+	}
+}
+
+__attribute__((target("avx512f")))
+static void avx512_delta(real * d, const real * y, int n){
+	int i = 0;
+	v512_mask m;
+	v512 one = v512_set1(1.0), half = v512_set1(0.5), vy;
+
+	for(; i < n; i += V512_N) {
+		m = V512_TAIL(n - i);
+		vy = v512_maskz_load(m, y + i);
+		v512_mask_store(d + i, m, v512_mul(v512_maskz_load(m, d + i),
+					v512_mul(half, v512_fnmadd(vy, vy, one))));
+	}
+}
+
+__attribute__((target("avx512f")))
+static void avx512_gemm4x4(real * c, int ldc, real * const * a, real * const * b,
+		int k0, int kn){
+	int i, j, k, kend = k0 + kn;
+	v512_mask m;
+	v512 acc[4][4], va[4], vb;
+
+	/* 16 accumulators + 5 operands fit in the 32 registers */
+	for(i = 0; i < 4; ++i)
+		for(j = 0; j < 4; ++j)
+			acc[i][j] = v512_zero();
+
+	for(k = k0; k < kend; k += V512_N) {
+		m = V512_TAIL(kend - k);
+
+		for(i = 0; i < 4; ++i)
+			va[i] = v512_maskz_load(m, a[i] + k);
+
+		for(j = 0; j < 4; ++j) {
+			vb = v512_maskz_load(m, b[j] + k);
+
+			for(i = 0; i < 4; ++i)
+				acc[i][j] = v512_fmadd(va[i], vb, acc[i][j]);
+		}
+	}
+
+	for(i = 0; i < 4; ++i)
+		for(j = 0; j < 4; ++j)
+			c[i * ldc + j] += v512_reduce(acc[i][j]);
+}
+
+/* 4 registers of y are kept along all rows of x */
+__attribute__((target("avx512f")))
+static void avx512_axpyn(real * y, const real * a, real * const * x, int nx,
+		int k0, int kn){
+	int i, q, k, kend = k0 + kn;
+	v512_mask m;
+	v512 acc[4], va;
+
+	for(k = k0; k + 4 * V512_N <= kend; k += 4 * V512_N) {
+		for(q = 0; q < 4; ++q)
+			acc[q] = v512_load(y + k + V512_N * q);
+
+		for(i = 0; i < nx; ++i) {
+			va = v512_set1(a[i]);
+			for(q = 0; q < 4; ++q)
+				acc[q] = v512_fmadd(va, v512_load(x[i] + k + V512_N * q), acc[q]);
+		}
+
+		for(q = 0; q < 4; ++q)
+			v512_store(y + k + V512_N * q, acc[q]);
+	}
+
+	for(; k < kend; k += V512_N) {
+		m = V512_TAIL(kend - k);
+		acc[0] = v512_maskz_load(m, y + k);
+
+		for(i = 0; i < nx; ++i)
+			acc[0] = v512_fmadd(v512_set1(a[i]), v512_maskz_load(m, x[i] + k), acc[0]);
+
+		v512_mask_store(y + k, m, acc[0]);
+	}
+}
+
+__attribute__((target("avx512f")))
+static void avx512_bsigmoid(real * y, const real * x, int n){
+	int i = 0, c;
+	v512_mask m;
+	v512 t, k, r, p, one = v512_set1(1.0), two = v512_set1(2.0),
+			lim = v512_set1(SIMD_SIGMOID_MAX);
+
+	for(; i < n; i += V512_N) {
+		m = V512_TAIL(n - i);
+
+		t = v512_sub(v512_zero(), v512_maskz_load(m, x + i));
+		t = v512_max(v512_min(t, lim), v512_sub(v512_zero(), lim));
+
+		k = v512_round(v512_mul(t, v512_set1(SIMD_LOG2E)),
+				_MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+		r = v512_fnmadd(k, v512_set1(SIMD_LN2), t);
+
+		p = v512_set1(simd_exp_coef[0]);
+		for(c = 1; c < 10; ++c)
+			p = v512_fmadd(p, r, v512_set1(simd_exp_coef[c]));
+
+		p = v512_scalef(p, k);  /* p * 2^k */
+
+		v512_mask_store(y + i, m, v512_sub(v512_div(two, v512_add(one, p)), one));
+	}
+}
+
+/* VNNI multiplies 4 bytes pairs and adds them into 32 bits in one
+ * instruction, 64 bytes at a time */
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+static int avx512vnni_qdot(const unsigned char * u, const signed char * q, int n){
+	int i = 0;
+	__mmask64 m;
+	__m512i acc0 = _mm512_setzero_si512(), acc1 = _mm512_setzero_si512();
+
+	for(; i + 128 <= n; i += 128) {
+		acc0 = _mm512_dpbusd_epi32(acc0, _mm512_loadu_si512(u + i), _mm512_loadu_si512(q + i));
+		acc1 = _mm512_dpbusd_epi32(acc1, _mm512_loadu_si512(u + i + 64),
+				_mm512_loadu_si512(q + i + 64));
+	}
+
+	for(; i < n; i += 64) {
+		m = (n - i >= 64) ? ~(__mmask64) 0 : ((__mmask64) 1 << (n - i)) - 1;
+		acc0 = _mm512_dpbusd_epi32(acc0, _mm512_maskz_loadu_epi8(m, u + i),
+				_mm512_maskz_loadu_epi8(m, q + i));
+	}
+
+	return _mm512_reduce_add_epi32(_mm512_add_epi32(acc0, acc1));
+}
+
+#endif /* SIMD_X86 */
+
+static const simd_kernels_t scalar = {
+	"scalar", scalar_dot, scalar_axpy, scalar_scale, scalar_delta,
+	scalar_gemm4x4, scalar_axpyn, scalar_bsigmoid, scalar_qdot
+};
+
+simd_kernels_t simd = {
+	"scalar", scalar_dot, scalar_axpy, scalar_scale, scalar_delta,
+	scalar_gemm4x4, scalar_axpyn, scalar_bsigmoid, scalar_qdot
+};
+
+/**
+ * Selects the best kernels for the running CPU.
+ *
+ * The CAVEBOY_SIMD environment variable (scalar, sse2, avx2, avx512) can be
+ * used to cap the instruction set, to compare results or speed among them.
+ *
+ * @return Name of the instruction set selected.
+ */
+const char * simd_init(void){
+#ifdef SIMD_X86
+	static const simd_kernels_t sse2 = {
+		"sse2", sse2_dot, sse2_axpy, sse2_scale, sse2_delta,
+		sse2_gemm4x4, sse2_axpyn, scalar_bsigmoid, sse2_qdot
+	};
+	static const simd_kernels_t avx2 = {
+		"avx2", avx2_dot, avx2_axpy, avx2_scale, avx2_delta,
+		avx2_gemm4x4, avx2_axpyn, avx2_bsigmoid, avx2_qdot
+	};
+	static const simd_kernels_t avx512 = {
+		"avx512", avx512_dot, avx512_axpy, avx512_scale, avx512_delta,
+		avx512_gemm4x4, avx512_axpyn, avx512_bsigmoid, avx2_qdot
+	};
+	const char * cap = getenv("CAVEBOY_SIMD");
+	int level = 3;  /* 0: scalar, 1: sse2, 2: avx2, 3: avx512 */
+#endif
+
+	simd = scalar;
+
+#ifdef SIMD_X86
+
+	if( cap != NULL ) {
+		if( strcmp(cap, "scalar") == 0 ) level = 0;
+		else if( strcmp(cap, "sse2") == 0 ) level = 1;
+		else if( strcmp(cap, "avx2") == 0 ) level = 2;
+	}
+
+	__builtin_cpu_init();
+
+	if( level >= 3 && __builtin_cpu_supports("avx512f") ) {
+		simd = avx512;
+
+		/* Byte dot products need AVX-512 VNNI, AVX2 ones are used otherwise */
+		if( __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vnni") )
+			simd.qdot = avx512vnni_qdot;
+	}
+	else if( level >= 2 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") )
+		simd = avx2;
+	else if( level >= 1 && __builtin_cpu_supports("sse2") )
+		simd = sse2;
+#endif
+
+	return simd.name;
+}
+
+/* Rows of a (frames) and b (weights) per block, and block length.
+ * A block of b is 64 x 256 doubles (128 KB) so it stays in L2 while every
+ * row of a goes through it. A 4 row tile of a is 8 KB and stays in L1
+ * along the whole block. Both are half of it in float. */
+#define SIMD_GEMM_NC 64
+#define SIMD_GEMM_KC 256
+
+/**
+ * Matrix product of row sets: c[i * ldc + j] += a[i] . b[j]
+ *
+ * @param c Output matrix (m x n), accumulated.
+ * @param ldc Distance between rows in c.
+ * @param a Rows of the left operand (m rows).
+ * @param m Number of rows in a.
+ * @param b Rows of the right operand (n rows).
+ * @param n Number of rows in b.
+ * @param k Length of all rows.
+ */
+void simd_gemm(real * c, int ldc, real * const * a, int m,
+		real * const * b, int n, int k){
+	int i, j, ii, jj, k0, kn, j0, jn;
+
+	/* For each block of the rows length */
+	for(k0 = 0; k0 < k; k0 += SIMD_GEMM_KC) {
+		kn = (k - k0 < SIMD_GEMM_KC) ? k - k0 : SIMD_GEMM_KC;
+
+		/* For each block of b rows */
+		for(j0 = 0; j0 < n; j0 += SIMD_GEMM_NC) {
+			jn = (n - j0 < SIMD_GEMM_NC) ? n - j0 : SIMD_GEMM_NC;
+
+			/* Use it against all rows in a, 4 at a time */
+			for(i = 0; i < m; i += 4)
+				for(j = j0; j < j0 + jn; j += 4) {
+					if( i + 4 <= m && j + 4 <= j0 + jn ) {
+						simd.gemm4x4(&c[i * ldc + j], ldc, &a[i], &b[j], k0, kn);
+						continue;
+					}
+
+					/* Incomplete tile at the borders */
+					for(ii = i; ii < m && ii < i + 4; ++ii)
+						for(jj = j; jj < j0 + jn && jj < j + 4; ++jj)
+							c[ii * ldc + jj] += simd.dot(a[ii] + k0, b[jj] + k0, kn);
+				}
+		}
+	}
+}
+
+/* Patterns whose coefficients are gathered at a time in simd_gemm_tn() */
+#define SIMD_GEMM_MC 64
+
+/**
+ * Accumulated outer products of row sets:
+ * c[j] += alpha * sum_i d[i * ldd + j] * x[i]
+ *
+ * @param c Rows to accumulate into (n rows).
+ * @param n Number of rows in c.
+ * @param d Coefficients matrix (m x n).
+ * @param ldd Distance between rows in d.
+ * @param alpha Scale for all products.
+ * @param x Rows of the right operand (m rows).
+ * @param m Number of rows in x.
+ * @param k Length of rows in c and x.
+ */
+void simd_gemm_tn(real * const * c, int n, const real * d, int ldd,
+		real alpha, real * const * x, int m, int k){
+	int i, j, i0, in, k0, kn;
+	real coef[SIMD_GEMM_MC];
+
+	/* For each block of the rows length */
+	for(k0 = 0; k0 < k; k0 += SIMD_GEMM_KC) {
+		kn = (k - k0 < SIMD_GEMM_KC) ? k - k0 : SIMD_GEMM_KC;
+
+		/* Update that block in every row of c */
+		for(j = 0; j < n; ++j)
+			for(i0 = 0; i0 < m; i0 += SIMD_GEMM_MC) {
+				in = (m - i0 < SIMD_GEMM_MC) ? m - i0 : SIMD_GEMM_MC;
+
+				for(i = 0; i < in; ++i)
+					coef[i] = alpha * d[(i0 + i) * ldd + j];
+
+				simd.axpyn(c[j], coef, &x[i0], in, k0, kn);
+			}
+	}
+}
@@ -0,0 +1,105 @@
+/*
+ *       Filename:  simd.h
+ *    Description:  Vectorized kernels for the perceptron layers
+ *         Author:  Javier Santacruz <francisco.santacruz@estudiante.uam.es>
+ *
+ *   Every kernel has a plain C version and hand vectorized SSE2, AVX2+FMA
+ *   and AVX-512 versions. The best one for the running CPU is chosen once
+ *   at startup with simd_init(), so the same binary can be run anywhere.
+ *   All of them work on the precision set in real.h, except qdot which
+ *   works on bytes for the quantized perceptron.
+ */
+
+#ifndef _SIMD_H_
+#define _SIMD_H_
+
+#include "real.h"
+
+/**
+ * name: Instruction set used by the kernels.
+ *
+ * dot: Returns the dot product of a and b (length n).
+ * axpy: y += a * x (length n).
+ * scale: y = a * x (length n).
+ * delta: d *= 0.5 * (1 + y) * (1 - y) (length n).
+ *        Bipolar sigmoid derivative from the already computed activation y.
+ * gemm4x4: c[i * ldc + j] += a[i][k0..k0+kn) . b[j][k0..k0+kn)
+ *          for a 4x4 tile of rows of a and b. Used by simd_gemm().
+ * axpyn: y[k0..k0+kn) += sum_i a[i] * x[i][k0..k0+kn) for nx rows of x.
+ *        Used by simd_gemm_tn().
+ * bsigmoid: y = 2 / (1 + exp(-x)) - 1 (length n, may be done in place).
+ *           Bipolar sigmoid with a polynomial exp, max error below 1e-11
+ *           (or float rounding error in single precision).
+ * qdot: Returns the dot product of unsigned bytes u and signed bytes q
+ *       (length n) accumulated in 32 bits. Exact for n up to SIMD_QDOT_MAX.
+ */
+typedef struct {
+	const char * name;
+
+	real (*dot)(const real * a, const real * b, int n);
+	void (*axpy)(real * y, real a, const real * x, int n);
+	void (*scale)(real * y, real a, const real * x, int n);
+	void (*delta)(real * d, const real * y, int n);
+	void (*gemm4x4)(real * c, int ldc, real * const * a, real * const * b,
+			int k0, int kn);
+	void (*axpyn)(real * y, const real * a, real * const * x, int nx,
+			int k0, int kn);
+	void (*bsigmoid)(real * y, const real * x, int n);
+	int (*qdot)(const unsigned char * u, const signed char * q, int n);
+} simd_kernels_t;
+
+/* Longest qdot that can't overflow its 32 bit accumulator */
+#define SIMD_QDOT_MAX 65536
+
+/* Kernels in use. Scalar ones until simd_init() is called. */
+extern simd_kernels_t simd;
+
+/**
+ * Selects the best kernels for the running CPU.
+ * Safe to be called more than once.
+ *
+ * @return Name of the instruction set selected.
+ */
+const char * simd_init(void);
+
+/**
+ * Matrix product of row sets: c[i * ldc + j] += a[i] . b[j]
+ *
+ * Both a and b are given as lists of rows of length k, as the perceptron
+ * patterns and weights are. The product is blocked so each block of b rows
+ * is kept in cache while it is used against every row in a, and computed
+ * in 4x4 register tiles.
+ *
+ * @param c Output matrix (m x n), accumulated.
+ * @param ldc Distance between rows in c.
+ * @param a Rows of the left operand (m rows).
+ * @param m Number of rows in a.
+ * @param b Rows of the right operand (n rows).
+ * @param n Number of rows in b.
+ * @param k Length of all rows.
+ */
+void simd_gemm(real * c, int ldc, real * const * a, int m,
+		real * const * b, int n, int k);
+
+/**
+ * Accumulated outer products of row sets:
+ * c[j] += alpha * sum_i d[i * ldd + j] * x[i]
+ *
+ * This is the weight gradient of a layer for a batch, with d the neuron
+ * deltas of each pattern and x the previous layer values. Each row of c is
+ * loaded once for a whole group of patterns, and the rows of x are used in
+ * blocks that stay in cache along all rows of c.
+ *
+ * @param c Rows to accumulate into (n rows).
+ * @param n Number of rows in c.
+ * @param d Coefficients matrix (m x n).
+ * @param ldd Distance between rows in d.
+ * @param alpha Scale for all products.
+ * @param x Rows of the right operand (m rows).
+ * @param m Number of rows in x.
+ * @param k Length of rows in c and x.
+ */
+void simd_gemm_tn(real * const * c, int n, const real * d, int ldd,
+		real alpha, real * const * x, int m, int k);
+
+#endif
@@ -0,0 +1,787 @@
+/*
+ *       Filename:  threadpool.c
+ *    Description:  Pool of worker threads for parallel loops and tasks
+ *         Author:  Javier Santacruz <francisco.santacruz@estudiante.uam.es>
+ *
+ */
+
+#define _GNU_SOURCE  /* Allows sched.h sched_getaffinity() and pthread_setaffinity_np() */
+
+#include "threadpool.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <dirent.h>
+
+/*  Handy macros */
+#ifndef printerr
+ #define printerr(...) fprintf(stderr, __VA_ARGS__)
+#endif
+
+/**
+ * A parallel loop, or a single task of a group.
+ *
+ * fun, arg, n, chunk: Loop, or task and arg for a task (n = chunk = 1).
+ * nchunks: Number of chunks.
+ * next: Next chunk to be taken, atomic. Chunks taken for static loops.
+ * left: Chunks not finished yet, atomic. Loops only.
+ * taken: Static loops only, whether each thread took its own chunk, atomic.
+ * group: Group of a task, NULL for loops.
+ * queued: Still in the deque of its worker.
+ * prev, after: Neighbours in the deque, from oldest to newest.
+ */
+typedef struct threadpool_job_t {
+	threadpool_fun fun;
+	threadpool_task task;
+	void * arg;
+	size_t n, chunk, nchunks;
+	size_t next;
+	size_t left;
+	int * taken;
+	threadpool_group group;
+	int queued;
+	struct threadpool_job_t * prev, * after;
+} threadpool_job_t;
+
+/**
+ * A thread of the pool and the deque of jobs it started.
+ * The owner takes work from the newest job, thieves from the oldest one.
+ */
+typedef struct {
+	threadpool pool;
+	int id;
+
+	pthread_mutex_t lock;
+	threadpool_job_t * oldest, * newest;
+} threadpool_worker_t;
+
+/**
+ * nthreads: Number of threads, including the caller.
+ * threads: Worker threads (nthreads - 1).
+ * workers: Deques of all threads, the caller's is 0.
+ * nworkers: Deques, one per requested thread, even if it couldn't start.
+ * cores: CPU each thread is pinned to, -1 if it isn't.
+ * gen: Generation of the work, changes when there is something new to do
+ *      or something is finished. Sleeping threads wait for it to change.
+ */
+struct threadpool_t {
+	int nthreads;
+	pthread_t * threads;
+	threadpool_worker_t * workers;
+	int nworkers;
+	int * cores;
+
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	unsigned long gen;
+	int quit;
+};
+
+/**
+ * pool: Pool running the tasks.
+ * pending: Tasks not finished yet, atomic.
+ */
+struct threadpool_group_t {
+	threadpool pool;
+	size_t pending;
+};
+
+/* Pool thread running this code, if any */
+static __thread threadpool_worker_t * threadpool_current = NULL;
+
+/* NUMA node of each CPU, read once */
+static short threadpool_nodes[CPU_SETSIZE];
+static int threadpool_nnodes = 1;
+static pthread_once_t threadpool_nodes_once = PTHREAD_ONCE_INIT;
+
+/* Whether a comma separated list has the given item */
+static int threadpool_hasitem(const char * list, const char * item){
+	size_t len = strlen(item);
+	const char * p = list;
+
+	for(p = list; (p = strstr(p, item)) != NULL; p += len)
+		if( (p == list || p[-1] == ',') && (p[len] == ',' || p[len] == '\0') )
+			return 1;
+
+	return 0;
+}
+
+/**
+ * Finds the cgroup of the process, v2 or the v1 one with the cpu controller,
+ * and where it is mounted.
+ *
+ * @param v2 Look for the cgroup v2 hierarchy, v1 otherwise
+ * @param dir Directory of the cgroup, to be set
+ * @param mnt Mount point of the hierarchy, to be set
+ * @return 0 if not found, 1 otherwise
+ */
+static int threadpool_cgroup(int v2, char * dir, char * mnt){
+	char * line = NULL, * sep = NULL, ctrls[256], root[PATH_MAX], path[PATH_MAX],
+		 type[64], opts[256];
+	size_t len = 0, rlen = 0;
+	int found = 0, id;
+	FILE * f = NULL;
+
+	/* Cgroup path of the process in the hierarchy */
+	if( (f = fopen("/proc/self/cgroup", "r")) == NULL )
+		return 0;
+
+	while( !found && getline(&line, &len, f) != -1 )
+		if( sscanf(line, "%d:%255[^:]:%4095s", &id, ctrls, path) == 3 )
+			found = !v2 && threadpool_hasitem(ctrls, "cpu");
+		else if( sscanf(line, "%d::%4095s", &id, path) == 2 )
+			found = v2 && id == 0;
+	fclose(f);
+
+	/* Where the hierarchy is mounted, and its root */
+	if( found && (f = fopen("/proc/self/mountinfo", "r")) != NULL ) {
+		found = 0;
+		while( !found && getline(&line, &len, f) != -1 )
+			if( (sep = strstr(line, " - ")) != NULL &&
+					sscanf(line, "%*s %*s %*s %4095s %4095s", root, mnt) == 2 &&
+					sscanf(sep + 3, "%63s %*s %255s", type, opts) == 2 )
+				found = v2 ? strcmp(type, "cgroup2") == 0 :
+					strcmp(type, "cgroup") == 0 && threadpool_hasitem(opts, "cpu");
+		fclose(f);
+	} else {
+		found = 0;
+	}
+
+	free(line);
+
+	if( !found )
+		return 0;
+
+	/* Path below the mounted root, which may be the cgroup itself */
+	rlen = strlen(root);
+	if( strcmp(root, "/") != 0 && strncmp(path, root, rlen) == 0 )
+		memmove(path, path + rlen, strlen(path + rlen) + 1);
+
+	snprintf(dir, PATH_MAX, "%s%s", mnt, (strcmp(path, "/") == 0) ? "" : path);
+
+	return 1;
+}
+
+/* CPUs allowed by the quota of a cgroup directory, 0 if unlimited */
+static double threadpool_cgroup_quota(int v2, const char * dir){
+	char path[PATH_MAX + 32], max[32];
+	long quota = -1, period = 0;
+	FILE * f = NULL;
+
+	if( v2 ) {
+		/* cpu.max: "quota period", quota is "max" when unlimited */
+		snprintf(path, sizeof(path), "%s/cpu.max", dir);
+		if( (f = fopen(path, "r")) == NULL )
+			return 0;
+		if( fscanf(f, "%31s %ld", max, &period) == 2 && strcmp(max, "max") != 0 )
+			quota = atol(max);
+		fclose(f);
+
+	} else {
+		/* cpu.cfs_quota_us is -1 when unlimited */
+		snprintf(path, sizeof(path), "%s/cpu.cfs_quota_us", dir);
+		if( (f = fopen(path, "r")) == NULL )
+			return 0;
+		if( fscanf(f, "%ld", &quota) != 1 )
+			quota = -1;
+		fclose(f);
+
+		snprintf(path, sizeof(path), "%s/cpu.cfs_period_us", dir);
+		if( (f = fopen(path, "r")) == NULL )
+			return 0;
+		if( fscanf(f, "%ld", &period) != 1 )
+			period = 0;
+		fclose(f);
+	}
+
+	return (quota > 0 && period > 0) ? (double) quota / period : 0;
+}
+
+/* CPUs allowed by the cgroup quotas of the process and its parents,
+ * the least of them, 0 if unlimited */
+static double threadpool_quota(void){
+	char dir[PATH_MAX], mnt[PATH_MAX], * slash = NULL;
+	double quota = 0, q;
+	int v2;
+
+	for(v2 = 0; v2 < 2; ++v2) {
+		if( !threadpool_cgroup(v2, dir, mnt) )
+			continue;
+
+		/* Up to the mount point */
+		for(;;) {
+			if( (q = threadpool_cgroup_quota(v2, dir)) > 0 && (quota == 0 || q < quota) )
+				quota = q;
+
+			if( strlen(dir) <= strlen(mnt) || (slash = strrchr(dir, '/')) == NULL )
+				break;
+			*slash = '\0';
+		}
+	}
+
+	return quota;
+}
+
+/* Reads the CPUs of every NUMA node, eg. "0-15,32-47". No nodes in sysfs
+ * means a single one. */
+static void threadpool_readnodes(void){
+	char path[PATH_MAX];
+	struct dirent * entry = NULL;
+	DIR * dir = NULL;
+	FILE * f = NULL;
+	int node, first, last, cpu;
+	char sep;
+
+	if( (dir = opendir("/sys/devices/system/node")) == NULL )
+		return;
+
+	while( (entry = readdir(dir)) != NULL ) {
+		if( sscanf(entry->d_name, "node%d", &node) != 1 || node < 0 )
+			continue;
+
+		snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", entry->d_name);
+		if( (f = fopen(path, "r")) == NULL )
+			continue;
+
+		while( fscanf(f, "%d", &first) == 1 ) {
+			last = first;
+			if( (sep = fgetc(f)) == '-' ) {
+				if( fscanf(f, "%d", &last) != 1 )
+					break;
+				sep = fgetc(f);
+			}
+
+			for(cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu)
+				threadpool_nodes[cpu] = node;
+
+			if( sep != ',' )
+				break;
+		}
+
+		fclose(f);
+
+		if( node + 1 > threadpool_nnodes )
+			threadpool_nnodes = node + 1;
+	}
+
+	closedir(dir);
+}
+
+int threadpool_cpunode(int cpu){
+	pthread_once(&threadpool_nodes_once, threadpool_readnodes);
+
+	return (cpu >= 0 && cpu < CPU_SETSIZE) ? threadpool_nodes[cpu] : 0;
+}
+
+void threadpool_topology(threadpool_topology_t * topo){
+	long online = sysconf(_SC_NPROCESSORS_ONLN);
+	cpu_set_t set;
+
+	topo->online = (online > 0) ? (int) online : 1;
+
+	CPU_ZERO(&set);
+	topo->affinity = (sched_getaffinity(0, sizeof(set), &set) == 0) ? CPU_COUNT(&set) : topo->online;
+
+	topo->quota = threadpool_quota();
+
+	pthread_once(&threadpool_nodes_once, threadpool_readnodes);
+	topo->nnodes = threadpool_nnodes;
+
+	/* Whole CPUs of quota, at least one */
+	topo->ncpus = (topo->affinity < topo->online) ? topo->affinity : topo->online;
+	if( topo->quota > 0 && (int) topo->quota < topo->ncpus )
+		topo->ncpus = (topo->quota < 1) ? 1 : (int) topo->quota;
+}
+
+int threadpool_ncpus(void){
+	threadpool_topology_t topo;
+
+	threadpool_topology(&topo);
+
+	return topo.ncpus;
+}
+
+/* Pins each thread to a CPU of the original affinity mask, in turns */
+static void threadpool_pin(threadpool pool, int worker, pthread_t thread, cpu_set_t * own){
+	cpu_set_t set;
+	int cpu, n = 0;
+
+	for(cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+		if( CPU_ISSET(cpu, own) && n++ == worker % CPU_COUNT(own) )
+			break;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	if( pthread_setaffinity_np(thread, sizeof(set), &set) == 0 )
+		pool->cores[worker] = cpu;
+	else
+		printerr("threadpool_create: Couldn't pin thread %d to CPU %d.\n", worker, cpu);
+}
+
+/* Worker of the calling thread. Any other thread is taken as the caller. */
+static threadpool_worker_t * threadpool_self(threadpool pool){
+	if( threadpool_current != NULL && threadpool_current->pool == pool )
+		return threadpool_current;
+	return &(pool->workers[0]);
+}
+
+/* Something changed, wakes up everyone waiting for it */
+static void threadpool_notify(threadpool pool){
+	pthread_mutex_lock(&(pool->lock));
+	__atomic_store_n(&(pool->gen), pool->gen + 1, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&(pool->wake));
+	pthread_mutex_unlock(&(pool->lock));
+}
+
+/* Sleeps until the generation changes from the given one */
+static void threadpool_sleep(threadpool pool, unsigned long gen){
+	pthread_mutex_lock(&(pool->lock));
+	while( !pool->quit && pool->gen == gen )
+		pthread_cond_wait(&(pool->wake), &(pool->lock));
+	pthread_mutex_unlock(&(pool->lock));
+}
+
+/* Removes a job from its deque. Deque lock must be held. */
+static void threadpool_unqueue(threadpool_worker_t * w, threadpool_job_t * job){
+	if( !job->queued )
+		return;
+
+	if( job->prev != NULL )
+		job->prev->after = job->after;
+	else
+		w->oldest = job->after;
+
+	if( job->after != NULL )
+		job->after->prev = job->prev;
+	else
+		w->newest = job->prev;
+
+	job->prev = job->after = NULL;
+	job->queued = 0;
+}
+
+static void threadpool_push(threadpool pool, threadpool_worker_t * w, threadpool_job_t * job){
+	pthread_mutex_lock(&(w->lock));
+	job->after = NULL;
+	job->prev = w->newest;
+	if( w->newest != NULL )
+		w->newest->after = job;
+	else
+		w->oldest = job;
+	w->newest = job;
+	job->queued = 1;
+	pthread_mutex_unlock(&(w->lock));
+
+	threadpool_notify(pool);
+}
+
+/**
+ * Takes a chunk from a deque, from the newest job if it is the own one or
+ * from the oldest one if stealing. Only from the given job or group, if any.
+ * Jobs with no chunks left are taken out of the deque.
+ *
+ * @return Job of the chunk, NULL if there was nothing to take
+ */
+static threadpool_job_t * threadpool_take(threadpool_worker_t * w, int own, int id,
+		const threadpool_job_t * only, threadpool_group group, size_t * c){
+	threadpool_job_t * job = NULL, * following = NULL;
+
+	pthread_mutex_lock(&(w->lock));
+
+	for(job = own ? w->newest : w->oldest; job != NULL; job = following) {
+		following = own ? job->prev : job->after;
+
+		if( (only != NULL && job != only) || (group != NULL && job->group != group) )
+			continue;
+
+		/* Each thread only takes its own chunk of static loops */
+		if( job->taken != NULL ) {
+			if( __atomic_exchange_n(&(job->taken[id]), 1, __ATOMIC_RELAXED) )
+				continue;
+
+			if( __atomic_fetch_add(&(job->next), 1, __ATOMIC_RELAXED) + 1 >= job->nchunks )
+				threadpool_unqueue(w, job);
+
+			*c = id;
+			break;
+		}
+
+		*c = __atomic_fetch_add(&(job->next), 1, __ATOMIC_RELAXED);
+
+		if( *c + 1 >= job->nchunks )
+			threadpool_unqueue(w, job);
+
+		if( *c < job->nchunks )
+			break;
+	}
+
+	pthread_mutex_unlock(&(w->lock));
+
+	return job;
+}
+
+/* Looks for work in the own deque first, then steals from the others */
+static threadpool_job_t * threadpool_find(threadpool pool, threadpool_worker_t * self,
+		const threadpool_job_t * only, threadpool_group group, size_t * c){
+	threadpool_job_t * job = NULL;
+	int i;
+
+	if( (job = threadpool_take(self, 1, self->id, only, group, c)) != NULL )
+		return job;
+
+	/* A loop is only in the deque of its caller */
+	if( only != NULL )
+		return NULL;
+
+	for(i = 1; i < pool->nworkers; ++i)
+		if( (job = threadpool_take(&(pool->workers[(self->id + i) % pool->nworkers]),
+						0, self->id, NULL, group, c)) != NULL )
+			return job;
+
+	return NULL;
+}
+
+/**
+ * Runs a chunk of a job and, for loops, any other chunk left of it.
+ * A loop can't finish while one of its chunks is running, so the next chunk
+ * is taken before telling this one is done.
+ */
+static void threadpool_run(threadpool pool, threadpool_worker_t * self,
+		threadpool_job_t * job, size_t c){
+	size_t begin, end, following;
+	threadpool_group group = job->group;
+
+	if( job->task != NULL ) {
+		job->task(job->arg, self->id);
+		free(job);
+
+		if( __atomic_sub_fetch(&(group->pending), 1, __ATOMIC_ACQ_REL) == 0 )
+			threadpool_notify(pool);
+		return;
+	}
+
+	/* Static loops have a single chunk per thread */
+	if( job->taken != NULL ) {
+		threadpool_static_range(pool, job->n, (int) c, &begin, &end);
+		job->fun(job->arg, begin, end, self->id);
+
+		if( __atomic_sub_fetch(&(job->left), 1, __ATOMIC_ACQ_REL) == 0 )
+			threadpool_notify(pool);
+		return;
+	}
+
+	for(;;) {
+		begin = c * job->chunk;
+		end = (begin + job->chunk < job->n) ? begin + job->chunk : job->n;
+		job->fun(job->arg, begin, end, self->id);
+
+		following = __atomic_fetch_add(&(job->next), 1, __ATOMIC_RELAXED);
+
+		/* The job may be gone right after its last chunk is done */
+		if( __atomic_sub_fetch(&(job->left), 1, __ATOMIC_ACQ_REL) == 0 ) {
+			threadpool_notify(pool);
+			return;
+		}
+
+		if( following >= job->nchunks )
+			return;
+
+		c = following;
+	}
+}
+
+/* Helps with a loop or a group until the counter gets to zero */
+static void threadpool_wait(threadpool pool, threadpool_worker_t * self,
+		const threadpool_job_t * only, threadpool_group group, const size_t * counter){
+	threadpool_job_t * job = NULL;
+	unsigned long gen;
+	size_t c;
+
+	for(;;) {
+		gen = __atomic_load_n(&(pool->gen), __ATOMIC_ACQUIRE);
+
+		if( __atomic_load_n(counter, __ATOMIC_ACQUIRE) == 0 )
+			return;
+
+		if( (job = threadpool_find(pool, self, only, group, &c)) != NULL )
+			threadpool_run(pool, self, job, c);
+		else
+			threadpool_sleep(pool, gen);
+	}
+}
+
+static void * threadpool_worker(void * arg){
+	threadpool_worker_t * self = (threadpool_worker_t *) arg;
+	threadpool pool = self->pool;
+	threadpool_job_t * job = NULL;
+	unsigned long gen;
+	size_t c;
+
+	threadpool_current = self;
+
+	for(;;) {
+		gen = __atomic_load_n(&(pool->gen), __ATOMIC_ACQUIRE);
+
+		if( __atomic_load_n(&(pool->quit), __ATOMIC_ACQUIRE) )
+			break;
+
+		if( (job = threadpool_find(pool, self, NULL, NULL, &c)) != NULL )
+			threadpool_run(pool, self, job, c);
+		else
+			threadpool_sleep(pool, gen);
+	}
+
+	return NULL;
+}
+
+int threadpool_create(threadpool * pool_ptr, int nthreads, int pin){
+	int i;
+	threadpool pool = NULL;
+	const char * env = getenv("CAVEBOY_PIN");
+	cpu_set_t own;
+
+	if( nthreads <= 0 )
+		nthreads = threadpool_ncpus();
+
+	if( env != NULL && *env != '\0' && strcmp(env, "0") != 0 )
+		pin = 1;
+
+	/* Mask before pinning the caller, which is inherited by the threads */
+	if( pin && sched_getaffinity(0, sizeof(own), &own) != 0 )
+		pin = 0;
+
+	if( (pool = (threadpool) calloc (1, sizeof(struct threadpool_t))) == NULL )
+		return 0;
+
+	pool->threads = (pthread_t *) malloc (nthreads * sizeof(pthread_t));
+	pool->workers = (threadpool_worker_t *) calloc (nthreads, sizeof(threadpool_worker_t));
+	pool->cores = (int *) malloc (nthreads * sizeof(int));
+
+	if( pool->threads == NULL || pool->workers == NULL || pool->cores == NULL ) {
+		printerr("threadpool_create: Couldn't alloc space for %d threads.\n", nthreads);
+		free(pool->threads);
+		free(pool->workers);
+		free(pool->cores);
+		free(pool);
+		return 0;
+	}
+
+	for(i = 0; i < nthreads; ++i)
+		pool->cores[i] = -1;
+
+	pthread_mutex_init(&(pool->lock), NULL);
+	pthread_cond_init(&(pool->wake), NULL);
+
+	pool->nworkers = nthreads;
+	for(i = 0; i < nthreads; ++i) {
+		pool->workers[i].pool = pool;
+		pool->workers[i].id = i;
+		pthread_mutex_init(&(pool->workers[i].lock), NULL);
+	}
+
+	/* Worker 0 is the caller */
+	pool->nthreads = 1;
+	*pool_ptr = pool;
+
+	if( pin )
+		threadpool_pin(pool, 0, pthread_self(), &own);
+
+	for(i = 1; i < nthreads; ++i) {
+		if( pthread_create(&(pool->threads[i]), NULL, threadpool_worker, &(pool->workers[i])) != 0 ) {
+			printerr("threadpool_create: Couldn't start thread %d, using %d.\n", i, pool->nthreads);
+			break;
+		}
+
+		if( pin )
+			threadpool_pin(pool, i, pool->threads[i], &own);
+
+		pool->nthreads++;
+	}
+
+	return 1;
+}
+
+int threadpool_free(threadpool * pool_ptr){
+	int i;
+	threadpool pool = *pool_ptr;
+
+	if( pool == NULL ) {
+		printerr("threadpool_free: Pool already freed.");
+		return 0;
+	}
+
+	pthread_mutex_lock(&(pool->lock));
+	__atomic_store_n(&(pool->quit), 1, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&(pool->wake));
+	pthread_mutex_unlock(&(pool->lock));
+
+	for(i = 1; i < pool->nthreads; ++i)
+		pthread_join(pool->threads[i], NULL);
+
+	for(i = 0; i < pool->nworkers; ++i)
+		pthread_mutex_destroy(&(pool->workers[i].lock));
+
+	pthread_mutex_destroy(&(pool->lock));
+	pthread_cond_destroy(&(pool->wake));
+
+	free(pool->threads);
+	free(pool->workers);
+	free(pool->cores);
+	free(pool);
+	*pool_ptr = NULL;
+
+	return 1;
+}
+
+int threadpool_size(threadpool pool){
+	return pool->nthreads;
+}
+
+int threadpool_core(threadpool pool, int worker){
+	return (worker >= 0 && worker < pool->nthreads) ? pool->cores[worker] : -1;
+}
+
+int threadpool_for(threadpool pool, size_t n, size_t chunk, threadpool_fun fun, void * arg){
+	size_t begin;
+	threadpool_worker_t * self = NULL;
+	threadpool_job_t job;
+
+	if( chunk == 0 )
+		chunk = 1;
+
+	/* No one to share it with */
+	if( pool->nthreads == 1 || n <= chunk ) {
+		for(begin = 0; begin < n; begin += chunk)
+			fun(arg, begin, (begin + chunk < n) ? begin + chunk : n, threadpool_self(pool)->id);
+		return 1;
+	}
+
+	memset(&job, 0, sizeof(job));
+	job.fun = fun;
+	job.arg = arg;
+	job.n = n;
+	job.chunk = chunk;
+	job.nchunks = job.left = (n + chunk - 1) / chunk;
+
+	/* Other threads steal chunks of it while the caller works on it */
+	self = threadpool_self(pool);
+	threadpool_push(pool, self, &job);
+	threadpool_wait(pool, self, &job, NULL, &(job.left));
+
+	/* Thieves only look at it while holding the lock */
+	pthread_mutex_lock(&(self->lock));
+	threadpool_unqueue(self, &job);
+	pthread_mutex_unlock(&(self->lock));
+
+	return 1;
+}
+
+void threadpool_static_range(threadpool pool, size_t n, int worker, size_t * begin, size_t * end){
+	*begin = n * worker / pool->nthreads;
+	*end = n * (worker + 1) / pool->nthreads;
+}
+
+int threadpool_static(threadpool pool, size_t n, threadpool_fun fun, void * arg){
+	threadpool_worker_t * self = NULL;
+	threadpool_job_t job;
+
+	/* No one to share it with */
+	if( pool->nthreads == 1 ) {
+		fun(arg, 0, n, 0);
+		return 1;
+	}
+
+	memset(&job, 0, sizeof(job));
+	job.fun = fun;
+	job.arg = arg;
+	job.n = n;
+	job.nchunks = job.left = pool->nthreads;
+
+	if( (job.taken = (int *) calloc (pool->nthreads, sizeof(int))) == NULL ) {
+		printerr("threadpool_static: Couldn't alloc space for %d threads.\n", pool->nthreads);
+		return 0;
+	}
+
+	/* Every thread comes to take its own chunk */
+	self = threadpool_self(pool);
+	threadpool_push(pool, self, &job);
+	threadpool_wait(pool, self, &job, NULL, &(job.left));
+
+	pthread_mutex_lock(&(self->lock));
+	threadpool_unqueue(self, &job);
+	pthread_mutex_unlock(&(self->lock));
+
+	free(job.taken);
+
+	return 1;
+}
+
+int threadpool_node(threadpool pool, int worker){
+	int cpu = threadpool_core(pool, worker);
+
+	return threadpool_cpunode((cpu != -1) ? cpu : sched_getcpu());
+}
+
+int threadpool_group_create(threadpool_group * group_ptr, threadpool pool){
+	threadpool_group group = NULL;
+
+	if( (group = (threadpool_group) calloc (1, sizeof(struct threadpool_group_t))) == NULL ) {
+		printerr("threadpool_group_create: Couldn't alloc space for the group.\n");
+		return 0;
+	}
+
+	group->pool = pool;
+	*group_ptr = group;
+
+	return 1;
+}
+
+int threadpool_group_run(threadpool_group group, threadpool_task task, void * arg){
+	threadpool pool = group->pool;
+	threadpool_job_t * job = NULL;
+
+	/* No one to share it with, or no space to queue it */
+	if( pool->nthreads == 1 ||
+			(job = (threadpool_job_t *) calloc (1, sizeof(threadpool_job_t))) == NULL ) {
+		task(arg, threadpool_self(pool)->id);
+		return 1;
+	}
+
+	job->task = task;
+	job->arg = arg;
+	job->n = job->chunk = job->nchunks = 1;
+	job->group = group;
+
+	__atomic_add_fetch(&(group->pending), 1, __ATOMIC_ACQ_REL);
+	threadpool_push(pool, threadpool_self(pool), job);
+
+	return 1;
+}
+
+int threadpool_group_wait(threadpool_group group){
+	threadpool pool = group->pool;
+
+	threadpool_wait(pool, threadpool_self(pool), NULL, group, &(group->pending));
+
+	return 1;
+}
+
+int threadpool_group_free(threadpool_group * group_ptr){
+	if( *group_ptr == NULL ) {
+		printerr("threadpool_group_free: Group already freed.");
+		return 0;
+	}
+
+	threadpool_group_wait(*group_ptr);
+
+	free(*group_ptr);
+	*group_ptr = NULL;
+
+	return 1;
+}
@@ -0,0 +1,213 @@
+/*
+ *       Filename:  threadpool.h
+ *    Description:  Pool of worker threads for parallel loops and tasks
+ *         Author:  Javier Santacruz <francisco.santacruz@estudiante.uam.es>
+ *
+ *   Worker threads are started once and sleep while there is nothing to do.
+ *   Every thread keeps a deque with the loops and tasks it started, and
+ *   idle threads steal work from the others, so loading, training and
+ *   testing can share the same threads even when they overlap.
+ *
+ *   The main thread works too, as worker 0, so a pool of 1 thread runs
+ *   everything in the caller with no synchronization at all. Loops and
+ *   tasks can start other loops and tasks. A thread waiting for a loop only
+ *   helps with that loop, so per-worker data of an outer loop is never
+ *   used by two of its chunks at once.
+ */
+
+#ifndef _THREADPOOL_H_
+#define _THREADPOOL_H_
+
+#include <stddef.h>
+
+/**
+ * Body of a parallel loop, called for each chunk of iterations.
+ *
+ * @param arg Argument given to threadpool_for()
+ * @param begin First iteration of the chunk
+ * @param end Last iteration of the chunk (not included)
+ * @param worker Worker running it, in [0, threads)
+ */
+typedef void (*threadpool_fun)(void * arg, size_t begin, size_t end, int worker);
+
+/**
+ * Task of a group.
+ *
+ * @param arg Argument given to threadpool_group_run()
+ * @param worker Worker running it, in [0, threads)
+ */
+typedef void (*threadpool_task)(void * arg, int worker);
+
+struct threadpool_t;
+struct threadpool_group_t;
+
+typedef struct threadpool_t * threadpool;
+typedef struct threadpool_group_t * threadpool_group;
+
+/**
+ * online: Online CPUs.
+ * affinity: CPUs in the affinity mask of the process.
+ * quota: CPUs allowed by the cgroup (v1 or v2) CPU quota, 0 if unlimited.
+ * ncpus: CPUs that can really be used, the least of all of them.
+ * nnodes: NUMA nodes, 1 if the system has none.
+ */
+typedef struct {
+	int online;
+	int affinity;
+	double quota;
+	int ncpus;
+	int nnodes;
+} threadpool_topology_t;
+
+/**
+ * Finds out the CPUs the process can use: online ones, its affinity mask
+ * and the CPU quota of its cgroup and the parent ones, as in containers.
+ *
+ * @param topo Topology to be set
+ */
+void threadpool_topology(threadpool_topology_t * topo);
+
+/**
+ * NUMA node of a CPU, as listed in /sys/devices/system/node.
+ *
+ * @param cpu CPU number
+ * @return Node, 0 if it can't be known
+ */
+int threadpool_cpunode(int cpu);
+
+/**
+ * Number of CPUs the process can use, within its affinity mask and CPU
+ * quota, so threads aren't throttled.
+ *
+ * @return Number of CPUs, 1 if it can't be known
+ */
+int threadpool_ncpus(void);
+
+/**
+ * Starts a pool of threads.
+ *
+ * Threads can be pinned to the CPUs of the affinity mask, in turns, the
+ * caller included. They also are if CAVEBOY_PIN is set to other than 0.
+ *
+ * @param pool_ptr Uninitialized pool by reference
+ * @param nthreads Number of threads, including the caller. 0 for one per CPU.
+ * @param pin Pin each thread to a CPU
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int threadpool_create(threadpool * pool_ptr, int nthreads, int pin);
+
+/**
+ * Stops the threads and frees the pool.
+ *
+ * @param pool_ptr Initialized pool by reference
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int threadpool_free(threadpool * pool_ptr);
+
+/**
+ * Number of threads of a pool, including the caller.
+ *
+ * @param pool Initialized pool
+ * @return Number of threads
+ */
+int threadpool_size(threadpool pool);
+
+/**
+ * CPU a thread of a pool is pinned to.
+ *
+ * @param pool Initialized pool
+ * @param worker Thread, in [0, threads)
+ * @return CPU, -1 if not pinned
+ */
+int threadpool_core(threadpool pool, int worker);
+
+/**
+ * NUMA node a thread of a pool runs on. Pinned threads stay on the node of
+ * their CPU, the rest are asked where they are now, so for them it must be
+ * called from the thread itself.
+ *
+ * @param pool Initialized pool
+ * @param worker Thread, in [0, threads)
+ * @return Node, 0 if it can't be known
+ */
+int threadpool_node(threadpool pool, int worker);
+
+/**
+ * Runs a loop of n iterations in parallel, in chunks of the given length.
+ * The caller takes chunks in order while idle workers steal them, and their
+ * bounds depend only on n and chunk. Returns when all of them are done.
+ *
+ * @param pool Initialized pool
+ * @param n Number of iterations
+ * @param chunk Iterations per chunk (the last one may be shorter)
+ * @param fun Loop body
+ * @param arg Argument for the loop body
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int threadpool_for(threadpool pool, size_t n, size_t chunk, threadpool_fun fun, void * arg);
+
+/**
+ * Runs a loop of n iterations with a static schedule: every thread of the
+ * pool runs its own contiguous range once, the one given by
+ * threadpool_static_range(). Memory first written by a thread in one of
+ * these loops lands on its NUMA node, and is local again for it in the
+ * next loop over the same n.
+ *
+ * All threads must take part, so it can't be called from loops or tasks.
+ *
+ * @param pool Initialized pool
+ * @param n Number of iterations
+ * @param fun Loop body, called once per thread, maybe with an empty range
+ * @param arg Argument for the loop body
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int threadpool_static(threadpool pool, size_t n, threadpool_fun fun, void * arg);
+
+/**
+ * Range of iterations of a thread in a static loop of n iterations.
+ *
+ * @param pool Initialized pool
+ * @param n Number of iterations
+ * @param worker Thread, in [0, threads)
+ * @param begin First iteration of the range, set
+ * @param end Last iteration of the range (not included), set
+ */
+void threadpool_static_range(threadpool pool, size_t n, int worker, size_t * begin, size_t * end);
+
+/**
+ * Creates an empty group of tasks.
+ *
+ * @param group_ptr Uninitialized group by reference
+ * @param pool Initialized pool to run the tasks
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int threadpool_group_create(threadpool_group * group_ptr, threadpool pool);
+
+/**
+ * Adds a task to a group. It is run by the first idle worker, or right
+ * away by the caller in a pool of 1 thread.
+ *
+ * @param group Initialized group
+ * @param task Task to run
+ * @param arg Argument for the task
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int threadpool_group_run(threadpool_group group, threadpool_task task, void * arg);
+
+/**
+ * Waits for all tasks of a group, helping with the ones not started yet.
+ *
+ * @param group Initialized group
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int threadpool_group_wait(threadpool_group group);
+
+/**
+ * Waits for all tasks of a group and frees it.
+ *
+ * @param group_ptr Initialized group by reference
+ * @return 0 if unsuccessful, 1 otherwise
+ */
+int threadpool_group_free(threadpool_group * group_ptr);
+
+#endif
@@ -4,6 +4,10 @@
 #define DO_CRC_CHECKS 1
 #define USE_ZLIB 1
 
+#if !defined(_POSIX_C_SOURCE) && (defined(__unix__) || defined(__APPLE__))
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #if USE_ZLIB
 #include "../zlib/zlib.h"
 #else
@@ -15,11 +19,59 @@
 #include <string.h>
 #include "pnglite.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+#define PNG_POSIX 1
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Smallest file worth mapping */
+#define PNG_MAP_MIN 65536
+#endif
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PNG_X86 1
+#include <emmintrin.h>
+#endif
 
 static png_alloc_t png_alloc;
 static png_free_t png_free;
 
+static int png_end_inflate(png_decoder_t* decoder);
+
+/*
+	Row unfilters. The vector ones are picked by png_init for 3 and 4 bytes
+	per pixel, and for up rows of any size. Both give the same bytes.
+*/
+
+typedef void (*png_unfilter_sub_t)(int stride, unsigned char* in, unsigned char* out, int len);
+typedef void (*png_unfilter_t)(int stride, unsigned char* in, unsigned char* out, unsigned char* prev_line, int len);
+
+typedef struct
+{
+	png_unfilter_sub_t	sub;
+	png_unfilter_t		up;
+	png_unfilter_t		average;
+	png_unfilter_t		paeth;
+}png_unfilters_t;
+
+static void png_filter_sub(int stride, unsigned char* in, unsigned char* out, int len);
+static void png_filter_up(int stride, unsigned char* in, unsigned char* out, unsigned char* prev_line, int len);
+static void png_filter_average(int stride, unsigned char* in, unsigned char* out, unsigned char* prev_line, int len);
+static void png_filter_paeth(int stride, unsigned char* in, unsigned char* out, unsigned char* prev_line, int len);
+
+static const png_unfilters_t png_unfilters_scalar = {png_filter_sub, png_filter_up, png_filter_average, png_filter_paeth};
+static png_unfilters_t png_unfilters_any = {png_filter_sub, png_filter_up, png_filter_average, png_filter_paeth};
+static png_unfilters_t png_unfilters_rgb = {png_filter_sub, png_filter_up, png_filter_average, png_filter_paeth};
+static png_unfilters_t png_unfilters_rgba = {png_filter_sub, png_filter_up, png_filter_average, png_filter_paeth};
+
+static void png_init_unfilters(void);
+static int png_unfilter_row(png_t* png, unsigned char* filtered_row);
+
+/* Bytes of filtered rows inflated at a time, at least one row */
+#define PNG_ROWS_BYTES 16384
+
 static size_t file_read(png_t* png, void* out, size_t size, size_t numel)
 {
 	size_t result;
@@ -120,6 +172,8 @@ int png_init(png_alloc_t pngalloc, png_free_t pngfree)
 	else
 		png_free = &free;
 
+	png_init_unfilters();
+
 	return PNG_NO_ERROR;
 }
 
@@ -148,6 +202,29 @@ static int png_get_bpp(png_t* png)
 	return bpp;
 }
 
+/* Sets the image fields from the type and data of an IHDR chunk */
+static int png_set_ihdr(png_t* png, unsigned char* ihdr)
+{
+	png->width = get_ul(ihdr+4);
+	png->height = get_ul(ihdr+8);
+	png->depth = ihdr[12];
+	png->color_type = ihdr[13];
+	png->compression_method = ihdr[14];
+	png->filter_method = ihdr[15];
+	png->interlace_method = ihdr[16];
+
+	if(png->color_type == PNG_INDEXED)
+		return PNG_NOT_SUPPORTED;
+
+	if(png->depth != 8 && png->depth != 16)
+		return PNG_NOT_SUPPORTED;
+
+	if(png->interlace_method)
+		return PNG_NOT_SUPPORTED;
+	
+	return PNG_NO_ERROR;
+}
+
 static int png_read_ihdr(png_t* png)
 {
 	unsigned length;
@@ -179,24 +256,7 @@ static int png_read_ihdr(png_t* png)
 	file_read_ul(png);
 #endif
 
-	png->width = get_ul(ihdr+4);
-	png->height = get_ul(ihdr+8);
-	png->depth = ihdr[12];
-	png->color_type = ihdr[13];
-	png->compression_method = ihdr[14];
-	png->filter_method = ihdr[15];
-	png->interlace_method = ihdr[16];
-
-	if(png->color_type == PNG_INDEXED)
-		return PNG_NOT_SUPPORTED;
-
-	if(png->depth != 8 && png->depth != 16)
-		return PNG_NOT_SUPPORTED;
-
-	if(png->interlace_method)
-		return PNG_NOT_SUPPORTED;
-	
-	return PNG_NO_ERROR;
+	return png_set_ihdr(png, ihdr);
 }
 
 static int png_write_ihdr(png_t* png)
@@ -254,11 +314,34 @@ void png_print_info(png_t* png)
 	printf("\tinterlace:\t%s\n",	png->interlace_method?"interlace":"no interlace");
 }
 
+/* Reads from a file mapped by png_open_file_map, the png itself */
+static unsigned png_map_read(void* output, size_t size, size_t numel, void* user_pointer)
+{
+	png_t* png = user_pointer;
+	size_t left = png->maplen - png->mappos;
+
+	if(size == 0)
+		return 0;
+
+	if(numel > left / size)
+		numel = left / size;
+
+	if(output)
+		memcpy(output, png->map + png->mappos, size * numel);
+
+	png->mappos += size * numel;
+
+	return (unsigned)numel;
+}
+
 int png_open_read(png_t* png, png_read_callback_t read_fun, void* user_pointer)
 {
 	char header[8];
 	int result;
 
+	if(read_fun != png_map_read)
+		png->map = 0;
+
 	png->read_fun = read_fun;
 	png->write_fun = 0;
 	png->user_pointer = user_pointer;
@@ -321,8 +404,150 @@ int png_open_file(png_t *png, const char* filename)
 	return png_open_file_read(png, filename);
 }
 
+int png_probe_file(png_t *png, const char* filename)
+{
+	/* signature, IHDR length, type, data and crc */
+	unsigned char header[8+4+4+13+4];
+	size_t got;
+	int result;
+#if PNG_POSIX
+	ssize_t n;
+	int fd = open(filename, O_RDONLY);
+
+	if(fd < 0)
+		return PNG_FILE_ERROR;
+
+	n = pread(fd, header, sizeof(header), 0);
+	close(fd);
+
+	if(n < 0)
+		return PNG_FILE_ERROR;
+
+	got = (size_t)n;
+#else
+	FILE* fp = fopen(filename, "rb");
+
+	if(!fp)
+		return PNG_FILE_ERROR;
+
+	got = fread(header, 1, sizeof(header), fp);
+	fclose(fp);
+#endif
+
+	png->read_fun = 0;
+	png->write_fun = 0;
+	png->user_pointer = 0;
+	png->map = 0;
+
+	if(got < 8)
+		return PNG_EOF_ERROR;
+
+	if(memcmp(header, "\x89\x50\x4E\x47\x0D\x0A\x1A\x0A", 8) != 0)
+		return PNG_HEADER_ERROR;
+
+	if(got != sizeof(header))
+		return PNG_EOF_ERROR;
+
+	if(get_ul(header+8) != 13)
+		return PNG_CRC_ERROR;
+
+#if DO_CRC_CHECKS
+	if(get_ul(header+8+4+4+13) != crc32(crc32(0L, 0, 0), header+8+4, 4+13))
+		return PNG_CRC_ERROR;
+#endif
+
+	result = png_set_ihdr(png, header+8+4);
+
+	png->bpp = (unsigned char)png_get_bpp(png);
+
+	return result;
+}
+
+int png_open_file_map(png_t *png, const char* filename)
+{
+#if PNG_POSIX
+	struct stat st;
+	void* map;
+	size_t got = 0;
+	ssize_t n;
+	int result;
+	int fd = open(filename, O_RDONLY);
+
+	if(fd < 0)
+		return PNG_FILE_ERROR;
+
+	if(fstat(fd, &st) != 0)
+	{
+		close(fd);
+		return PNG_FILE_ERROR;
+	}
+
+	/* Small files are read whole, faster than mapped and unmapped */
+	if(st.st_size < PNG_MAP_MIN)
+	{
+		if(!(map = png_alloc((size_t)st.st_size + 1)))
+		{
+			close(fd);
+			return PNG_MEMORY_ERROR;
+		}
+
+		while(got < (size_t)st.st_size && (n = read(fd, (char*)map + got, (size_t)st.st_size - got)) > 0)
+			got += (size_t)n;
+
+		close(fd);
+
+		png->mapped = 0;
+	}
+	else
+	{
+		if((map = mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+		{
+			close(fd);
+			return PNG_FILE_ERROR;
+		}
+
+		/* The mapping keeps the file open */
+		close(fd);
+
+		/* Read once from start to end, so read ahead and drop behind */
+		posix_madvise(map, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+		posix_madvise(map, (size_t)st.st_size, POSIX_MADV_WILLNEED);
+
+		got = (size_t)st.st_size;
+		png->mapped = 1;
+	}
+
+	png->map = map;
+	png->maplen = got;
+	png->mappos = 0;
+
+	/* Nothing is left open on errors */
+	result = png_open_read(png, png_map_read, png);
+
+	if(result != PNG_NO_ERROR)
+		png_close_file(png);
+
+	return result;
+#else
+	return png_open_file_read(png, filename);
+#endif
+}
+
 int png_close_file(png_t* png)
 {
+#if PNG_POSIX
+	if(png->read_fun == png_map_read)
+	{
+		if(png->map && png->mapped)
+			munmap(png->map, png->maplen);
+		else if(png->map)
+			png_free(png->map);
+		png->map = 0;
+
+		return PNG_NO_ERROR;
+	}
+#endif
+
 	fclose(png->user_pointer);
 
 	return PNG_NO_ERROR;
@@ -349,13 +574,62 @@ static int png_init_deflate(png_t* png, unsigned char* data, int datalen)
 	return PNG_NO_ERROR;
 }
 
+#if USE_ZLIB
+/* zlib allocations go through the pnglite ones too */
+static voidpf png_zalloc(voidpf opaque, uInt items, uInt size)
+{
+	return png_alloc((size_t)items * size);
+}
+
+static void png_zfree(voidpf opaque, voidpf p)
+{
+	png_free(p);
+}
+#endif
+
+/* Buffer of a decoder with room for at least size bytes. It only grows. */
+static unsigned char* png_grow(unsigned char** buf, unsigned* len, unsigned size)
+{
+	if(size > *len || !*buf)
+	{
+		png_free(*buf);
+		*buf = png_alloc(size ? size : 1);
+		*len = *buf ? size : 0;
+	}
+
+	return *buf;
+}
+
+/* Starts inflating with the stream of the decoder, reset if it was used */
 static int png_init_inflate(png_t* png)
 {
+	png_decoder_t* decoder = png->decoder;
 #if USE_ZLIB
 	z_stream *stream;
-	png->zs = png_alloc(sizeof(z_stream));
 #else
 	zl_stream *stream;
+#endif
+
+	png->row = 0;
+	png->rowpos = 0;
+
+	if(decoder->zs)
+	{
+		png->zs = decoder->zs;
+
+#if USE_ZLIB
+		if(inflateReset(png->zs) != Z_OK)
+#else
+		if(z_inflateEnd(png->zs) != Z_OK || z_inflateInit(png->zs) != Z_OK)
+#endif
+			return PNG_ZLIB_ERROR;
+
+		return PNG_NO_ERROR;
+	}
+
+#if USE_ZLIB
+	png->zs = png_alloc(sizeof(z_stream));
+#else
 	png->zs = png_alloc(sizeof(zl_stream));
 #endif
 
@@ -364,20 +638,22 @@ static int png_init_inflate(png_t* png)
 	if(!stream)
 		return PNG_MEMORY_ERROR;
 
-	
-
 #if USE_ZLIB
 	memset(stream, 0, sizeof(z_stream));
+	stream->zalloc = png_zalloc;
+	stream->zfree = png_zfree;
 	if(inflateInit(stream) != Z_OK)
-		return PNG_ZLIB_ERROR;
 #else
 	memset(stream, 0, sizeof(zl_stream));
 	if(z_inflateInit(stream) != Z_OK)
-		return PNG_ZLIB_ERROR;
 #endif
+	{
+		png_free(stream);
+		png->zs = 0;
+		return PNG_ZLIB_ERROR;
+	}
 
-	stream->next_out = png->png_data;
-	stream->avail_out = png->png_datalen;
+	decoder->zs = stream;
 
 	return PNG_NO_ERROR;
 }
@@ -396,16 +672,16 @@ static int png_end_deflate(png_t* png)
 	return PNG_NO_ERROR;
 }
 
-static int png_end_inflate(png_t* png)
+static int png_end_inflate(png_decoder_t* decoder)
 {
 #if USE_ZLIB
-	z_stream *stream = png->zs;
+	z_stream *stream = decoder->zs;
 #else
-	zl_stream *stream = png->zs;
+	zl_stream *stream = decoder->zs;
 #endif
 
 	if(!stream)
-		return PNG_MEMORY_ERROR;
+		return PNG_NO_ERROR;
 
 #if USE_ZLIB
 	if(inflateEnd(stream) != Z_OK)
@@ -414,17 +690,29 @@ static int png_end_inflate(png_t* png)
 #endif
 	{
 		printf("ZLIB says: %s\n", stream->msg);
+		png_free(decoder->zs);
+		decoder->zs = 0;
 		return PNG_ZLIB_ERROR;
 	}
 
-	png_free(png->zs);
+	png_free(decoder->zs);
+	decoder->zs = 0;
 
 	return PNG_NO_ERROR;
 }
 
+/*
+	Inflates a chunk into the rows buffer, unfiltering every row as soon as
+	it is complete, and keeps the bytes of an incomplete one for the next
+	time. Inflate is never given room past the last row, so just the stream
+	end can be read after it and any extra data is an error.
+*/
 static int png_inflate(png_t* png, char* data, int len)
 {
 	int result;
+	unsigned rowlen = png->width * png->bpp + 1;
+	unsigned give, done;
+	size_t left;
 #if USE_ZLIB
 	z_stream *stream = png->zs;
 #else
@@ -436,17 +724,48 @@ static int png_inflate(png_t* png, char* data, int len)
 
 	stream->next_in = (unsigned char*)data;
 	stream->avail_in = len;
-	
+
+	for(;;)
+	{
+		left = (size_t)(png->height - png->row) * rowlen - png->rowpos;
+		give = png->png_datalen - png->rowpos;
+		if(left < give)
+			give = (unsigned)left;
+
+		stream->next_out = png->png_data + png->rowpos;
+		stream->avail_out = give;
+
 #if USE_ZLIB
-	result = inflate(stream, Z_SYNC_FLUSH);
+		result = inflate(stream, Z_SYNC_FLUSH);
 #else
-	result = z_inflate(stream);
+		result = z_inflate(stream);
 #endif
 
-	if(result != Z_STREAM_END && result != Z_OK)
-	{
-		printf("%s\n", stream->msg);
-		return PNG_ZLIB_ERROR;
+		/* No room or no input left is not an error */
+		if(result != Z_STREAM_END && result != Z_OK && result != Z_BUF_ERROR)
+		{
+			printf("%s\n", stream->msg);
+			return PNG_ZLIB_ERROR;
+		}
+
+		png->rowpos += give - stream->avail_out;
+
+		for(done = 0; done + rowlen <= png->rowpos; done += rowlen, png->row++)
+		{
+			result = png_unfilter_row(png, png->png_data + done);
+
+			if(result != PNG_NO_ERROR)
+				return result;
+		}
+
+		/* Incomplete row goes to the front */
+		png->rowpos -= done;
+		memmove(png->png_data, png->png_data + done, png->rowpos);
+
+		/* Room left means inflate had nothing more to give. After the
+		   last row it is called once more with no room, for the stream end. */
+		if(stream->avail_out != 0 || give == 0)
+			break;
 	}
 
 	if(stream->avail_in != 0)
@@ -515,35 +834,43 @@ static int png_write_idats(png_t* png, unsigned char* data)
 
 static int png_read_idat(png_t* png, unsigned firstlen) 
 {
+	png_decoder_t* decoder = png->decoder;
 	unsigned type = 0;
 	char *chunk;
 	int result;
 	unsigned length = firstlen;
-	unsigned old_len = length;
 
 #if DO_CRC_CHECKS
 	unsigned orig_crc;
 	unsigned calc_crc;
 #endif
 
-	chunk = png_alloc(firstlen); 
-
+	/* Stream and chunk buffer are the decoder's, kept for the next image */
 	result = png_init_inflate(png);
 
 	if(result != PNG_NO_ERROR)
-	{
-		png_end_inflate(png);
-		png_free(chunk); 
 		return result;
-	}
 
 	do
 	{
-		if(file_read(png, chunk, 1, length) != length)
+		/* Mapped files are inflated in place, others copied to the buffer */
+		if(png->map)
 		{
-			png_end_inflate(png);
-			png_free(chunk); 
-			return PNG_FILE_ERROR;
+			if(length > png->maplen - png->mappos)
+				return PNG_FILE_ERROR;
+
+			chunk = (char*)png->map + png->mappos;
+			png->mappos += length;
+		}
+		else
+		{
+			chunk = (char*)png_grow(&decoder->chunk, &decoder->chunklen, length);
+
+			if(!chunk)
+				return PNG_MEMORY_ERROR;
+
+			if(file_read(png, chunk, 1, length) != length)
+				return PNG_FILE_ERROR;
 		}
 
 #if DO_CRC_CHECKS
@@ -568,13 +895,6 @@ static int png_read_idat(png_t* png, unsigned firstlen)
 		
 		file_read_ul(png, &length);
 
-		if(length > old_len)
-		{
-			png_free(chunk); 
-			chunk = png_alloc(length); 
-			old_len = length;
-		}
-
 		if(file_read(png, &type, 1, 4) != 4)
 		{
 			result = PNG_FILE_ERROR;
@@ -586,9 +906,6 @@ static int png_read_idat(png_t* png, unsigned firstlen)
 	if(type == *(unsigned int*)"IEND")
 		result = PNG_DONE;
 
-	png_free(chunk);
-	png_end_inflate(png);
-
 	return result;
 }
 
@@ -605,8 +922,11 @@ static int png_process_chunk(png_t* png)
 
 	if(type == *(unsigned int*)"IDAT")	/* if we found an idat, all other idats should be followed with no other chunks in between */
 	{
-		png->png_datalen = png->width * png->height * png->bpp + png->height;
-		png->png_data = png_alloc(png->png_datalen);
+		/* Some filtered rows, with their filter type bytes */
+		png->png_datalen = png->width * png->bpp + 1;
+		if(png->png_datalen < PNG_ROWS_BYTES)
+			png->png_datalen *= PNG_ROWS_BYTES / png->png_datalen;
+		png->png_data = png_grow(&png->decoder->rows, &png->decoder->rowslen, png->png_datalen);
 		
 		if(!png->png_data)
 			return PNG_MEMORY_ERROR;
@@ -676,21 +996,16 @@ static void png_filter_average(int stride, unsigned char* in, unsigned char* out
 
 static unsigned char png_paeth(unsigned char a, unsigned char b, unsigned char c)
 {
-	int p = (int)a + b - c;
-	int pa = abs(p - a);
-	int pb = abs(p - b);
-	int pc = abs(p - c);
-
-	int pr;
+	/* Distances from p = a + b - c, with no branches: a wins ties, then b */
+	int pa = abs((int)b - c);
+	int pb = abs((int)a - c);
+	int pc = abs((int)a + b - 2 * c);
 
-	if(pa <= pb && pa <= pc)
-		pr = a;
-	else if(pb <= pc)
-		pr = b;
-	else
-		pr = c;
+	int not_a = -((pb < pa) | (pc < pa));
+	int not_b = -(pc < pb);
+	int bc = b ^ ((b ^ c) & not_b);
 
-	return (char)pr;
+	return (unsigned char)(a ^ ((a ^ bc) & not_a));
 }
 
 static void png_filter_paeth(int stride, unsigned char* in, unsigned char* out, unsigned char* prev_line, int len)
@@ -727,6 +1042,206 @@ static void png_filter_paeth(int stride, unsigned char* in, unsigned char* out,
 	}
 }
 
+#if PNG_X86
+
+/* A pixel of 3 or 4 bytes in the low lanes of a register */
+__attribute__((target("sse2")))
+static __m128i png_load_pixel(const unsigned char* p, int stride)
+{
+	int v = 0;
+
+	if(stride == 4)
+		memcpy(&v, p, 4);
+	else
+		memcpy(&v, p, 3);
+
+	return _mm_cvtsi32_si128(v);
+}
+
+__attribute__((target("sse2")))
+static void png_store_pixel(unsigned char* p, __m128i x, int stride)
+{
+	int v = _mm_cvtsi128_si32(x);
+
+	if(stride == 4)
+		memcpy(p, &v, 4);
+	else
+		memcpy(p, &v, 3);
+}
+
+/* Rest of a sub row from i, one byte at a time */
+static void png_filter_sub_tail(int stride, unsigned char* in, unsigned char* out, int i, int len)
+{
+	for(; i < len; i++)
+		out[i] = in[i] + (i >= stride ? out[i - stride] : 0);
+}
+
+/*
+	Sub rows as running sums of whole pixels: the last pixel of the previous
+	block is added to the first one of the next block, and then every pixel
+	gets the ones before it in two or three shifted adds.
+*/
+
+__attribute__((target("sse2")))
+static void png_filter_sub3_sse2(int stride, unsigned char* in, unsigned char* out, int len)
+{
+	int i;
+	__m128i x, carry = _mm_setzero_si128();
+
+	/* 5 pixels per block, the 16th byte is rewritten by the next one */
+	for(i = 0; i + 16 <= len; i += 15)
+	{
+		x = _mm_add_epi8(_mm_loadu_si128((__m128i*)(in + i)), carry);
+		x = _mm_add_epi8(x, _mm_slli_si128(x, 3));
+		x = _mm_add_epi8(x, _mm_slli_si128(x, 6));
+		x = _mm_add_epi8(x, _mm_slli_si128(x, 12));
+		_mm_storeu_si128((__m128i*)(out + i), x);
+		carry = _mm_srli_si128(_mm_slli_si128(x, 1), 13);
+	}
+
+	png_filter_sub_tail(stride, in, out, i, len);
+}
+
+__attribute__((target("sse2")))
+static void png_filter_sub4_sse2(int stride, unsigned char* in, unsigned char* out, int len)
+{
+	int i;
+	__m128i x, carry = _mm_setzero_si128();
+
+	for(i = 0; i + 16 <= len; i += 16)
+	{
+		x = _mm_add_epi8(_mm_loadu_si128((__m128i*)(in + i)), carry);
+		x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+		x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+		_mm_storeu_si128((__m128i*)(out + i), x);
+		carry = _mm_srli_si128(x, 12);
+	}
+
+	png_filter_sub_tail(stride, in, out, i, len);
+}
+
+/* Any pixel size, as no byte depends on the others of the row */
+__attribute__((target("sse2")))
+static void png_filter_up_sse2(int stride, unsigned char* in, unsigned char* out, unsigned char* prev_line, int len)
+{
+	int i;
+
+	if(!prev_line)
+	{
+		memcpy(out, in, len);
+		return;
+	}
+
+	for(i = 0; i + 16 <= len; i += 16)
+		_mm_storeu_si128((__m128i*)(out + i), _mm_add_epi8(_mm_loadu_si128((__m128i*)(in + i)),
+					_mm_loadu_si128((__m128i*)(prev_line + i))));
+
+	for(; i < len; i++)
+		out[i] = in[i] + prev_line[i];
+}
+
+/* A pixel at a time, as each one needs the previous one. (a + b) / 2 is
+   the rounded up average minus the bit lost by rounding. */
+__attribute__((target("sse2")))
+static void png_filter_average_sse2(int stride, unsigned char* in, unsigned char* out, unsigned char* prev_line, int len)
+{
+	int i;
+	__m128i a = _mm_setzero_si128(), b = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi8(1);
+
+	for(i = 0; i < len; i += stride)
+	{
+		if(prev_line)
+			b = png_load_pixel(prev_line + i, stride);
+
+		a = _mm_add_epi8(png_load_pixel(in + i, stride),
+				_mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one)));
+		png_store_pixel(out + i, a, stride);
+	}
+}
+
+/* Branchless Paeth predictor for the 16 bit lanes of a, b and c */
+__attribute__((target("sse2")))
+static __m128i png_paeth_sse2(__m128i a, __m128i b, __m128i c)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i pa, pb, pc, smallest, is_a, is_b;
+
+	pa = _mm_sub_epi16(b, c);
+	pb = _mm_sub_epi16(a, c);
+	pc = _mm_add_epi16(pa, pb);
+
+	pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+	pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+	pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+
+	smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+	is_a = _mm_cmpeq_epi16(pa, smallest);
+	is_b = _mm_cmpeq_epi16(pb, smallest);
+
+	b = _mm_or_si128(_mm_and_si128(is_b, b), _mm_andnot_si128(is_b, c));
+	return _mm_or_si128(_mm_and_si128(is_a, a), _mm_andnot_si128(is_a, b));
+}
+
+__attribute__((target("sse2")))
+static void png_filter_paeth_sse2(int stride, unsigned char* in, unsigned char* out, unsigned char* prev_line, int len)
+{
+	int i;
+	const __m128i zero = _mm_setzero_si128();
+	__m128i a = zero, b, c = zero, x;
+
+	/* Only the left pixel is left to predict from */
+	if(!prev_line)
+	{
+		(stride == 4 ? png_filter_sub4_sse2 : png_filter_sub3_sse2)(stride, in, out, len);
+		return;
+	}
+
+	for(i = 0; i < len; i += stride)
+	{
+		b = _mm_unpacklo_epi8(png_load_pixel(prev_line + i, stride), zero);
+		x = _mm_unpacklo_epi8(png_load_pixel(in + i, stride), zero);
+
+		/* High bytes are zero, so byte adds wrap as the scalar code does */
+		a = _mm_add_epi8(x, png_paeth_sse2(a, b, c));
+		png_store_pixel(out + i, _mm_packus_epi16(a, a), stride);
+		c = b;
+	}
+}
+
+#endif
+
+/*
+	Picks the fastest unfilters for the running CPU. Setting CAVEBOY_SIMD
+	to scalar keeps the byte at a time ones, to compare with them.
+*/
+static void png_init_unfilters(void)
+{
+	const char* cap = getenv("CAVEBOY_SIMD");
+
+	png_unfilters_any = png_unfilters_rgb = png_unfilters_rgba = png_unfilters_scalar;
+
+	if(cap && strcmp(cap, "scalar") == 0)
+		return;
+
+#if PNG_X86
+	__builtin_cpu_init();
+
+	if(__builtin_cpu_supports("sse2"))
+	{
+		png_unfilters_any.up = png_filter_up_sse2;
+
+		png_unfilters_rgb.sub = png_filter_sub3_sse2;
+		png_unfilters_rgb.up = png_filter_up_sse2;
+		png_unfilters_rgb.average = png_filter_average_sse2;
+		png_unfilters_rgb.paeth = png_filter_paeth_sse2;
+
+		png_unfilters_rgba = png_unfilters_rgb;
+		png_unfilters_rgba.sub = png_filter_sub4_sse2;
+	}
+#endif
+}
+
 static int png_filter(png_t* png, unsigned char* data)
 {
 
@@ -734,86 +1249,110 @@ static int png_filter(png_t* png, unsigned char* data)
 	return PNG_NO_ERROR;
 }
 
-static int png_unfilter(png_t* png, unsigned char* data)
+/*
+	Unfilters the next row into its place in the output. The previous row is
+	read back from the output, so no other copy of the image is kept.
+*/
+static int png_unfilter_row(png_t* png, unsigned char* filtered_row)
 {
 	unsigned i;
-	unsigned pos = 0;
-	unsigned outpos = 0;
-	unsigned char *filtered = png->png_data;
+	unsigned char *filtered = filtered_row + 1;
+	unsigned char filter = filtered_row[0];
 
 	int stride = png->bpp;
+	int len = png->width * stride;
+	unsigned char *out = png->out + (size_t)png->row * len;
+	unsigned char *prev_line = png->row ? out - len : 0;
+	const png_unfilters_t* f = stride == 3 ? &png_unfilters_rgb :
+		stride == 4 ? &png_unfilters_rgba : &png_unfilters_any;
 
-	while(pos < png->png_datalen)
+	if(png->depth == 16)
 	{
-		unsigned char filter = filtered[pos];
-
-		pos++;
-
-		if(png->depth == 16)
-		{
-			for(i = 0; i < png->width * stride; i+=2)
-			{
-				*(short*)(filtered+pos+i) = (filtered[pos+i] << 8) | filtered[pos+i+1];
-			}
-		}
-
-		switch(filter)
+		for(i = 0; i < png->width * stride; i+=2)
 		{
-		case 0: /* none */
-			memcpy(data+outpos, filtered+pos, png->width * stride);
-			break;
-		case 1: /* sub */
-			png_filter_sub(stride, filtered+pos, data+outpos, png->width * stride);
-			break;
-		case 2: /* up */
-			if(outpos)
-				png_filter_up(stride, filtered+pos, data+outpos, data + outpos - (png->width*stride), png->width*stride);
-			else
-				png_filter_up(stride, filtered+pos, data+outpos, 0, png->width*stride);
-			break;
-		case 3: /* average */
-			if(outpos)
-				png_filter_average(stride, filtered+pos, data+outpos, data + outpos - (png->width*stride), png->width*stride);
-			else
-				png_filter_average(stride, filtered+pos, data+outpos, 0, png->width*stride);
-			break;
-		case 4: /* paeth */
-			if(outpos)
-				png_filter_paeth(stride, filtered+pos, data+outpos, data + outpos - (png->width*stride), png->width*stride);
-			else
-				png_filter_paeth(stride, filtered+pos, data+outpos, 0, png->width*stride);
-			break;
-		default:
-			return PNG_UNKNOWN_FILTER;
+			*(short*)(filtered+i) = (filtered[i] << 8) | filtered[i+1];
 		}
+	}
 
-		outpos += png->width * stride;
-		pos += png->width * stride;
+	switch(filter)
+	{
+	case 0: /* none */
+		memcpy(out, filtered, len);
+		break;
+	case 1: /* sub */
+		f->sub(stride, filtered, out, len);
+		break;
+	case 2: /* up */
+		f->up(stride, filtered, out, prev_line, len);
+		break;
+	case 3: /* average */
+		f->average(stride, filtered, out, prev_line, len);
+		break;
+	case 4: /* paeth */
+		f->paeth(stride, filtered, out, prev_line, len);
+		break;
+	default:
+		return PNG_UNKNOWN_FILTER;
 	}
 
 	return PNG_NO_ERROR;
 }
 
+int png_decoder_init(png_decoder_t* decoder)
+{
+	memset(decoder, 0, sizeof(png_decoder_t));
+
+	return PNG_NO_ERROR;
+}
+
+int png_decoder_free(png_decoder_t* decoder)
+{
+	int result = png_end_inflate(decoder);
+
+	png_free(decoder->rows);
+	png_free(decoder->chunk);
+	png_decoder_init(decoder);
+
+	return result;
+}
+
 int png_get_data(png_t* png, unsigned char* data)
+{
+	png_decoder_t decoder;
+	int result;
+
+	png_decoder_init(&decoder);
+	result = png_get_data_decoder(png, &decoder, data);
+	png_decoder_free(&decoder);
+
+	return result;
+}
+
+int png_get_data_decoder(png_t* png, png_decoder_t* decoder, unsigned char* data)
 {
 	int result = PNG_NO_ERROR;
 
+	/* Rows are unfiltered straight into data while inflating */
+	png->decoder = decoder;
+	png->out = data;
+	png->png_data = 0;
+	png->row = 0;
+
 	while(result == PNG_NO_ERROR)
 	{
 		result = png_process_chunk(png);
 	}
 
+	png->png_data = 0;
+
 	if(result != PNG_DONE)
-	{
-		png_free(png->png_data); 
 		return result;
-	}
-
-	result = png_unfilter(png, data);
 
-	png_free(png->png_data); 
+	/* The stream ended before the last row */
+	if(png->row < png->height)
+		return PNG_EOF_ERROR;
 
-	return result;
+	return PNG_NO_ERROR;
 }
 
 int png_set_data(png_t* png, unsigned width, unsigned height, char depth, int color, unsigned char* data)
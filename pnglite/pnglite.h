@@ -75,16 +75,41 @@ typedef unsigned (*png_read_callback_t)(void* output, size_t size, size_t numel,
 typedef void (*png_free_t)(void* p);
 typedef void * (*png_alloc_t)(size_t s);
 
+/*
+	Decoder state kept from an image to the next one: the inflate stream,
+	which is reset instead of created again, and buffers that only grow.
+	Each thread decoding at once needs its own.
+*/
+
+typedef struct
+{
+	void*					zs;				/* pointer to z_stream, 0 until used */
+	unsigned char*			rows;			/* filtered rows window */
+	unsigned				rowslen;
+	unsigned char*			chunk;			/* IDAT chunk data */
+	unsigned				chunklen;
+}png_decoder_t;
+
 typedef struct
 {
 	void*					zs;				/* pointer to z_stream */
+	png_decoder_t*			decoder;		/* decoder of the current png_get_data */
 	png_read_callback_t		read_fun;
 	png_write_callback_t	write_fun;
 	void*					user_pointer;
 
-	unsigned char*			png_data;
+	unsigned char*			map;			/* file mapped or read by png_open_file_map */
+	size_t					maplen;
+	size_t					mappos;			/* next byte to read from it */
+	unsigned char			mapped;			/* map is a mapping, not a copy */
+
+	unsigned char*			png_data;		/* filtered rows being inflated */
 	unsigned				png_datalen;
 
+	unsigned char*			out;			/* where decoded rows go */
+	unsigned				row;			/* next row to be decoded */
+	unsigned				rowpos;			/* bytes of it inflated so far */
+
 	unsigned				width;
 	unsigned				height;
 	unsigned char			depth;
@@ -131,6 +156,44 @@ int png_open_file(png_t *png, const char* filename);
 int png_open_file_read(png_t *png, const char* filename);
 int png_open_file_write(png_t *png, const char* filename);
 
+/*
+	Function: png_open_file_map
+
+	Same as png_open_file, but the file is mapped in memory and read through
+	the png_open callback, with no stdio buffering. The IDAT data is inflated
+	straight from the mapping, with no copies, and the kernel is told it will
+	be read once in order. Files under 64 KB, which are read faster than
+	mapped, are read whole in one call instead. Systems with no mmap use
+	stdio as png_open_file does.
+
+	Parameters:
+		png - Empty png_t struct.
+		filename - Filename of the file to be opened.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_open_file_map(png_t *png, const char* filename);
+
+/*
+	Function: png_probe_file
+
+	Reads only the signature and the IHDR chunk of a png file, the first 33
+	bytes, in one read, and sets the size and format of the image as
+	png_open_file does. The file is closed before returning, so png_close_file
+	is not needed and the data can't be read with png_get_data.
+
+	Parameters:
+		png - Empty png_t struct.
+		filename - Filename of the file to be probed.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_probe_file(png_t *png, const char* filename);
+
 /*
 	Function: png_open
 
@@ -196,6 +259,9 @@ char* png_error_string(int error);
 	
 	> width*height*(bytes per pixel)
 
+	Rows are unfiltered into data as soon as they are inflated, so apart
+	from it only 16 KB of filtered rows are kept, or a single longer row.
+
 	Parameters:
 		data - Where to store result.
 
@@ -205,12 +271,51 @@ char* png_error_string(int error);
 
 int png_get_data(png_t* png, unsigned char* data);
 
+/*
+	Function: png_get_data_decoder
+
+	Same as png_get_data, but with the stream and buffers of a decoder, so
+	once they are big enough decoding more images allocates nothing.
+
+	Parameters:
+		decoder - Decoder set up with png_decoder_init.
+		data - Where to store result.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_get_data_decoder(png_t* png, png_decoder_t* decoder, unsigned char* data);
+
+/*
+	Function: png_decoder_init
+
+	Sets up an empty decoder. Nothing is allocated until it is used, so its
+	memory belongs to the thread decoding with it.
+
+	Returns:
+		Always returns PNG_NO_ERROR.
+*/
+
+int png_decoder_init(png_decoder_t* decoder);
+
+/*
+	Function: png_decoder_free
+
+	Frees the stream and buffers of a decoder, leaving it empty.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_decoder_free(png_decoder_t* decoder);
+
 int png_set_data(png_t* png, unsigned width, unsigned height, char depth, int color, unsigned char* data);
 
 /*
 	Function: png_close_file
 
-	Closes an open png file pointer. Should only be used when the png has been opened with png_open_file.
+	Closes an open png file pointer. Should only be used when the png has been opened with png_open_file or png_open_file_map.
 
 	Parameters:
 		png - png to close.
@@ -0,0 +1,504 @@
+/*
+ *       Filename:  perceptron_check.c
+ *    Description:  Checks the layer engine against the original perceptron
+ *         Author:  Javier Santacruz <francisco.santacruz@estudiante.uam.es>
+ *
+ *   Keeps the first feedforward and backpropagation of the perceptron, the
+ *   triple loops over w[i][j][k] weights, as a reference. A net with fixed
+ *   random weights is trained on the same patterns by both, and the outputs
+ *   and updated weights must match. Run by make check, with the trainers
+ *   progress on stdout and the results on stderr.
+ *
+ *   Also checks that splitting the hidden neurons of each pattern among
+ *   threads gives the very same weights as one thread, that batches of
+ *   patterns are fed forward as one at a time, that one mini-batch update
+ *   is the sum of the gradients of its patterns, and that the
+ *   transition function modes keep within their stated errors.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "perceptron.h"
+#include "threadpool.h"
+
+#ifndef printerr
+ #define printerr(...) fprintf(stderr, __VA_ARGS__)
+#endif
+
+/* Odd lengths, so the vector kernels run their tails too */
+#define NI 301
+#define NH 19
+#define NO 5
+#define NPATS 12
+#define EPOCHS 10
+#define LRATE 0.01
+#define SEED 7
+
+/* Input layer large enough to be split among threads, and hidden layer
+ * slices of odd lengths, so the vector kernels run their tails in them */
+#define SLICES_NI 4095
+#define SLICES_NH 19
+#define SLICES_NPATS 4
+#define SLICES_EPOCHS 3
+
+/* Mini-batches that leave incomplete tiles and blocks in the products of
+ * patterns and weights */
+static const int batches[] = {1, 3, 5, 7, 13, 67};
+#define NBATCHES (sizeof(batches) / sizeof(batches[0]))
+
+/* Max errors of the transition function modes, as stated in perceptron.h */
+#ifdef PERCEPTRON_FLOAT
+ #define POLY_MAXERROR 2.5e-7
+ #define TABLE_MAXERROR 2e-6
+#else
+ #define POLY_MAXERROR 1e-11
+ #define TABLE_MAXERROR 1.5e-6
+#endif
+
+/* Accumulation order differs, so results only match to rounding */
+#ifdef PERCEPTRON_FLOAT
+ #define TOLERANCE 1e-4
+#else
+ #define TOLERANCE 1e-9
+#endif
+
+/**
+ * Reference perceptron, as it was first written.
+ *
+ * n: Layers lengths.
+ * w: Weights, w[i][j][k] from neuron j in layer i to neuron k in layer i+1.
+ * net: Neuron values, bias included.
+ * rin: Neuron raw inputs.
+ * d: Neuron deltas.
+ * dw: Weight deltas, as w.
+ */
+typedef struct {
+	int n[3];
+	double *** w;
+	double * net[3];
+	double * rin[2];
+	double * d[2];
+	double *** dw;
+} reference_t;
+
+static double bipolarsigmoid(double x){
+	return 2.0/(1 + exp(-x)) - 1;
+}
+
+static double bipolarsigmoid_prima(double x){
+	double fx = bipolarsigmoid(x);
+	return 0.5 * (1 + fx) * (1 - fx);
+}
+
+/* Allocs a weight cube as w[i][j][k] */
+static double *** reference_cube(int * n){
+	int i = 0, j = 0;
+	double *** w = (double ***) malloc (2 * sizeof(double **));
+
+	for(i = 0; i < 2; ++i) {
+		w[i] = (double **) malloc ((n[i] + 1) * sizeof(double *));
+		for(j = 0; j < n[i] + 1; ++j)
+			w[i][j] = (double *) calloc (n[i + 1], sizeof(double));
+	}
+
+	return w;
+}
+
+static void reference_cube_free(double *** w, int * n){
+	int i = 0, j = 0;
+
+	for(i = 0; i < 2; ++i) {
+		for(j = 0; j < n[i] + 1; ++j)
+			free(w[i][j]);
+		free(w[i]);
+	}
+	free(w);
+}
+
+/* Creates the reference with the weights of a perceptron */
+static void reference_create(reference_t * ref, perceptron per){
+	int i = 0, j = 0, k = 0;
+
+	for(i = 0; i < 3; ++i)
+		ref->n[i] = per->n[i];
+
+	ref->w = reference_cube(ref->n);
+	ref->dw = reference_cube(ref->n);
+
+	for(i = 0; i < 2; ++i)
+		for(j = 0; j < ref->n[i] + 1; ++j)
+			for(k = 0; k < ref->n[i + 1]; ++k)
+				ref->w[i][j][k] = per->w[i][k][j];
+
+	ref->net[0] = NULL;
+	for(i = 1; i < 3; ++i)
+		ref->net[i] = (double *) calloc (ref->n[i] + 1, sizeof(double));
+	ref->net[1][ref->n[1]] = 1;  /* Hidden bias */
+
+	for(i = 0; i < 2; ++i) {
+		ref->rin[i] = (double *) calloc (ref->n[i + 1], sizeof(double));
+		ref->d[i] = (double *) calloc (ref->n[i + 1], sizeof(double));
+	}
+}
+
+static void reference_free(reference_t * ref){
+	int i = 0;
+
+	reference_cube_free(ref->w, ref->n);
+	reference_cube_free(ref->dw, ref->n);
+	for(i = 0; i < 2; ++i) {
+		free(ref->net[i + 1]);
+		free(ref->rin[i]);
+		free(ref->d[i]);
+	}
+}
+
+static void reference_feedforward(reference_t * ref, const double * pat){
+	int i = 0, j = 0, k = 0;
+	double sum = 0;
+
+	ref->net[0] = (double *) pat;
+
+	for(i = 0; i < 2; ++i)
+		for(k = 0; k < ref->n[i + 1]; ++k) {
+			sum = 0;
+			for(j = ref->n[i]; j >= 0; --j)
+				sum += ref->net[i][j] * ref->w[i][j][k];
+
+			ref->rin[i][k] = sum;
+			ref->net[i + 1][k] = bipolarsigmoid(sum);
+		}
+}
+
+/* Weight deltas of a pattern into dw, with the current weights */
+static void reference_gradient(reference_t * ref, const double * pat, size_t code, double lrate){
+	int i = 0, j = 0, k = 0;
+	double Dj_in = 0;
+
+	reference_feedforward(ref, pat);
+
+	/* Output layer */
+	for(k = 0; k < ref->n[2]; ++k) {
+		ref->d[1][k] = (ISACTIVE(k, code) - ref->net[2][k]) * bipolarsigmoid_prima(ref->rin[1][k]);
+		for(j = 0; j < ref->n[1] + 1; ++j)
+			ref->dw[1][j][k] = lrate * ref->d[1][k] * ref->net[1][j];
+	}
+
+	/* Hidden layer */
+	for(j = 0; j < ref->n[1]; ++j) {
+		Dj_in = 0;
+		for(k = 0; k < ref->n[2]; ++k)
+			Dj_in += ref->d[1][k] * ref->w[1][j][k];
+
+		ref->d[0][j] = Dj_in * bipolarsigmoid_prima(ref->rin[0][j]);
+		for(i = 0; i < ref->n[0] + 1; ++i)
+			ref->dw[0][i][j] = lrate * ref->d[0][j] * ref->net[0][i];
+	}
+}
+
+static void reference_backpropagation(reference_t * ref, const double * pat, size_t code, double lrate){
+	int i = 0, j = 0, k = 0;
+
+	reference_gradient(ref, pat, code, lrate);
+
+	/* Update weights */
+	for(i = 0; i < 2; ++i)
+		for(j = 0; j < ref->n[i] + 1; ++j)
+			for(k = 0; k < ref->n[i + 1]; ++k)
+				ref->w[i][j][k] += ref->dw[i][j][k];
+}
+
+/* Largest difference between the outputs of both for a pattern */
+static double check_outputs(perceptron per, reference_t * ref, pattern pat, const double * rpat){
+	int k = 0;
+	double diff = 0, max = 0;
+
+	perceptron_feedforward(per, pat);
+	reference_feedforward(ref, rpat);
+
+	for(k = 0; k < ref->n[2]; ++k)
+		if( (diff = fabs(per->ctx->net[2][k] - ref->net[2][k])) > max )
+			max = diff;
+
+	return max;
+}
+
+/* Largest difference between the weights of both */
+static double check_weights(perceptron per, reference_t * ref){
+	int i = 0, j = 0, k = 0;
+	double diff = 0, max = 0;
+
+	for(i = 0; i < 2; ++i)
+		for(j = 0; j < ref->n[i] + 1; ++j)
+			for(k = 0; k < ref->n[i + 1]; ++k)
+				if( (diff = fabs(per->w[i][k][j] - ref->w[i][j][k])) > max )
+					max = diff;
+
+	return max;
+}
+
+/* Feeding a batch of patterns forward at once must give the outputs of
+ * feeding them one at a time.
+ * @return Largest difference between them, -1 on error */
+static double check_batch_forward(perceptron per, real ** pats, int nbatch){
+	int p = 0, k = 0;
+	double diff = 0, max = -1;
+	real * out = (real *) malloc (nbatch * per->n[2] * sizeof(real));
+
+	if( out == NULL || perceptron_feedforward_batch(per, NULL, pats, nbatch, out) == 0 )
+		goto end;
+
+	for(p = 0, max = 0; p < nbatch; ++p) {
+		perceptron_feedforward(per, pats[p]);
+		for(k = 0; k < per->n[2]; ++k)
+			if( (diff = fabs(out[p * per->n[2] + k] - per->ctx->net[2][k])) > max )
+				max = diff;
+	}
+
+end:
+	free(out);
+
+	return max;
+}
+
+/* One mini-batch update must add up the gradients of all its patterns,
+ * computed with the weights previous to the update. The batch is fed
+ * forward first as check_batch_forward() does.
+ * @param forward Where to set the largest difference of the outputs
+ * @return Largest difference with the reference weights, -1 on error */
+static double check_batch(int nbatch, double * forward){
+	int i = 0, j = 0, k = 0, p = 0;
+	double max = -1, *** sum = NULL;
+	perceptron per = NULL;
+	reference_t ref;
+	patternset_t pset;
+	real ** pats = (real **) calloc (nbatch, sizeof(real *));
+	double ** rpats = (double **) calloc (nbatch, sizeof(double *));
+	size_t * codes = (size_t *) malloc (nbatch * sizeof(size_t));
+
+	*forward = -1;
+	srand(SEED);
+	if( pats == NULL || rpats == NULL || codes == NULL || perceptron_create(&per, NI, NH, NO) == 0 )
+		goto end;
+
+	for(p = 0; p < nbatch; ++p) {
+		pats[p] = (real *) malloc ((NI + 1) * sizeof(real));
+		rpats[p] = (double *) malloc ((NI + 1) * sizeof(double));
+		if( pats[p] == NULL || rpats[p] == NULL )
+			goto end;
+		for(j = 0; j < NI; ++j)
+			pats[p][j] = (real) ((rand() % 512) / 256.0 - 1);
+		pats[p][NI] = 1;
+		for(j = 0; j < NI + 1; ++j)
+			rpats[p][j] = pats[p][j];
+		codes[p] = p % NO;
+	}
+
+	*forward = check_batch_forward(per, pats, nbatch);
+
+	reference_create(&ref, per);
+	sum = reference_cube(ref.n);
+
+	/* Reference: gradients of all patterns, then a single update */
+	for(p = 0; p < nbatch; ++p) {
+		reference_gradient(&ref, rpats[p], codes[p], LRATE);
+		for(i = 0; i < 2; ++i)
+			for(j = 0; j < ref.n[i] + 1; ++j)
+				for(k = 0; k < ref.n[i + 1]; ++k)
+					sum[i][j][k] += ref.dw[i][j][k];
+	}
+
+	for(i = 0; i < 2; ++i)
+		for(j = 0; j < ref.n[i] + 1; ++j)
+			for(k = 0; k < ref.n[i + 1]; ++k)
+				ref.w[i][j][k] += sum[i][j][k];
+
+	/* One epoch of a single batch */
+	memset(&pset, 0, sizeof(patternset_t));
+	pset.npats = nbatch;
+	pset.npsets = pset.no = NO;
+	pset.ni = NI;
+	pset.input = pats;
+	pset.codes = codes;
+
+	if( perceptron_trainingprint_batch(per, &pset, LRATE, 0, 1, nbatch, NULL) )
+		max = check_weights(per, &ref);
+
+	reference_cube_free(sum, ref.n);
+	reference_free(&ref);
+
+end:
+	for(p = 0; p < nbatch && pats != NULL && rpats != NULL; ++p) {
+		free(pats[p]);
+		free(rpats[p]);
+	}
+	free(pats);
+	free(rpats);
+	free(codes);
+	if( per != NULL )
+		perceptron_free(&per);
+
+	return max;
+}
+
+/* Number of weights that are not bit-identical in both perceptrons */
+static int count_unequal(perceptron a, perceptron b){
+	int i = 0, k = 0, j = 0, n = 0;
+
+	for(i = 0; i < 2; ++i)
+		for(k = 0; k < a->n[i + 1]; ++k)
+			for(j = 0; j < a->n[i] + 1; ++j)
+				n += memcmp(&(a->w[i][k][j]), &(b->w[i][k][j]), sizeof(real)) != 0;
+
+	return n;
+}
+
+/* Online backpropagation with each pattern split among nthreads must give
+ * the same weights as perceptron_backpropagation(), bit by bit.
+ * @return Number of weights which differ, -1 on error */
+static int check_slices(int nthreads, perceptron_mode_t mode){
+	int p = 0, j = 0, e = 0, n = -1;
+	perceptron serial = NULL, sliced = NULL;
+	threadpool pool = NULL;
+	real * pats[SLICES_NPATS] = {NULL};
+
+	perceptron_setmode(mode);
+
+	srand(SEED);
+	for(p = 0; p < SLICES_NPATS; ++p) {
+		if( (pats[p] = (real *) malloc ((SLICES_NI + 1) * sizeof(real))) == NULL )
+			goto end;
+		for(j = 0; j < SLICES_NI; ++j)
+			pats[p][j] = (real) ((rand() % 512) / 256.0 - 1);
+		pats[p][SLICES_NI] = 1;
+	}
+
+	if( perceptron_create(&serial, SLICES_NI, SLICES_NH, NO) == 0 ||
+			perceptron_copy(&sliced, serial) == 0 ||
+			threadpool_create(&pool, nthreads, 0) == 0 )
+		goto end;
+
+	for(e = 0; e < SLICES_EPOCHS; ++e)
+		for(p = 0; p < SLICES_NPATS; ++p) {
+			perceptron_backpropagation(serial, pats[p], p % NO, LRATE);
+			perceptron_backpropagation_parallel(sliced, pats[p], p % NO, LRATE, pool);
+		}
+
+	n = count_unequal(serial, sliced);
+
+end:
+	if( pool != NULL )
+		threadpool_free(&pool);
+	if( serial != NULL )
+		perceptron_free(&serial);
+	if( sliced != NULL )
+		perceptron_free(&sliced);
+	for(p = 0; p < SLICES_NPATS; ++p)
+		free(pats[p]);
+
+	perceptron_setmode(PERCEPTRON_EXACT);
+
+	return n;
+}
+
+int main(int argc, char * argv[]){
+	int p = 0, j = 0, e = 0, t = 0, m = 0, n = 0, failed = 0;
+	double diff = 0, max = 0, prima = 0;
+	perceptron per = NULL;
+	reference_t ref;
+	real * pats[NPATS];
+	double * rpats[NPATS];
+
+	srand(SEED);
+
+	if( perceptron_create(&per, NI, NH, NO) == 0 ) {
+		printerr("perceptron_check: Couldn't create the perceptron.\n");
+		return 1;
+	}
+
+	reference_create(&ref, per);
+
+	/* Patterns in [-1,1] with their bias, in both precisions */
+	for(p = 0; p < NPATS; ++p) {
+		pats[p] = (real *) malloc ((NI + 1) * sizeof(real));
+		rpats[p] = (double *) malloc ((NI + 1) * sizeof(double));
+		for(j = 0; j < NI; ++j)
+			pats[p][j] = (real) ((rand() % 512) / 256.0 - 1);
+		pats[p][NI] = 1;
+		for(j = 0; j < NI + 1; ++j)
+			rpats[p][j] = pats[p][j];
+	}
+
+	/* Feedforward of the untrained net */
+	for(p = 0; p < NPATS; ++p)
+		if( (diff = check_outputs(per, &ref, pats[p], rpats[p])) > max )
+			max = diff;
+
+	printerr("feedforward: max difference %g\n", max);
+	failed |= max > TOLERANCE;
+
+	/* Online backpropagation, weights checked after every epoch */
+	for(e = 0, max = 0; e < EPOCHS; ++e) {
+		for(p = 0; p < NPATS; ++p) {
+			perceptron_backpropagation(per, pats[p], p % NO, LRATE);
+			reference_backpropagation(&ref, rpats[p], p % NO, LRATE);
+		}
+
+		if( (diff = check_weights(per, &ref)) > max )
+			max = diff;
+	}
+
+	printerr("backpropagation weights: max difference %g\n", max);
+	failed |= max > TOLERANCE;
+
+	/* Feedforward of the trained net */
+	for(p = 0, max = 0; p < NPATS; ++p)
+		if( (diff = check_outputs(per, &ref, pats[p], rpats[p])) > max )
+			max = diff;
+
+	printerr("trained feedforward: max difference %g\n", max);
+	failed |= max > TOLERANCE;
+
+	/* Batches fed forward against one pattern at a time, and mini-batches
+	 * against the sum of their gradients */
+	for(n = 0; n < NBATCHES; ++n) {
+		diff = check_batch(batches[n], &max);
+		printerr("batch of %d fed forward: max difference %g\n", batches[n], max);
+		printerr("mini-batch of %d: max difference %g\n", batches[n], diff);
+		failed |= max < 0 || max > TOLERANCE || diff < 0 || diff > TOLERANCE;
+	}
+
+	/* Hidden neurons split among threads, exact and polynomial sigmoid */
+	for(t = 2; t <= 3; ++t)
+		for(m = 0; m < 2; ++m) {
+			n = check_slices(t, m ? PERCEPTRON_POLY : PERCEPTRON_EXACT);
+			printerr("slices with %d threads (%s): %d weights differ\n", t, m ? "poly" : "exact", n);
+			failed |= n != 0;
+		}
+
+	/* Transition function and derivative errors of each mode. The derivative
+	 * is (1 - y^2) / 2, so its error is never larger than the function one. */
+	for(m = 0; m < 2; ++m) {
+		perceptron_setmode(m ? PERCEPTRON_TABLE : PERCEPTRON_POLY);
+		diff = perceptron_mode_maxerror(&prima);
+		max = m ? TABLE_MAXERROR : POLY_MAXERROR;
+		printerr("%s mode: max error %g (derivative %g), bound %g\n", m ? "table" : "poly",
+				diff, prima, max);
+		failed |= diff > max || prima > max;
+	}
+	perceptron_setmode(PERCEPTRON_EXACT);
+
+	for(p = 0; p < NPATS; ++p) {
+		free(pats[p]);
+		free(rpats[p]);
+	}
+	reference_free(&ref);
+	perceptron_free(&per);
+
+	printerr("perceptron_check: %s\n", failed ? "FAILED" : "OK");
+
+	return failed;
+}
@@ -0,0 +1,230 @@
+/*
+ *       Filename:  png_check.c
+ *    Description:  Checks png decoding against the pixels the pngs were made of
+ *         Author:  Javier Santacruz <francisco.santacruz@estudiante.uam.es>
+ *
+ *   Writes pngs of every pixel size, 1 to 4 bytes, with rows filtered by all
+ *   five filter types, odd widths and the data split in several IDAT
+ *   chunks, then decodes them with pnglite. Decoded pixels must be the ones
+ *   written, and they are also printed to stdout, so make check can compare
+ *   the unfilters chosen for the CPU with the scalar ones (CAVEBOY_SIMD).
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "../pnglite/pnglite.h"
+
+#ifndef printerr
+ #define printerr(...) fprintf(stderr, __VA_ARGS__)
+#endif
+
+#define SEED 21
+
+/* Odd widths, so the vector unfilters run their tails too. The widest rows
+ * don't fit in the 16 KB window of filtered rows of pnglite. */
+static const unsigned widths[] = {1, 3, 5, 15, 17, 33, 63, 257, 1031, 4099};
+static const unsigned char color_types[] = {PNG_GREYSCALE, PNG_GREYSCALE_ALPHA,
+	PNG_TRUECOLOR, PNG_TRUECOLOR_ALPHA};
+
+#define NWIDTHS (sizeof(widths) / sizeof(widths[0]))
+#define NCOLORS (sizeof(color_types) / sizeof(color_types[0]))
+#define HEIGHT 11
+
+/* Data of every png is split in about this many IDAT chunks */
+#define NIDATS 5
+
+static int paeth(int a, int b, int c){
+	int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+
+	if( pa <= pb && pa <= pc )
+		return a;
+	return (pb <= pc) ? b : c;
+}
+
+/* Filters a row with a filter type, as a png encoder would.
+ * prev is NULL for the first row. */
+static void filter_row(unsigned char * out, const unsigned char * row,
+		const unsigned char * prev, size_t len, int bpp, int filter){
+	size_t i = 0;
+	int a = 0, b = 0, c = 0, v = 0;
+
+	for(i = 0; i < len; ++i) {
+		a = (i >= bpp) ? row[i - bpp] : 0;
+		b = (prev != NULL) ? prev[i] : 0;
+		c = (i >= bpp && prev != NULL) ? prev[i - bpp] : 0;
+
+		switch(filter) {
+			case 0: v = row[i]; break;
+			case 1: v = row[i] - a; break;
+			case 2: v = row[i] - b; break;
+			case 3: v = row[i] - (a + b) / 2; break;
+			default: v = row[i] - paeth(a, b, c); break;
+		}
+
+		out[i] = (unsigned char) v;
+	}
+}
+
+static void put32(unsigned char * p, unsigned long v){
+	p[0] = (v >> 24) & 0xff;
+	p[1] = (v >> 16) & 0xff;
+	p[2] = (v >> 8) & 0xff;
+	p[3] = v & 0xff;
+}
+
+static int write_chunk(FILE * f, const char * type, const unsigned char * data, size_t len){
+	unsigned char head[8], crc[4];
+	unsigned long sum = 0;
+
+	put32(head, len);
+	memcpy(&(head[4]), type, 4);
+	sum = crc32(crc32(0, &(head[4]), 4), data, len);
+	put32(crc, sum);
+
+	return fwrite(head, 1, 8, f) == 8 && fwrite(data, 1, len, f) == len &&
+		fwrite(crc, 1, 4, f) == 4;
+}
+
+/* Writes the pixels as an 8 bit depth png. The filter of every row is
+ * taken in turn, starting at first_filter. */
+static int write_png(const char * path, const unsigned char * pixels, unsigned w, unsigned h,
+		int color, int bpp, int first_filter){
+	static const unsigned char signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+	size_t y = 0, stride = (size_t) w * bpp, rawlen = (stride + 1) * h, part = 0, pos = 0,
+		len = 0;
+	unsigned char ihdr[13], * raw = NULL, * z = NULL;
+	uLongf zlen = compressBound(rawlen);
+	int ok = 0;
+	FILE * f = NULL;
+
+	raw = (unsigned char *) malloc (rawlen);
+	z = (unsigned char *) malloc (zlen);
+	if( raw == NULL || z == NULL ) {
+		free(raw);
+		free(z);
+		return 0;
+	}
+
+	for(y = 0; y < h; ++y) {
+		raw[y * (stride + 1)] = (first_filter + y) % 5;
+		filter_row(&(raw[y * (stride + 1) + 1]), &(pixels[y * stride]),
+				(y > 0) ? &(pixels[(y - 1) * stride]) : NULL, stride, bpp,
+				raw[y * (stride + 1)]);
+	}
+
+	put32(ihdr, w);
+	put32(&(ihdr[4]), h);
+	ihdr[8] = 8;
+	ihdr[9] = color;
+	ihdr[10] = ihdr[11] = ihdr[12] = 0;
+
+	if( compress2(z, &zlen, raw, rawlen, 6) == Z_OK && (f = fopen(path, "wb")) != NULL ) {
+		ok = fwrite(signature, 1, 8, f) == 8 && write_chunk(f, "IHDR", ihdr, 13);
+
+		/* The first chunk is just a byte, so the stream starts split */
+		for(pos = 0, part = 1; ok && pos < zlen; pos += len, part = zlen / NIDATS + 1) {
+			len = (zlen - pos < part) ? zlen - pos : part;
+			ok = write_chunk(f, "IDAT", &(z[pos]), len);
+		}
+
+		ok = ok && write_chunk(f, "IEND", (const unsigned char *) "", 0);
+		ok = (fclose(f) == 0) && ok;
+	}
+
+	free(raw);
+	free(z);
+
+	return ok;
+}
+
+/* Decodes the png with the file open in both ways pnglite can.
+ * @return 0 if it couldn't be decoded, 1 otherwise */
+static int decode_png(const char * path, unsigned char * data, unsigned char * data_map,
+		png_decoder_t * decoder){
+	png_t png;
+	int ret = PNG_NO_ERROR;
+
+	if( (ret = png_open_file(&png, path)) == PNG_NO_ERROR ) {
+		ret = png_get_data(&png, data);
+		png_close_file(&png);
+	}
+
+	if( ret == PNG_NO_ERROR && (ret = png_open_file_map(&png, path)) == PNG_NO_ERROR ) {
+		ret = png_get_data_decoder(&png, decoder, data_map);
+		png_close_file(&png);
+	}
+
+	if( ret != PNG_NO_ERROR )
+		printerr("png_check: Couldn't decode '%s': %s\n", path, png_error_string(ret));
+
+	return ret == PNG_NO_ERROR;
+}
+
+int main(int argc, char * argv[]){
+	char path[] = "/tmp/png_checkXXXXXX";
+	size_t c = 0, x = 0, i = 0, size = 0;
+	unsigned char * pixels = NULL, * data = NULL, * data_map = NULL;
+	int fd = -1, bpp = 0, filter = 0, failed = 0;
+	png_decoder_t decoder;
+
+	srand(SEED);
+	png_init(NULL, NULL);
+	png_decoder_init(&decoder);
+
+	if( (fd = mkstemp(path)) == -1 ) {
+		printerr("png_check: Couldn't create a temporary png file.\n");
+		return 1;
+	}
+	close(fd);
+
+	for(c = 0; c < NCOLORS && !failed; ++c)
+		for(x = 0; x < NWIDTHS && !failed; ++x)
+			/* Each row filter type on the first row too */
+			for(filter = 0; filter < 5 && !failed; ++filter) {
+				bpp = (color_types[c] == PNG_GREYSCALE) ? 1 :
+					(color_types[c] == PNG_GREYSCALE_ALPHA) ? 2 :
+					(color_types[c] == PNG_TRUECOLOR) ? 3 : 4;
+				size = (size_t) widths[x] * HEIGHT * bpp;
+
+				pixels = (unsigned char *) malloc (size);
+				data = (unsigned char *) calloc (size, 1);
+				data_map = (unsigned char *) calloc (size, 1);
+				if( pixels == NULL || data == NULL || data_map == NULL ) {
+					printerr("png_check: Out of memory.\n");
+					failed = 1;
+				} else {
+					for(i = 0; i < size; ++i)
+						pixels[i] = rand() & 0xff;
+
+					if( write_png(path, pixels, widths[x], HEIGHT, color_types[c], bpp, filter) == 0 ) {
+						printerr("png_check: Couldn't write '%s'.\n", path);
+						failed = 1;
+					} else if( decode_png(path, data, data_map, &decoder) == 0 ) {
+						failed = 1;
+					} else if( memcmp(pixels, data, size) != 0 || memcmp(pixels, data_map, size) != 0 ) {
+						printerr("png_check: Wrong pixels for %ux%u (%d Bpp), first filter %d.\n",
+								widths[x], HEIGHT, bpp, filter);
+						failed = 1;
+					}
+
+					fwrite(data, 1, size, stdout);
+				}
+
+				free(pixels);
+				free(data);
+				free(data_map);
+			}
+
+	png_decoder_free(&decoder);
+	unlink(path);
+
+	printerr("png_check: %s\n", failed ? "FAILED" : "OK");
+
+	return failed;
+}
@@ -0,0 +1,246 @@
+/*
+ *       Filename:  quant_check.c
+ *    Description:  Checks the quantized perceptron against the real one
+ *         Author:  Javier Santacruz <francisco.santacruz@estudiante.uam.es>
+ *
+ *   For every instruction set the CPU has, compares the byte dot products
+ *   with plain integer ones, up to SIMD_QDOT_MAX and with the largest
+ *   pixels and weights, and the quantized outputs of a fixed net with the
+ *   real ones. Longer input layers must be added up in blocks that can't
+ *   overflow. Run by make check.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "perceptron.h"
+#include "simd.h"
+
+#ifndef printerr
+ #define printerr(...) fprintf(stderr, __VA_ARGS__)
+#endif
+
+#define SEED 11
+
+/* Lengths around every vector width and unrolling, and the longest one */
+static const int lengths[] = {0, 1, 15, 16, 17, 31, 32, 33, 63, 64, 65, 127, 128, 129,
+	1000, 4099, SIMD_QDOT_MAX - 1, SIMD_QDOT_MAX};
+#define NLENGTHS (sizeof(lengths) / sizeof(lengths[0]))
+
+static const char * isas[] = {"scalar", "sse2", "avx2", "avx512"};
+#define NISAS (sizeof(isas) / sizeof(isas[0]))
+
+/* Fixed net, with hidden values away from saturation */
+#define NI 1001
+#define NH 19
+#define NO 5
+#define NPATS 20
+
+/* Largest difference allowed between quantized and real outputs. Weights
+ * are rounded to 1/254 of the largest one in each neuron, and hidden values
+ * to 1/255 of their range, which is about 5e-3 at most for these nets. */
+#define QUANT_TOLERANCE 0.02
+
+/* Input layer longer than a qdot can be, with 1 byte pixels */
+#define LONG_NI (SIMD_QDOT_MAX + 4099)
+#define LONG_NH 4
+#define LONG_NO 3
+
+/* Plain dot product of bytes, wide enough for any length */
+static long long reference_qdot(const unsigned char * u, const signed char * q, int n){
+	int i = 0;
+	long long sum = 0;
+
+	for(i = 0; i < n; ++i)
+		sum += u[i] * q[i];
+
+	return sum;
+}
+
+/* Random bytes, and the largest pixels against the largest weights of
+ * both signs.
+ * @return Number of wrong dot products */
+static int check_qdot(unsigned char * u, signed char * q){
+	int l = 0, c = 0, i = 0, wrong = 0;
+
+	for(c = 0; c < 4; ++c) {
+		for(i = 0; i < SIMD_QDOT_MAX; ++i) {
+			u[i] = (c == 0) ? rand() & 0xff : 255;
+			q[i] = (c == 0) ? (signed char) (rand() % 255 - 127) :
+				(c == 1) ? 127 : (c == 2) ? -127 : -128;
+		}
+
+		for(l = 0; l < NLENGTHS; ++l)
+			if( (long long) simd.qdot(u, q, lengths[l]) != reference_qdot(u, q, lengths[l]) ) {
+				printerr("quant_check: Wrong %s qdot of length %d (case %d).\n",
+						simd.name, lengths[l], c);
+				++wrong;
+			}
+	}
+
+	return wrong;
+}
+
+/* Real pattern of a pixel bytes, as pattern_create() does, with its bias */
+static void bytes_pattern(pattern pat, const unsigned char * bytes, int ni, int bpp){
+	int j = 0, b = 0;
+
+	for(j = 0; j < ni; ++j)
+		for(pat[j] = 0, b = bpp - 1; b >= 0; --b)
+			pat[j] = pat[j] * 256 + bytes[j * bpp + b];
+	pat[ni] = 1;
+}
+
+/* Largest difference between the quantized and real outputs of a net for
+ * some patterns of random pixels.
+ * @return The difference, -1 on error */
+static double check_outputs(perceptron per, int bpp, int npats){
+	int p = 0, j = 0, k = 0, ni = per->n[0];
+	double diff = 0, max = -1;
+	qperceptron qper = NULL;
+	unsigned char * bytes = (unsigned char *) malloc ((size_t) ni * bpp);
+	real * pat = (real *) malloc ((ni + 1) * sizeof(real));
+	real * qout = (real *) malloc (per->n[2] * sizeof(real));
+
+	if( bytes == NULL || pat == NULL || qout == NULL || perceptron_quantize(per, bpp, &qper) == 0 )
+		goto end;
+
+	for(p = 0, max = 0; p < npats && max >= 0; ++p) {
+		for(j = 0; j < ni * bpp; ++j)
+			bytes[j] = rand() & 0xff;
+		bytes_pattern(pat, bytes, ni, bpp);
+
+		if( perceptron_feedforward(per, pat) == 0 ||
+				perceptron_feedforward_quant(qper, NULL, bytes, qout) == 0 ) {
+			max = -1;
+			break;
+		}
+
+		for(k = 0; k < per->n[2]; ++k)
+			if( (diff = fabs(qout[k] - per->ctx->net[2][k])) > max )
+				max = diff;
+	}
+
+end:
+	if( qper != NULL )
+		perceptron_quant_free(&qper);
+	free(bytes);
+	free(pat);
+	free(qout);
+
+	return max;
+}
+
+/* Net whose hidden weights, all of the same size, add up more than a 32
+ * bit accumulator holds for the brightest pattern. Each hidden neuron goes
+ * to the opposite sign if the sum overflows. */
+static int long_create(perceptron * per){
+	int j = 0, k = 0;
+
+	if( perceptron_create(per, LONG_NI, LONG_NH, LONG_NO) == 0 )
+		return 0;
+
+	for(k = 0; k < LONG_NH; ++k)
+		for(j = 0; j < LONG_NI + 1; ++j)
+			(*per)->w[0][k][j] = (k % 2) ? 1e-3 : -1e-3;
+
+	return 1;
+}
+
+/* Largest difference between the quantized and real outputs of the long
+ * net for the brightest pattern.
+ * @return The difference, -1 on error */
+static double check_long(perceptron per){
+	int k = 0;
+	double diff = 0, max = -1;
+	qperceptron qper = NULL;
+	unsigned char * bytes = (unsigned char *) malloc (LONG_NI);
+	real * pat = (real *) malloc ((LONG_NI + 1) * sizeof(real)), qout[LONG_NO];
+
+	if( bytes == NULL || pat == NULL || perceptron_quantize(per, 1, &qper) == 0 )
+		goto end;
+
+	memset(bytes, 255, LONG_NI);
+	bytes_pattern(pat, bytes, LONG_NI, 1);
+
+	if( perceptron_feedforward(per, pat) && perceptron_feedforward_quant(qper, NULL, bytes, qout) )
+		for(k = 0, max = 0; k < LONG_NO; ++k)
+			if( (diff = fabs(qout[k] - per->ctx->net[2][k])) > max )
+				max = diff;
+
+end:
+	if( qper != NULL )
+		perceptron_quant_free(&qper);
+	free(bytes);
+	free(pat);
+
+	return max;
+}
+
+/* Scales the weights of a new net for inputs up to 256^bpp, so hidden
+ * values are not saturated */
+static void fixed_scale(perceptron per, int bpp){
+	int j = 0, k = 0;
+	double scale = 1 / (pow(256, bpp) * sqrt(per->n[0]));
+
+	for(k = 0; k < per->n[1]; ++k)
+		for(j = 0; j < per->n[0]; ++j)
+			per->w[0][k][j] *= scale;
+}
+
+int main(int argc, char * argv[]){
+	int i = 0, bpp = 0, failed = 0, wrong = 0;
+	double diff = 0;
+	unsigned char * u = (unsigned char *) malloc (SIMD_QDOT_MAX);
+	signed char * q = (signed char *) malloc (SIMD_QDOT_MAX);
+	perceptron fixed[2] = {NULL, NULL}, wide = NULL;
+
+	srand(SEED);
+	for(bpp = 1; bpp <= 2 && !failed; ++bpp)
+		if( perceptron_create(&(fixed[bpp - 1]), NI, NH, NO) == 0 )
+			failed = 1;
+		else
+			fixed_scale(fixed[bpp - 1], bpp);
+
+	if( failed || u == NULL || q == NULL || long_create(&wide) == 0 ) {
+		printerr("quant_check: Couldn't create the nets.\n");
+		return 1;
+	}
+
+	for(i = 0; i < NISAS; ++i) {
+		setenv("CAVEBOY_SIMD", isas[i], 1);
+		if( strcmp(simd_init(), isas[i]) != 0 )
+			continue;  /* Not in this CPU */
+
+		srand(SEED);
+		wrong = check_qdot(u, q);
+		printerr("%s qdot: %d wrong of %d\n", simd.name, wrong, (int) (4 * NLENGTHS));
+		failed |= wrong != 0;
+
+		for(bpp = 1; bpp <= 2; ++bpp) {
+			diff = check_outputs(fixed[bpp - 1], bpp, NPATS);
+			printerr("%s quantized outputs (%d Bpp): max difference %g\n", simd.name, bpp, diff);
+			failed |= diff < 0 || diff > QUANT_TOLERANCE;
+		}
+
+		/* Brightest pattern through more inputs than a qdot can add up */
+		diff = check_long(wide);
+		printerr("%s quantized outputs (%d inputs): max difference %g\n", simd.name,
+				LONG_NI, diff);
+		failed |= diff < 0 || diff > QUANT_TOLERANCE;
+	}
+
+	for(bpp = 1; bpp <= 2; ++bpp)
+		perceptron_free(&(fixed[bpp - 1]));
+	perceptron_free(&wide);
+	free(u);
+	free(q);
+
+	printerr("quant_check: %s\n", failed ? "FAILED" : "OK");
+
+	return failed;
+}
@@ -0,0 +1,200 @@
+/*
+ *       Filename:  training_check.c
+ *    Description:  Checks that deterministic training is reproducible
+ *         Author:  Javier Santacruz <francisco.santacruz@estudiante.uam.es>
+ *
+ *   Trains a net as caveboy -d does, online and by batches, twice with the
+ *   same seed and threads. The printed weights and error log must be the
+ *   same byte for byte, and the weights the same bit for bit, also as with
+ *   one thread. Run by make check, with the trainers progress on stdout
+ *   and the results on stderr.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "perceptron.h"
+#include "threadpool.h"
+
+#ifndef printerr
+ #define printerr(...) fprintf(stderr, __VA_ARGS__)
+#endif
+
+/* Input layer large enough for online patterns to be split among threads.
+ * Odd lengths, so the vector kernels run their tails too. */
+#define NI 4095
+#define NH 19
+#define NO 3
+#define NPATS 30
+#define EPOCHS 2
+#define BATCH 7
+#define LRATE 0.01
+#define SEED 5
+#define MAX_THREADS 3
+
+/* Weights and error log of a training */
+typedef struct {
+	perceptron per;
+	char * weights, * errors;
+	size_t weights_len, errors_len;
+} training_t;
+
+/* Reads all of a stream */
+static char * read_all(FILE * f, size_t * len){
+	char * buf = NULL;
+	long size = 0;
+
+	fflush(f);
+	if( (size = ftell(f)) < 0 || (buf = (char *) malloc (size + 1)) == NULL )
+		return NULL;
+
+	rewind(f);
+	*len = fread(buf, 1, size, f);
+
+	return buf;
+}
+
+/* Patternset with random patterns in [-1,1], their bias and codes */
+static patternset patterns_create(void){
+	size_t p = 0, j = 0;
+	patternset pset = NULL;
+
+	if( (pset = (patternset) calloc (1, sizeof(patternset_t))) == NULL )
+		return NULL;
+
+	pset->npats = NPATS;
+	pset->npsets = pset->no = NO;
+	pset->ni = NI;
+	pset->input = (real **) malloc (NPATS * sizeof(real *));
+	pset->input_raw = (real *) malloc (NPATS * (NI + 1) * sizeof(real));
+	pset->codes = (size_t *) malloc (NPATS * sizeof(size_t));
+	if( pset->input == NULL || pset->input_raw == NULL || pset->codes == NULL )
+		return pset;
+
+	srand(SEED);
+	for(p = 0; p < NPATS; ++p) {
+		pset->input[p] = &(pset->input_raw[p * (NI + 1)]);
+		for(j = 0; j < NI; ++j)
+			pset->input[p][j] = (real) ((rand() % 512) / 256.0 - 1);
+		pset->input[p][NI] = 1;
+		pset->codes[p] = p % NO;
+	}
+
+	return pset;
+}
+
+static void patterns_free(patternset pset){
+	free(pset->input);
+	free(pset->input_raw);
+	free(pset->codes);
+	free(pset);
+}
+
+/* Trains a new net with the seed, online if batch is 1, as caveboy -d.
+ * @return 0 if unsuccessful, 1 otherwise */
+static int train(training_t * t, patternset pset, int nthreads, int batch){
+	int ok = 0;
+	threadpool pool = NULL;
+	FILE * weights = NULL, * errors = NULL;
+
+	memset(t, 0, sizeof(training_t));
+
+	srand(SEED);
+	if( perceptron_create(&(t->per), NI, NH, NO) == 0 || threadpool_create(&pool, nthreads, 0) == 0 ||
+			(weights = tmpfile()) == NULL || (errors = tmpfile()) == NULL )
+		goto end;
+
+	ok = (batch > 1) ?
+		perceptron_trainingprint_parallel(t->per, pset, LRATE, 0, EPOCHS, batch,
+				PERCEPTRON_SHARDS, pool, errors) :
+		perceptron_trainingprint_slices(t->per, pset, LRATE, 0, EPOCHS, pool, errors);
+
+	ok = ok && perceptron_print(t->per, weights) &&
+		(t->weights = read_all(weights, &(t->weights_len))) != NULL &&
+		(t->errors = read_all(errors, &(t->errors_len))) != NULL;
+
+end:
+	if( pool != NULL )
+		threadpool_free(&pool);
+	if( weights != NULL )
+		fclose(weights);
+	if( errors != NULL )
+		fclose(errors);
+
+	return ok;
+}
+
+static void training_free(training_t * t){
+	if( t->per != NULL )
+		perceptron_free(&(t->per));
+	free(t->weights);
+	free(t->errors);
+}
+
+/* Printed weights and error log are the same byte for byte */
+static int same_output(training_t * a, training_t * b){
+	return a->weights_len == b->weights_len && a->errors_len == b->errors_len &&
+		memcmp(a->weights, b->weights, a->weights_len) == 0 &&
+		memcmp(a->errors, b->errors, a->errors_len) == 0;
+}
+
+/* Weights are the same bit for bit */
+static int same_weights(perceptron a, perceptron b){
+	int i = 0, k = 0;
+
+	for(i = 0; i < 2; ++i)
+		for(k = 0; k < a->n[i + 1]; ++k)
+			if( memcmp(a->w[i][k], b->w[i][k], (a->n[i] + 1) * sizeof(real)) != 0 )
+				return 0;
+
+	return 1;
+}
+
+int main(int argc, char * argv[]){
+	int b = 0, t = 0, failed = 0, same = 0;
+	const int batches[2] = {1, BATCH};
+	training_t one, first, second;
+	patternset pset = NULL;
+
+	if( (pset = patterns_create()) == NULL || pset->codes == NULL ) {
+		printerr("training_check: Couldn't create the patterns.\n");
+		return 1;
+	}
+
+	for(b = 0; b < 2; ++b) {
+		if( train(&one, pset, 1, batches[b]) == 0 ) {
+			printerr("training_check: Couldn't train with 1 thread.\n");
+			failed = 1;
+		}
+
+		for(t = 1; t <= MAX_THREADS && !failed; ++t) {
+			if( train(&first, pset, t, batches[b]) == 0 || train(&second, pset, t, batches[b]) == 0 ) {
+				printerr("training_check: Couldn't train with %d threads.\n", t);
+				failed = 1;
+			} else {
+				/* Twice the same, and the same as one thread */
+				same = same_output(&first, &second) && same_weights(first.per, second.per);
+				printerr("%s with %d thread%s: %s", (batches[b] > 1) ? "batches" : "online", t,
+						(t > 1) ? "s" : "",
+						same ? "reproducible" : "NOT reproducible");
+				failed |= !same;
+
+				same = same_output(&first, &one) && same_weights(first.per, one.per);
+				printerr(", %s as 1 thread\n", same ? "same" : "NOT the same");
+				failed |= !same;
+			}
+
+			training_free(&first);
+			training_free(&second);
+		}
+
+		training_free(&one);
+	}
+
+	patterns_free(pset);
+
+	printerr("training_check: %s\n", failed ? "FAILED" : "OK");
+
+	return failed;
+}